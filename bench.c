@@ -0,0 +1,789 @@
+/* GInetFlow - Synthetic traffic benchmark
+ * LD_LIBRARY_PATH=. ./bench -f 100000 -n 10000000 -z 1.0 --json
+ *
+ * Copyright (C) 2017 Allied Telesis Ltd
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <glib.h>
+#include <glib/gprintf.h>
+#include "ginetflow.h"
+#include "ginethistogram.h"
+
+/* Frames are generated a batch at a time, outside the timed sections */
+#define BATCH_FRAMES    65536
+#define MAX_FRAME       192
+
+static gint flows = 100000;
+static gint64 packets = 0;
+static gdouble new_rate = 1.0;
+static gdouble zipf = 0.0;
+static gint ipv6_ratio = 0;
+static gint tcp_ratio = 50;
+static gint vlan_ratio = 0;
+static gint mpls_ratio = 0;
+static gint gre_ratio = 0;
+static gint frag_ratio = 0;
+static gint fin_ratio = 0;
+static gint admit = 0;
+static gint sample = 0;
+static gint top_k = 0;
+static gint cache_entries = G_INET_FLOW_DEFAULT_CACHE_ENTRIES;
+static gint64 lookups = 1000000;
+static gint expire_interval = 10000;
+static gint64 packet_gap_ns = 10000;
+static gint64 max_flows = 0;
+static gint64 new_max = 0;
+static gint seed = 1;
+static gboolean json = FALSE;
+static gchar *pcap = NULL;
+static gboolean latency = FALSE;
+static gboolean hugepages = FALSE;
+static gboolean cuckoo = FALSE;
+static gint numa_node = G_INET_FLOW_NUMA_ANY;
+
+static GOptionEntry entries[] = {
+    {"flows", 'f', 0, G_OPTION_ARG_INT, &flows, "Number of active flows", NULL},
+    {"packets", 'n', 0, G_OPTION_ARG_INT64, &packets,
+     "Number of packets to process (default 10M, or the whole capture)", NULL},
+    {"new", 'N', 0, G_OPTION_ARG_DOUBLE, &new_rate,
+     "Percentage of packets that start a new flow", NULL},
+    {"zipf", 'z', 0, G_OPTION_ARG_DOUBLE, &zipf, "Zipf exponent of flow popularity (0 = uniform)",
+     NULL},
+    {"ipv6", '6', 0, G_OPTION_ARG_INT, &ipv6_ratio, "Percentage of IPv6 flows", NULL},
+    {"tcp", 't', 0, G_OPTION_ARG_INT, &tcp_ratio,
+     "Percentage of TCP flows (with handshakes), the rest are UDP", NULL},
+    {"vlan", 0, 0, G_OPTION_ARG_INT, &vlan_ratio, "Percentage of VLAN tagged flows", NULL},
+    {"mpls", 0, 0, G_OPTION_ARG_INT, &mpls_ratio, "Percentage of MPLS labelled flows", NULL},
+    {"gre", 0, 0, G_OPTION_ARG_INT, &gre_ratio, "Percentage of GRE tunnelled flows", NULL},
+    {"frag", 0, 0, G_OPTION_ARG_INT, &frag_ratio,
+     "Percentage of UDP packets sent as two fragments", NULL},
+    {"fin", 0, 0, G_OPTION_ARG_INT, &fin_ratio,
+     "Percentage of TCP flows closed with FINs when they are replaced", NULL},
+    {"lookups", 'l', 0, G_OPTION_ARG_INT64, &lookups, "Number of g_inet_flow_lookup calls",
+     NULL},
+    {"expire", 'e', 0, G_OPTION_ARG_INT, &expire_interval,
+     "Packets between expiry runs (0 = never)", NULL},
+    {"gap", 'g', 0, G_OPTION_ARG_INT64, &packet_gap_ns,
+     "Nanoseconds of flow time between packets", NULL},
+    {"max", 'm', 0, G_OPTION_ARG_INT64, &max_flows, "Maximum flows in the table", NULL},
+    {"new-max", 0, 0, G_OPTION_ARG_INT64, &new_max,
+     "Maximum NEW flows, recycling the oldest beyond it", NULL},
+    {"seed", 's', 0, G_OPTION_ARG_INT, &seed, "Random seed", NULL},
+    {"pcap", 'p', 0, G_OPTION_ARG_STRING, &pcap,
+     "Replay frames from a pcap file instead of generating them", NULL},
+    {"latency", 'L', 0, G_OPTION_ARG_NONE, &latency,
+     "Measure per-packet latency while the table grows to --flows and then mass expires",
+     NULL},
+    {"admit", 'a', 0, G_OPTION_ARG_INT, &admit,
+     "Only create a flow on this packet of a tuple, or its first reply", NULL},
+    {"sample", 0, 0, G_OPTION_ARG_INT, &sample,
+     "Track one in this many flows, chosen by hash", NULL},
+    {"cache", 'c', 0, G_OPTION_ARG_INT, &cache_entries,
+     "Flow cache slots (0 = no cache)", NULL},
+    {"top", 'k', 0, G_OPTION_ARG_INT, &top_k,
+     "Track this many of the heaviest flows and sources", NULL},
+    {"cuckoo", 'C', 0, G_OPTION_ARG_NONE, &cuckoo,
+     "Use the cuckoo hash, sized for --max flows", NULL},
+    {"hugepages", 'H', 0, G_OPTION_ARG_NONE, &hugepages,
+     "Map the flow hash on huge pages", NULL},
+    {"numa", 0, 0, G_OPTION_ARG_INT, &numa_node,
+     "NUMA node for the flow hash (-2 = the node bench runs on)", NULL},
+    {"json", 'j', 0, G_OPTION_ARG_NONE, &json, "Print results as JSON", NULL},
+    {NULL}
+};
+
+typedef struct bench_batch {
+    guint8 *storage;
+    const guint8 *frame[BATCH_FRAMES];
+    guint32 length[BATCH_FRAMES];
+    guint64 ts[BATCH_FRAMES];
+    guint count;
+} bench_batch;
+
+typedef struct bench_state {
+    guint64 rng;
+    /* Flow id currently held by each popularity slot */
+    guint64 *slot_id;
+    /* Packets sent so far on the flow in each slot (TCP handshake) */
+    guint8 *progress;
+    guint64 next_id;
+    guint64 next_slot;
+    guint32 frag_id;
+    /* Flow time of the next packet */
+    guint64 ts;
+} bench_state;
+
+/* A pcap file loaded into memory */
+typedef struct bench_capture {
+    gchar *data;
+    guint32 *offset;
+    guint32 *length;
+    guint64 *ts;
+    guint count;
+    guint next;
+    /* Added to the timestamps on each pass so time keeps moving forward */
+    guint64 base;
+} bench_capture;
+
+static inline guint64 now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * (guint64) 1000000000 + now.tv_nsec;
+}
+
+/* xorshift64* - fast and identical on every platform */
+static inline guint64 bench_rand(bench_state * state)
+{
+    state->rng ^= state->rng >> 12;
+    state->rng ^= state->rng << 25;
+    state->rng ^= state->rng >> 27;
+    return state->rng * 0x2545F4914F6CDD1DULL;
+}
+
+static inline gdouble bench_uniform(bench_state * state)
+{
+    return ((bench_rand(state) >> 11) + 1) * (1.0 / 9007199254740993.0);
+}
+
+/* Stable per-flow attributes */
+static inline guint64 mix(guint64 x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static inline gboolean flow_has(guint64 id, int attribute, gint ratio)
+{
+    return ratio > 0 && (mix(id * 8 + attribute) % 100) < (guint64) ratio;
+}
+
+/* Rank by popularity, 0 being the most popular */
+static guint64 zipf_rank(bench_state * state, guint64 n)
+{
+    gdouble u = bench_uniform(state);
+    gdouble r;
+
+    if (zipf <= 0.0)
+        return bench_rand(state) % n;
+    if (fabs(zipf - 1.0) < 1e-9)
+        r = exp(u * log(n + 1.0)) - 1.0;
+    else
+        r = pow(u * (pow(n + 1.0, 1.0 - zipf) - 1.0) + 1.0, 1.0 / (1.0 - zipf)) - 1.0;
+    return MIN((guint64) r, n - 1);
+}
+
+static guint8 *put16(guint8 * p, guint16 v)
+{
+    v = htons(v);
+    memcpy(p, &v, 2);
+    return p + 2;
+}
+
+static guint8 *put32(guint8 * p, guint32 v)
+{
+    v = htonl(v);
+    memcpy(p, &v, 4);
+    return p + 4;
+}
+
+#define FRAG_NONE   0
+#define FRAG_FIRST  1
+#define FRAG_LAST   2
+
+static guint8 *build_ipv4(guint8 * p, guint32 src, guint32 dst, guint8 protocol,
+                          guint16 frag_off, guint16 id)
+{
+    *p++ = 0x45;
+    *p++ = 0;
+    p = put16(p, 0);
+    p = put16(p, id);
+    p = put16(p, frag_off);
+    *p++ = 64;
+    *p++ = protocol;
+    p = put16(p, 0);
+    p = put32(p, src);
+    p = put32(p, dst);
+    return p;
+}
+
+static guint8 *build_ipv6_addr(guint8 * p, guint32 net, guint64 host)
+{
+    p = put32(p, 0x20010db8);
+    p = put32(p, net);
+    p = put32(p, host >> 32);
+    p = put32(p, (guint32) host);
+    return p;
+}
+
+/* One frame of flow id into buf, returns the length */
+static guint build_frame(guint8 * buf, guint64 id, gboolean reverse, guint16 tcp_flags,
+                         int frag, guint32 frag_id)
+{
+    gboolean ipv6 = flow_has(id, 0, ipv6_ratio);
+    gboolean tcp = flow_has(id, 1, tcp_ratio);
+    guint8 protocol = tcp ? IPPROTO_TCP : IPPROTO_UDP;
+    guint16 sport = 1024 + mix(id) % 64512;
+    guint16 dport = tcp ? (id & 1 ? 443 : 80) : (id & 1 ? 53 : 4789);
+    guint32 src = 0x0a000000 | (id & 0xffffff);
+    guint32 dst = 0xac100000 | ((id >> 24) & 0xfffff);
+    guint8 *p = buf;
+
+    if (reverse) {
+        guint16 port = sport;
+        guint32 addr = src;
+        sport = dport;
+        dport = port;
+        src = dst;
+        dst = addr;
+    }
+
+    memcpy(p, "\x00\x01\x02\x03\x04\x05\x00\x0a\x0b\x0c\x0d\x0e", 12);
+    p += 12;
+    if (flow_has(id, 2, vlan_ratio)) {
+        p = put16(p, 0x8100);
+        p = put16(p, id & 0xfff);
+    }
+    if (flow_has(id, 3, mpls_ratio)) {
+        p = put16(p, 0x8847);
+        p = put32(p, ((id & 0xfffff) << 12) | 0x100 | 64);
+    } else {
+        p = put16(p, flow_has(id, 4, gre_ratio) || !ipv6 ? 0x0800 : 0x86DD);
+    }
+    if (flow_has(id, 4, gre_ratio)) {
+        p = build_ipv4(p, 0xc0000201, 0xc0000202, 47, 0, 0);
+        p = put16(p, 0);
+        p = put16(p, ipv6 ? 0x86DD : 0x0800);
+    }
+
+    if (ipv6) {
+        *p++ = 0x60;
+        *p++ = 0;
+        p = put16(p, 0);
+        p = put16(p, 0);
+        *p++ = frag ? 44 : protocol;
+        *p++ = 64;
+        p = build_ipv6_addr(p, reverse ? 1 : 0, reverse ? id >> 24 : id);
+        p = build_ipv6_addr(p, reverse ? 0 : 1, reverse ? id : id >> 24);
+        if (frag) {
+            *p++ = protocol;
+            *p++ = 0;
+            p = put16(p, frag == FRAG_FIRST ? 0x0001 : (185 << 3));
+            p = put32(p, frag_id);
+        }
+    } else {
+        guint16 frag_off = frag == FRAG_FIRST ? 0x2000 : frag == FRAG_LAST ? 185 : 0;
+        p = build_ipv4(p, src, dst, protocol, frag_off, (guint16) frag_id);
+    }
+
+    if (frag == FRAG_LAST) {
+        memset(p, 0, 16);
+        return (p + 16) - buf;
+    }
+    p = put16(p, sport);
+    p = put16(p, dport);
+    if (tcp) {
+        p = put32(p, 0);
+        p = put32(p, 0);
+        p = put16(p, 0x5000 | tcp_flags);
+        p = put16(p, 0xffff);
+        p = put32(p, 0);
+    } else {
+        p = put16(p, 8);
+        p = put16(p, 0);
+    }
+    return p - buf;
+}
+
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_ACK 0x10
+
+static void batch_add(bench_state * state, bench_batch * batch, guint64 id, gboolean reverse,
+                      guint16 flags, int frag, guint32 frag_id)
+{
+    guint8 *frame = batch->storage + (gsize) batch->count * MAX_FRAME;
+
+    batch->frame[batch->count] = frame;
+    batch->length[batch->count] = build_frame(frame, id, reverse, flags, frag, frag_id);
+    batch->ts[batch->count++] = state->ts / 1000;
+    state->ts += packet_gap_ns;
+}
+
+/* Fill a batch with the next packets of the workload */
+static void generate(bench_state * state, bench_batch * batch, gboolean churn,
+                     gboolean fragments)
+{
+    batch->count = 0;
+    /* Room for a teardown and the packet after it */
+    while (batch->count < BATCH_FRAMES - 4) {
+        guint64 slot;
+        guint64 id;
+        guint8 progress;
+
+        if (churn && new_rate > 0 && bench_uniform(state) * 100.0 < new_rate) {
+            slot = state->next_slot++ % flows;
+            id = state->slot_id[slot];
+            if (state->progress[slot] > 2 && flow_has(id, 1, tcp_ratio) &&
+                flow_has(id, 6, fin_ratio)) {
+                batch_add(state, batch, id, FALSE, TCP_FIN | TCP_ACK, FRAG_NONE, 0);
+                batch_add(state, batch, id, TRUE, TCP_FIN | TCP_ACK, FRAG_NONE, 0);
+                batch_add(state, batch, id, FALSE, TCP_ACK, FRAG_NONE, 0);
+            }
+            state->slot_id[slot] = state->next_id++;
+            state->progress[slot] = 0;
+        } else {
+            /* Scatter popularity over the slots so new flows are not all hot */
+            slot = (zipf_rank(state, flows) * 2654435761ULL) % flows;
+        }
+        id = state->slot_id[slot];
+        progress = state->progress[slot];
+        if (progress < 255)
+            state->progress[slot]++;
+
+        if (flow_has(id, 1, tcp_ratio)) {
+            /* SYN, SYN-ACK, ACK then data in both directions */
+            switch (progress) {
+            case 0:
+                batch_add(state, batch, id, FALSE, TCP_SYN, FRAG_NONE, 0);
+                break;
+            case 1:
+                batch_add(state, batch, id, TRUE, TCP_SYN | TCP_ACK, FRAG_NONE, 0);
+                break;
+            default:
+                batch_add(state, batch, id, progress & 1, TCP_ACK, FRAG_NONE, 0);
+                break;
+            }
+        } else if (fragments && flow_has(id + state->frag_id, 5, frag_ratio)) {
+            state->frag_id++;
+            batch_add(state, batch, id, progress & 1, 0, FRAG_FIRST, state->frag_id);
+            batch_add(state, batch, id, progress & 1, 0, FRAG_LAST, state->frag_id);
+        } else {
+            batch_add(state, batch, id, progress & 1, 0, FRAG_NONE, 0);
+        }
+    }
+}
+
+#define PCAP_MAGIC      0xa1b2c3d4
+#define PCAP_MAGIC_NS   0xa1b23c4d
+#define PCAP_ETHERNET   1
+
+static guint32 pcap_u32(const gchar * p, gboolean swap)
+{
+    guint32 v;
+    memcpy(&v, p, 4);
+    return swap ? GUINT32_SWAP_LE_BE(v) : v;
+}
+
+/* Classic pcap (not pcapng) of Ethernet frames, read without libpcap */
+static bench_capture *load_capture(const gchar * filename, GError ** error)
+{
+    bench_capture *capture;
+    gsize length;
+    gsize position = 24;
+    gboolean swap = FALSE;
+    gboolean nsec = FALSE;
+    guint32 magic;
+    guint size = 1024;
+
+    capture = g_new0(bench_capture, 1);
+    if (!g_file_get_contents(filename, &capture->data, &length, error)) {
+        g_free(capture);
+        return NULL;
+    }
+    magic = length >= 24 ? pcap_u32(capture->data, FALSE) : 0;
+    if (magic == GUINT32_SWAP_LE_BE(PCAP_MAGIC) || magic == GUINT32_SWAP_LE_BE(PCAP_MAGIC_NS)) {
+        swap = TRUE;
+        magic = GUINT32_SWAP_LE_BE(magic);
+    }
+    nsec = magic == PCAP_MAGIC_NS;
+    if ((magic != PCAP_MAGIC && !nsec) || pcap_u32(capture->data + 20, swap) != PCAP_ETHERNET) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                    "%s is not a pcap file of Ethernet frames", filename);
+        g_free(capture->data);
+        g_free(capture);
+        return NULL;
+    }
+
+    capture->offset = g_new(guint32, size);
+    capture->length = g_new(guint32, size);
+    capture->ts = g_new(guint64, size);
+    while (position + 16 <= length) {
+        guint32 caplen = pcap_u32(capture->data + position + 8, swap);
+
+        if (position + 16 + caplen > length)
+            break;
+        if (capture->count == size) {
+            size *= 2;
+            capture->offset = g_renew(guint32, capture->offset, size);
+            capture->length = g_renew(guint32, capture->length, size);
+            capture->ts = g_renew(guint64, capture->ts, size);
+        }
+        capture->offset[capture->count] = position + 16;
+        capture->length[capture->count] = caplen;
+        capture->ts[capture->count] =
+            pcap_u32(capture->data + position, swap) * (guint64) 1000000 +
+            pcap_u32(capture->data + position + 4, swap) / (nsec ? 1000 : 1);
+        capture->count++;
+        position += 16 + caplen;
+    }
+    if (!capture->count) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "%s has no frames", filename);
+        g_free(capture->offset);
+        g_free(capture->length);
+        g_free(capture->ts);
+        g_free(capture->data);
+        g_free(capture);
+        return NULL;
+    }
+    return capture;
+}
+
+static void free_capture(bench_capture * capture)
+{
+    g_free(capture->offset);
+    g_free(capture->length);
+    g_free(capture->ts);
+    g_free(capture->data);
+    g_free(capture);
+}
+
+/* Fill a batch with the next frames of the capture, wrapping at the end */
+static void replay(bench_capture * capture, bench_batch * batch)
+{
+    batch->count = 0;
+    while (batch->count < BATCH_FRAMES) {
+        guint i = capture->next;
+
+        batch->frame[batch->count] = (const guint8 *) capture->data + capture->offset[i];
+        batch->length[batch->count] = capture->length[i];
+        batch->ts[batch->count++] = capture->base + capture->ts[i];
+        if (++capture->next == capture->count) {
+            capture->next = 0;
+            capture->base += capture->ts[capture->count - 1] - capture->ts[0] + 1000000;
+        }
+    }
+}
+
+static void read_rss(guint64 * rss, guint64 * peak)
+{
+    gchar *status = NULL;
+    gchar *line;
+
+    *rss = *peak = 0;
+    if (!g_file_get_contents("/proc/self/status", &status, NULL, NULL))
+        return;
+    if ((line = strstr(status, "VmRSS:")))
+        *rss = g_ascii_strtoull(line + 6, NULL, 10);
+    if ((line = strstr(status, "VmHWM:")))
+        *peak = g_ascii_strtoull(line + 6, NULL, 10);
+    g_free(status);
+}
+
+static void print_latency(const gchar * name, GInetHistogram * histogram, gboolean last)
+{
+    if (json) {
+        g_printf("\"%s\": {\"count\": %" G_GUINT64_FORMAT ", \"p50\": %" G_GUINT64_FORMAT
+                 ", \"p99\": %" G_GUINT64_FORMAT ", \"p999\": %" G_GUINT64_FORMAT
+                 ", \"max\": %" G_GUINT64_FORMAT "}%s", name, histogram->count,
+                 g_inet_histogram_percentile(histogram, 50),
+                 g_inet_histogram_percentile(histogram, 99),
+                 g_inet_histogram_percentile(histogram, 99.9), histogram->max,
+                 last ? "}\n" : ", ");
+    } else {
+        g_printf("%-8s %10" G_GUINT64_FORMAT " p50 %8" G_GUINT64_FORMAT " ns, p99 %8"
+                 G_GUINT64_FORMAT " ns, p99.9 %10" G_GUINT64_FORMAT " ns, max %12"
+                 G_GUINT64_FORMAT " ns\n", name, histogram->count,
+                 g_inet_histogram_percentile(histogram, 50),
+                 g_inet_histogram_percentile(histogram, 99),
+                 g_inet_histogram_percentile(histogram, 99.9), histogram->max);
+    }
+}
+
+/* Time each packet while the table grows from empty to --flows new flows,
+ * then jump past the NEW timeout so they all expire together and time the
+ * packets that follow, including the expiry runs that land on them. */
+static void run_latency(GInetFlowTable * table, bench_state * state, bench_batch * batch)
+{
+    GInetHistogram *growth = g_inet_histogram_new();
+    GInetHistogram *storm = g_inet_histogram_new();
+    GInetHistogram *expiry = g_inet_histogram_new();
+    guint64 storm_packets = MIN(flows, 1000000);
+    guint64 count = 0;
+    guint64 since_expire = 0;
+    GInetFlow *flow;
+    guint i;
+
+    /* Every packet starts a flow, and growth spans 20s of flow time so
+     * nothing reaches the 30s NEW timeout before the storm */
+    new_rate = 100.0;
+    packet_gap_ns = MAX(1, 20000000000LL / flows);
+    while (count < (guint64) flows) {
+        generate(state, batch, TRUE, FALSE);
+        for (i = 0; i < batch->count && count < (guint64) flows; i++, count++) {
+            guint64 start = now_ns();
+            g_inet_flow_get_full(table, batch->frame[i], batch->length[i], 0, batch->ts[i],
+                                 TRUE, TRUE, TRUE, NULL, NULL);
+            g_inet_histogram_add(growth, now_ns() - start);
+        }
+    }
+
+    state->ts += (G_INET_FLOW_DEFAULT_NEW_TIMEOUT + 1) * 1000000000ULL;
+    count = 0;
+    while (count < storm_packets) {
+        generate(state, batch, TRUE, FALSE);
+        for (i = 0; i < batch->count && count < storm_packets; i++, count++) {
+            guint64 start = now_ns();
+            g_inet_flow_get_full(table, batch->frame[i], batch->length[i], 0, batch->ts[i],
+                                 TRUE, TRUE, TRUE, NULL, NULL);
+            if (expire_interval && ++since_expire >= (guint64) expire_interval) {
+                guint64 expire_start = now_ns();
+                since_expire = 0;
+                while ((flow = g_inet_flow_expire(table, batch->ts[i])))
+                    g_object_unref(flow);
+                g_inet_histogram_add(expiry, now_ns() - expire_start);
+            }
+            g_inet_histogram_add(storm, now_ns() - start);
+        }
+    }
+
+    if (json)
+        g_printf("{");
+    print_latency("growth", growth, FALSE);
+    print_latency("storm", storm, FALSE);
+    print_latency("expiry", expiry, TRUE);
+    g_inet_histogram_free(growth);
+    g_inet_histogram_free(storm);
+    g_inet_histogram_free(expiry);
+}
+
+int main(int argc, char **argv)
+{
+    GError *error = NULL;
+    GOptionContext *context;
+    GInetFlowTable *table;
+    bench_batch *batch;
+    bench_state state = { 0 };
+    bench_capture *capture = NULL;
+    GInetTuple *tuples;
+    GInetFlow *flow;
+    guint64 processed = 0;
+    guint64 found = 0;
+    guint64 expired = 0;
+    guint64 since_expire = 0;
+    guint64 get_ns = 0;
+    guint64 expire_ns = 0;
+    guint64 parse_ns = 0;
+    guint64 lookup_ns = 0;
+    guint64 looked_up = 0;
+    guint64 ts = 0;
+    GInetFlowTableStats stats;
+    GInetFlowTableMemory memory;
+    guint64 size, created, rss, peak, cache_lookups;
+    guint64 i;
+
+    context = g_option_context_new("- Synthetic traffic benchmark of libginetflow");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_print("%s", g_option_context_get_help(context, FALSE, NULL));
+        g_print("ERROR: %s\n", error->message);
+        exit(1);
+    }
+    if (flows < 1 || packets < 0) {
+        g_print("%s", g_option_context_get_help(context, FALSE, NULL));
+        g_print("ERROR: Require at least one flow\n");
+        exit(1);
+    }
+    if (pcap) {
+        capture = load_capture(pcap, &error);
+        if (!capture) {
+            g_print("ERROR: %s\n", error->message);
+            exit(1);
+        }
+        if (!packets)
+            packets = capture->count;
+    } else if (!packets) {
+        packets = 10000000;
+    }
+
+    state.rng = mix(seed) | 1;
+    state.slot_id = g_new(guint64, flows);
+    state.progress = g_new0(guint8, flows);
+    for (i = 0; i < (guint64) flows; i++)
+        state.slot_id[i] = i;
+    state.next_id = flows;
+    /* Flow time starts well away from 0, which means "use the host clock" */
+    state.ts = 1000000000;
+    batch = g_new0(bench_batch, 1);
+    batch->storage = g_malloc((gsize) BATCH_FRAMES * MAX_FRAME);
+    tuples = g_new0(GInetTuple, BATCH_FRAMES);
+
+    table = g_inet_flow_table_new_full(cuckoo ? max_flows : 0, max_flows, 0, 0,
+                                       (hugepages ? G_INET_FLOW_TABLE_HUGEPAGES : 0) |
+                                       (cuckoo ? G_INET_FLOW_TABLE_CUCKOO : 0));
+    g_inet_flow_table_admission_set(table, admit, 0);
+    g_inet_flow_table_state_max_set(table, FLOW_NEW, new_max);
+    g_inet_flow_table_sample_set(table, sample);
+    g_inet_flow_table_top_set(table, top_k, 0, G_INET_FLOW_TOP_PACKETS);
+    g_inet_flow_table_cache_set(table, cache_entries);
+    if (numa_node != G_INET_FLOW_NUMA_ANY && !g_inet_flow_table_numa_node_set(table, numa_node))
+        g_printerr("NUMA node %d not available, using default placement\n", numa_node);
+
+    if (latency) {
+        run_latency(table, &state, batch);
+        goto done;
+    }
+
+    while (processed < (guint64) packets) {
+        if (capture)
+            replay(capture, batch);
+        else
+            generate(&state, batch, TRUE, TRUE);
+        i = 0;
+        while (i < batch->count && processed < (guint64) packets) {
+            guint64 run = MIN(batch->count - i, (guint64) packets - processed);
+            guint64 start;
+            guint64 end;
+
+            /* Time the packets between expiry calls as one run, as a pair of
+             * clock reads per packet would be a fair part of what is measured */
+            if (expire_interval)
+                run = MIN(run, (guint64) expire_interval - since_expire);
+            start = now_ns();
+            for (end = i + run; i < end; i++)
+                g_inet_flow_get_full(table, batch->frame[i], batch->length[i], 0, batch->ts[i],
+                                     TRUE, TRUE, TRUE, NULL, NULL);
+            get_ns += now_ns() - start;
+            processed += run;
+            ts = batch->ts[i - 1];
+
+            if (expire_interval && (since_expire += run) >= (guint64) expire_interval) {
+                since_expire = 0;
+                start = now_ns();
+                while ((flow = g_inet_flow_expire(table, ts))) {
+                    g_object_unref(flow);
+                    expired++;
+                }
+                expire_ns += now_ns() - start;
+            }
+        }
+    }
+
+    while (looked_up < (guint64) lookups) {
+        guint64 start;
+        guint count;
+
+        if (capture)
+            replay(capture, batch);
+        else
+            generate(&state, batch, FALSE, FALSE);
+        count = MIN(batch->count, lookups - looked_up);
+        start = now_ns();
+        for (i = 0; i < count; i++)
+            g_inet_flow_parse(batch->frame[i], batch->length[i], NULL, &tuples[i], TRUE);
+        parse_ns += now_ns() - start;
+        start = now_ns();
+        for (i = 0; i < count; i++) {
+            if (g_inet_flow_lookup(table, &tuples[i]))
+                found++;
+        }
+        lookup_ns += now_ns() - start;
+        looked_up += count;
+    }
+
+    g_object_get(table, "size", &size, "misses", &created, NULL);
+    g_inet_flow_table_stats_get(table, &stats);
+    read_rss(&rss, &peak);
+    cache_lookups = stats.cache_hits + stats.cache_misses;
+    g_inet_flow_table_memory_get(table, &memory);
+
+    if (json) {
+        g_printf("{\"packets\": %" G_GUINT64_FORMAT ", \"flows\": %d,"
+                 " \"seconds\": %.6f, \"mpps\": %.3f, \"ns_per_packet\": %.1f,"
+                 " \"created\": %" G_GUINT64_FORMAT ", \"unadmitted\": %" G_GUINT64_FORMAT ","
+                 " \"recycled\": %" G_GUINT64_FORMAT ", \"unsampled\": %" G_GUINT64_FORMAT ","
+                 " \"cache_hit_rate\": %.3f,"
+                 " \"size\": %" G_GUINT64_FORMAT ", \"expired\": %" G_GUINT64_FORMAT ", \"expire_ns_per_flow\": %.1f,"
+                 " \"lookups\": %" G_GUINT64_FORMAT ", \"lookup_hits\": %" G_GUINT64_FORMAT ","
+                 " \"ns_per_parse\": %.1f, \"ns_per_lookup\": %.1f,"
+                 " \"hash_bytes_per_flow\": %.1f, \"chain_max\": %" G_GUINT64_FORMAT ","
+                 " \"rss_kb\": %" G_GUINT64_FORMAT ", \"peak_rss_kb\": %" G_GUINT64_FORMAT "}\n",
+                 processed, flows, get_ns / 1e9,
+                 get_ns ? processed * 1e3 / get_ns : 0.0,
+                 processed ? (gdouble) get_ns / processed : 0.0,
+                 created, stats.unadmitted, stats.recycled[FLOW_NEW], stats.unsampled,
+                 cache_lookups ? (gdouble) stats.cache_hits / cache_lookups : 0.0, size, expired,
+                 expired ? (gdouble) expire_ns / expired : 0.0, looked_up, found, looked_up ? (gdouble) parse_ns / looked_up : 0.0,
+                 looked_up ? (gdouble) lookup_ns / looked_up : 0.0,
+                 size ? (gdouble) memory.hash / size : 0.0, stats.chain_max, rss, peak);
+    } else {
+        g_printf("Packets: %" G_GUINT64_FORMAT " in %.3fs, %.3f Mpps, %.1f ns/packet\n",
+                 processed, get_ns / 1e9, get_ns ? processed * 1e3 / get_ns : 0.0,
+                 processed ? (gdouble) get_ns / processed : 0.0);
+        g_printf("Flows:   %" G_GUINT64_FORMAT " created, %" G_GUINT64_FORMAT " in table, %"
+                 G_GUINT64_FORMAT " expired (%.1f ns/flow)\n", created, size, expired,
+                 expired ? (gdouble) expire_ns / expired : 0.0);
+        if (new_max)
+            g_printf("Recycle: %" G_GUINT64_FORMAT " NEW flows\n", stats.recycled[FLOW_NEW]);
+        if (cache_lookups)
+            g_printf("Cache:   %.1f%% of %" G_GUINT64_FORMAT " lookups hit\n",
+                     100.0 * stats.cache_hits / cache_lookups, cache_lookups);
+        if (top_k) {
+            GInetFlowTop top;
+            GInetFlowTopHost host;
+
+            if (g_inet_flow_table_top_flows(table, &top, 1) &&
+                g_inet_flow_table_top_hosts(table, &host, 1))
+                g_printf("Top:     flow %" G_GUINT64_FORMAT " packets, source %"
+                         G_GUINT64_FORMAT " packets\n", top.packets, host.packets);
+        }
+        if (sample > 1)
+            g_printf("Sample:  1 in %" G_GUINT64_FORMAT " flows, %" G_GUINT64_FORMAT
+                     " packets skipped\n", stats.sample_rate, stats.unsampled);
+        if (admit > 1)
+            g_printf("Admit:   %" G_GUINT64_FORMAT " packets without a flow\n",
+                     stats.unadmitted);
+        g_printf("Lookups: %" G_GUINT64_FORMAT " (%" G_GUINT64_FORMAT
+                 " found), %.1f ns/parse, %.1f ns/lookup\n", looked_up, found,
+                 looked_up ? (gdouble) parse_ns / looked_up : 0.0,
+                 looked_up ? (gdouble) lookup_ns / looked_up : 0.0);
+        g_printf("Hash:    %.1f bytes/flow, longest chain %" G_GUINT64_FORMAT "\n",
+                 size ? (gdouble) memory.hash / size : 0.0, stats.chain_max);
+        g_printf("Memory:  %" G_GUINT64_FORMAT " kB RSS, %" G_GUINT64_FORMAT " kB peak\n",
+                 rss, peak);
+    }
+
+  done:
+    g_object_unref(table);
+    if (capture)
+        free_capture(capture);
+    g_free(tuples);
+    g_free(batch->storage);
+    g_free(batch);
+    g_free(state.slot_id);
+    g_free(state.progress);
+    g_option_context_free(context);
+    return 0;
+}
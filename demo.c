@@ -1,5 +1,6 @@
 /* GInetFlow - IP Flow Manager demo code
  * LD_LIBRARY_PATH=. ./demo -p test.pcap -w 8 -d
+ * LD_LIBRARY_PATH=. ./demo -p test.pcap -r 1000
  *
  * Copyright (C) 2017 ECLB Ltd
  *
@@ -34,6 +35,7 @@ static gint nworkers = 1;
 static gboolean dpi = FALSE;
 static gchar *filename = NULL;
 static gboolean verbose = FALSE;
+static gint replay = 0;
 
 static GThreadPool *workers[MAX_WORKERS];
 static gint processed[MAX_WORKERS] = { };
@@ -231,12 +233,173 @@ static void clean_flow(GInetFlow * flow, gpointer data)
     g_object_unref(flow);
 }
 
+/* A frame preloaded for replay */
+typedef struct Frame {
+    gsize offset;
+    uint32_t length;
+    uint64_t timestamp;
+    /* Offset of the addresses to rewrite, 0 if none */
+    uint16_t address;
+    uint8_t address_length;
+} Frame;
+
+/* Find the addresses of the outer IP header, skipping VLAN tags */
+static void find_address(const uint8_t * data, Frame * frame)
+{
+    uint32_t offset = 12;
+    uint16_t type;
+
+    while (offset + 2 <= frame->length) {
+        type = (data[offset] << 8) | data[offset + 1];
+        offset += 2;
+        if (type == 0x8100 || type == 0x88a8) {
+            offset += 2;
+        } else if (type == 0x0800 && offset + 20 <= frame->length) {
+            frame->address = offset + 12;
+            frame->address_length = 4;
+            return;
+        } else if (type == 0x86DD && offset + 40 <= frame->length) {
+            frame->address = offset + 8;
+            frame->address_length = 16;
+            return;
+        } else {
+            return;
+        }
+    }
+}
+
+/* Give each pass its own addresses. The same change is made to source and
+ * destination so both directions of a flow still match each other. */
+static void rewrite_addresses(uint8_t * data, Frame * frames, guint count, gint from, gint to)
+{
+    uint16_t change = from ^ to;
+    guint i;
+
+    for (i = 0; i < count; i++) {
+        uint8_t *address = data + frames[i].offset + frames[i].address;
+        uint8_t length = frames[i].address_length;
+
+        if (!frames[i].address)
+            continue;
+        address[length - 3] ^= change >> 8;
+        address[length - 2] ^= change & 0xff;
+        address[2 * length - 3] ^= change >> 8;
+        address[2 * length - 2] ^= change & 0xff;
+    }
+}
+
+static guint64 peak_rss(void)
+{
+    gchar *status = NULL;
+    gchar *line;
+    guint64 peak = 0;
+
+    if (g_file_get_contents("/proc/self/status", &status, NULL, NULL)) {
+        if ((line = strstr(status, "VmHWM:")))
+            peak = g_ascii_strtoull(line + 6, NULL, 10);
+        g_free(status);
+    }
+    return peak;
+}
+
+/* Replay the capture from memory with flow time taken from the capture,
+ * timing only the library */
+static void replay_pcap(const char *filename, gint passes)
+{
+    char error_pcap[PCAP_ERRBUF_SIZE];
+    pcap_t *pcap;
+    const uint8_t *frame;
+    struct pcap_pkthdr *hdr;
+    GByteArray *data;
+    GArray *loaded;
+    GInetFlow *flow;
+    guint64 span, offset, last_expiry = 0;
+    guint64 expired = 0, memory = 0, peak_memory = 0;
+    guint64 size, misses, start, elapsed = 0;
+    gint pass;
+    guint i;
+
+    pcap = pcap_open_offline(filename, error_pcap);
+    if (pcap == NULL) {
+        g_printf("Invalid pcap file: %s\n", filename);
+        return;
+    }
+
+    g_printf("Loading \"%s\"\n", filename);
+    data = g_byte_array_new();
+    loaded = g_array_new(FALSE, FALSE, sizeof(Frame));
+    while (pcap_next_ex(pcap, &hdr, &frame) == 1) {
+        Frame f = { 0 };
+        f.offset = data->len;
+        f.length = hdr->caplen;
+        f.timestamp = hdr->ts.tv_sec * (uint64_t) 1000000 + hdr->ts.tv_usec;
+        find_address(frame, &f);
+        g_byte_array_append(data, frame, hdr->caplen);
+        g_array_append_val(loaded, f);
+    }
+    pcap_close(pcap);
+    if (loaded->len == 0) {
+        g_printf("No frames in %s\n", filename);
+        g_array_free(loaded, TRUE);
+        g_byte_array_free(data, TRUE);
+        return;
+    }
+
+    /* Each pass starts a second after the previous one ended */
+    span = g_array_index(loaded, Frame, loaded->len - 1).timestamp -
+        g_array_index(loaded, Frame, 0).timestamp + 1000000;
+    g_printf("Replaying %u frames %d times\n", loaded->len, passes);
+    for (pass = 0, offset = 0; pass < passes; pass++, offset += span) {
+        if (pass)
+            rewrite_addresses(data->data, (Frame *) loaded->data, loaded->len, pass - 1, pass);
+        start = g_get_monotonic_time();
+        for (i = 0; i < loaded->len; i++) {
+            Frame *f = &g_array_index(loaded, Frame, i);
+            uint64_t timestamp = f->timestamp + offset;
+
+            g_inet_flow_get_full(table, data->data + f->offset, f->length, 0, timestamp,
+                                 TRUE, TRUE, TRUE, NULL, NULL);
+            /* Bulk expiry once a second of capture time */
+            if (timestamp >= last_expiry + 1000000) {
+                last_expiry = timestamp;
+                while ((flow = g_inet_flow_expire(table, timestamp)) != NULL) {
+                    clean_flow(flow, NULL);
+                    expired++;
+                }
+                elapsed += g_get_monotonic_time() - start;
+                g_object_get(table, "memory", &memory, NULL);
+                peak_memory = MAX(peak_memory, memory);
+                start = g_get_monotonic_time();
+            }
+        }
+        elapsed += g_get_monotonic_time() - start;
+    }
+    /* Leave the capture as it was loaded */
+    rewrite_addresses(data->data, (Frame *) loaded->data, loaded->len, passes - 1, 0);
+
+    g_object_get(table, "size", &size, "misses", &misses, "memory", &memory, NULL);
+    peak_memory = MAX(peak_memory, memory);
+    g_printf("\nReplayed %" G_GUINT64_FORMAT " frames in %.3fs (library time)\n",
+             (guint64) loaded->len * passes, elapsed / 1e6);
+    g_printf("%.0f packets/s, %.0f flows/s\n",
+             elapsed ? loaded->len * (gdouble) passes * 1e6 / elapsed : 0.0,
+             elapsed ? misses * 1e6 / elapsed : 0.0);
+    g_printf("%" G_GUINT64_FORMAT " flows created, %" G_GUINT64_FORMAT " expired, %"
+             G_GUINT64_FORMAT " remaining\n", misses, expired, size);
+    g_printf("Peak table memory %" G_GUINT64_FORMAT " kB, peak RSS %" G_GUINT64_FORMAT
+             " kB\n", peak_memory / 1024, peak_rss());
+    g_array_free(loaded, TRUE);
+    g_byte_array_free(data, TRUE);
+}
+
 static GOptionEntry entries[] = {
     {"pcap", 'p', 0, G_OPTION_ARG_STRING, &filename, "Pcap file to use", NULL},
     {"workers", 'w', 0, G_OPTION_ARG_INT, &nworkers, "Number of worker threads", NULL},
 #if defined(LIBNDPI_OLD_API) || defined(LIBNDPI_NEW_API) || defined(LIBNDPI_NEWEST_API)
     {"dpi", 'd', 0, G_OPTION_ARG_NONE, &dpi, "Analyse frames using DPI", NULL},
 #endif
+    {"replay", 'r', 0, G_OPTION_ARG_INT, &replay,
+     "Replay the pcap from memory this many times and report throughput", NULL},
     {"verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose, "Be verbose", NULL},
     {NULL}
 };
@@ -286,7 +449,10 @@ int main(int argc, char **argv)
     }
 
     table = g_inet_flow_table_new();
-    process_pcap(filename);
+    if (replay > 0)
+        replay_pcap(filename, replay);
+    else
+        process_pcap(filename);
 
     for (i = 0; i < nworkers; i++) {
         for (j = 0; j < 10; j++) {
@@ -307,9 +473,11 @@ int main(int argc, char **argv)
     for (i = 0; i < nworkers; i++)
         g_printf(" %d:%d", i, processed[i]);
     g_printf("\n");
-    g_printf
-        ("Hash    lip              uip            prot lport uport  pkts  state  app\n");
-    g_inet_flow_foreach(table, (GIFFunc) print_flow, NULL);
+    if (!replay || verbose) {
+        g_printf
+            ("Hash    lip              uip            prot lport uport  pkts  state  app\n");
+        g_inet_flow_foreach(table, (GIFFunc) print_flow, NULL);
+    }
     g_inet_flow_foreach(table, (GIFFunc) clean_flow, NULL);
     g_object_unref(table);
 #if defined(LIBNDPI_NEWEST_API)
@@ -0,0 +1,113 @@
+/* GInetFlow - Flow Admission Filter
+ *
+ * Copyright (C) 2017 Allied Telesis Ltd
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "ginetfilter.h"
+
+/* Filter of cells (rounded up to a power of two) per generation that
+ * admits a tuple on its threshold'th packet within window microseconds */
+GInetFilter *g_inet_filter_new(guint cells, guint threshold, guint64 window)
+{
+    GInetFilter *filter = g_malloc0(sizeof(GInetFilter));
+    guint32 size = 64;
+
+    while (size < cells && size < (1U << 31))
+        size <<= 1;
+    filter->cells[0] = g_malloc0(size);
+    filter->cells[1] = g_malloc0(size);
+    filter->mask = size - 1;
+    filter->threshold = CLAMP(threshold, 1, G_INET_FILTER_COUNT_MAX);
+    filter->window = window;
+    return filter;
+}
+
+void g_inet_filter_free(GInetFilter * filter)
+{
+    if (filter) {
+        g_free(filter->cells[0]);
+        g_free(filter->cells[1]);
+        g_free(filter);
+    }
+}
+
+/* Start a new generation once the current one covers a window or is a
+ * quarter written */
+static void filter_age(GInetFilter * filter, guint64 timestamp)
+{
+    guint8 *oldest;
+
+    if (!filter->since || timestamp < filter->since) {
+        filter->since = timestamp;
+        return;
+    }
+    if (timestamp - filter->since < filter->window && filter->written < (filter->mask + 1) / 4)
+        return;
+    oldest = filter->cells[1];
+    filter->cells[1] = filter->cells[0];
+    filter->cells[0] = oldest;
+    memset(oldest, 0, filter->mask + 1);
+    /* Nothing seen for two windows is forgotten entirely */
+    if (timestamp - filter->since >= 2 * filter->window)
+        memset(filter->cells[1], 0, filter->mask + 1);
+    filter->since = timestamp;
+    filter->written = 0;
+}
+
+static inline guint filter_count(GInetFilter * filter, guint32 index)
+{
+    return (filter->cells[0][index] & G_INET_FILTER_COUNT_MAX) +
+        (filter->cells[1][index] & G_INET_FILTER_COUNT_MAX);
+}
+
+static inline void filter_add(guint8 * cell, guint8 direction)
+{
+    if ((*cell & G_INET_FILTER_COUNT_MAX) < G_INET_FILTER_COUNT_MAX)
+        (*cell)++;
+    *cell |= direction;
+}
+
+/* Record a packet of the tuple with this (direction independent) hash.
+ * TRUE once it has reached the threshold or been seen in the direction
+ * opposite to reverse, when the caller should create its flow. */
+gboolean g_inet_filter_admit(GInetFilter * filter, guint32 hash, gboolean reverse,
+                             guint64 timestamp)
+{
+    guint32 a = hash & filter->mask;
+    guint32 b = ((hash >> 16 | hash << 16) * 0x9E3779B1U) & filter->mask;
+    guint8 direction = reverse ? G_INET_FILTER_REVERSE : G_INET_FILTER_FORWARD;
+    guint8 other = reverse ? G_INET_FILTER_FORWARD : G_INET_FILTER_REVERSE;
+    guint8 seen;
+
+    filter_age(filter, timestamp);
+    seen = (filter->cells[0][a] | filter->cells[1][a]) &
+        (filter->cells[0][b] | filter->cells[1][b]);
+    if ((seen & other) || MIN(filter_count(filter, a), filter_count(filter, b)) + 1 >=
+        filter->threshold)
+        return TRUE;
+    filter_add(&filter->cells[0][a], direction);
+    filter_add(&filter->cells[0][b], direction);
+    filter->written += 2;
+    return FALSE;
+}
+
+guint64 g_inet_filter_memory(GInetFilter * filter)
+{
+    return sizeof(GInetFilter) + 2 * ((guint64) filter->mask + 1);
+}
@@ -0,0 +1,51 @@
+/* GInetFlow - Flow Admission Filter
+ *
+ * Copyright (C) 2017 Allied Telesis Ltd
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef __G_INET_FILTER_H__
+#define __G_INET_FILTER_H__
+
+#include <glib.h>
+
+/* Counting Bloom filter of tuples not yet given a flow. Each tuple hashes
+ * to two one-byte cells holding a saturating packet count and a bit for
+ * each direction; the smaller count and the common bits are its estimate.
+ * Two generations of cells each cover a window of time, so a tuple is
+ * remembered for between one and two windows without per-entry expiry.
+ * A generation also ends once it has had a quarter of its cells written,
+ * so a flood of new tuples shortens the memory rather than filling it. */
+#define G_INET_FILTER_COUNT_MAX     0x3f
+#define G_INET_FILTER_FORWARD       0x40
+#define G_INET_FILTER_REVERSE       0x80
+
+typedef struct _GInetFilter {
+    /* Current and previous generation */
+    guint8 *cells[2];
+    guint32 mask;
+    guint threshold;
+    guint64 window;
+    guint64 since;
+    /* Cell writes in the current generation */
+    guint32 written;
+} GInetFilter;
+
+GInetFilter *g_inet_filter_new(guint cells, guint threshold, guint64 window);
+void g_inet_filter_free(GInetFilter * filter);
+gboolean g_inet_filter_admit(GInetFilter * filter, guint32 hash, gboolean reverse,
+                             guint64 timestamp);
+guint64 g_inet_filter_memory(GInetFilter * filter);
+
+#endif                          /* __G_INET_FILTER_H__ */
@@ -17,6 +17,9 @@
  */
 #include <stdlib.h>
 #include <stdio.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 #include <string.h>
 #include <sys/time.h>
 #include <arpa/inet.h>
@@ -25,6 +28,12 @@
 #include <gio/gio.h>
 #include "ginetflow.h"
 #include "ginettuple.h"
+#include "ginethistogram.h"
+#include "ginethash.h"
+#include "ginetfilter.h"
+#include "ginetlimit.h"
+#include "ginetsketch.h"
+#include "ginetprobes.h"
 
 #include <netinet/in.h>
 
@@ -38,6 +47,7 @@
 struct _GInetFlow {
     GObject parent;
     struct _GInetFlowTable *table;
+    GInetHashNode node;
     GList list;
     guint64 timestamp;
     guint64 lifetime;
@@ -47,7 +57,17 @@ struct _GInetFlow {
     guint32 hash;
     guint16 flags;
     guint8 direction;
+    /* TCP connection state and the TCP_SEEN_ flags of each end, indexed by
+     * direction (client first) */
+    guint8 tcp_state;
+    guint8 tcp_seen[2];
+    /* Already counted as expired */
+    gboolean expired;
+    /* Dropped for a state quota and waiting for g_inet_flow_expire */
+    gboolean recycled;
     guint16 server_port;
+    /* The tuple swapped bit of packets going to the server */
+    gboolean server_swapped;
     guint32 server_ip[4];
     GInetTuple tuple;
     gpointer context;
@@ -62,25 +82,131 @@ static int lifetime_values[] = {
     G_INET_FLOW_DEFAULT_CLOSED_TIMEOUT,
     G_INET_FLOW_DEFAULT_NEW_TIMEOUT,
     G_INET_FLOW_DEFAULT_OPEN_TIMEOUT,
+    G_INET_FLOW_DEFAULT_HALF_CLOSED_TIMEOUT,
+    G_INET_FLOW_DEFAULT_TIME_WAIT_TIMEOUT,
 };
 
 #define LIFETIME_COUNT (sizeof(lifetime_values) / sizeof(lifetime_values[0]))
 
+/* Flow cache slot, the table hash saving a look at the flow on a miss */
+typedef struct flow_cache_t {
+    guint32 hash;
+    GInetFlow *flow;
+} flow_cache_t;
+
 /** GInetFlowTable */
 struct _GInetFlowTable {
     GObject parent;
-    GHashTable *table;
+    GInetHash *flows;
     GQueue *expire_queue[LIFETIME_COUNT];
+    /* Flows dropped for a state quota, first out of g_inet_flow_expire */
+    GQueue *recycled;
     GInetFragList *frag_info_list;
     guint64 hits;
     guint64 misses;
     guint64 max;
+    guint64 memory_max;
+    guint64 capacity;
+    /* Flows in each state and the quota for each (0 for none) */
+    guint64 state_count[G_INET_FLOW_STATES];
+    guint64 state_max[G_INET_FLOW_STATES];
+    GInetFlowTableFlags flags;
+    /* Flow time the hash became sparse, 0 while it is not */
+    guint64 sparse_since;
+    /* Tuples waiting to be seen enough to get a flow, NULL to admit all */
+    GInetFilter *admission;
+    /* New flows each source address may create, NULL for no limit */
+    GInetLimit *source_limit;
+    /* Only flows whose hash falls in the first 1/sample_rate are tracked */
+    guint sample_rate;
+    guint32 sample_max;
+    /* Direct-mapped cache of recently used flows, checked before the hash */
+    flow_cache_t *cache;
+    guint32 cache_mask;
+    /* Heaviest flows and sources, NULL when not tracked */
+    GInetSketch *top_flows;
+    GInetSketch *top_hosts;
+    /* Latency sampling - one in every latency_rate calls is timed */
+    guint latency_rate;
+    guint latency_count;
+    GInetHistogram *latency[G_INET_FLOW_STAGE_COUNT];
+    /* Per-thread counter blocks, summed by g_inet_flow_table_stats_get */
+    guint id;
+    GMutex stats_lock;
+    GList *stats;
+    gint nstats;
 };
 struct _GInetFlowTableClass {
     GObjectClass parent;
 };
 G_DEFINE_TYPE(GInetFlowTable, g_inet_flow_table, G_TYPE_OBJECT);
 
+/* Counters owned by one thread, so threads sharing a table never write
+ * to the same cache line */
+typedef struct flow_stats_t {
+    guint64 created;
+    guint64 create_failed;
+    guint64 expired[G_INET_FLOW_STATES];
+    guint64 recycled[G_INET_FLOW_STATES];
+    guint64 refused[G_INET_FLOW_STATES];
+    guint64 parse_failed[G_INET_FLOW_PARSE_FAILURE_COUNT];
+    guint64 tunnels;
+    guint64 unadmitted;
+    guint64 throttled;
+    guint64 throttled_sources;
+    guint64 unsampled;
+    guint64 cache_hits;
+    guint64 cache_misses;
+    /* The owning thread's flow_stats_cache */
+    gpointer owner;
+} __attribute__ ((aligned(64))) flow_stats_t;
+
+/* Small per-thread cache of counter blocks, keyed by table id */
+#define FLOW_STATS_CACHE    4
+static __thread struct {
+    guint id;
+    flow_stats_t *stats;
+} flow_stats_cache[FLOW_STATS_CACHE];
+static guint flow_table_ids;
+
+/* The cache slot was taken by another table - reuse this thread's block
+ * if it has one, so threads switching between tables allocate only once */
+static flow_stats_t *flow_stats_slow(GInetFlowTable * table)
+{
+    flow_stats_t *stats = NULL;
+    GList *iter;
+
+    g_mutex_lock(&table->stats_lock);
+    for (iter = table->stats; iter; iter = iter->next) {
+        if (((flow_stats_t *) iter->data)->owner == flow_stats_cache) {
+            stats = iter->data;
+            break;
+        }
+    }
+    if (!stats) {
+        if (posix_memalign((void **) &stats, __alignof__(flow_stats_t), sizeof(flow_stats_t)))
+            g_error("Failed to allocate flow statistics");
+        memset(stats, 0, sizeof(flow_stats_t));
+        stats->owner = flow_stats_cache;
+        table->stats = g_list_prepend(table->stats, stats);
+        g_atomic_int_inc(&table->nstats);
+    }
+    g_mutex_unlock(&table->stats_lock);
+
+    flow_stats_cache[table->id % FLOW_STATS_CACHE].id = table->id;
+    flow_stats_cache[table->id % FLOW_STATS_CACHE].stats = stats;
+    return stats;
+}
+
+static inline flow_stats_t *flow_stats(GInetFlowTable * table)
+{
+    guint slot = table->id % FLOW_STATS_CACHE;
+
+    if (G_LIKELY(flow_stats_cache[slot].id == table->id))
+        return flow_stats_cache[slot].stats;
+    return flow_stats_slow(table);
+}
+
 /* Packet */
 #define ETH_PROTOCOL_8021Q      0x8100
 #define ETH_PROTOCOL_8021AD     0x88A8
@@ -214,12 +340,41 @@ typedef struct ipv6_partial_ext_hdr_t {
     guint8 hdr_ext_len;
 } __attribute__ ((packed)) ipv6_partial_ext_hdr_t;
 
+/* What the parser learnt beyond the tuple */
+typedef struct flow_parse_info_t {
+    /* Fragments held before the first fragment and now resolved */
+    guint32 resolved;
+    /* Set to time fragment handling, which is accumulated in frag_time */
+    gboolean timed;
+    guint64 frag_time;
+    /* Why parsing failed - truncated unless the failing header says otherwise */
+    GInetFlowParseFailure failure;
+    /* Tunnel headers stripped to reach the inner tuple */
+    guint tunnels;
+} flow_parse_info_t;
+
+static inline gboolean flow_parse_failed(flow_parse_info_t * info,
+                                         GInetFlowParseFailure failure)
+{
+    if (info)
+        info->failure = failure;
+    return FALSE;
+}
+
+static inline void flow_parse_tunnel(flow_parse_info_t * info)
+{
+    if (info)
+        info->tunnels++;
+}
+
 static gboolean flow_parse_ipv4(GInetTuple * f, const guint8 * data, guint32 length,
                                 GInetFragList * fragments, const uint8_t ** iphr,
-                                guint64 ts, guint16 * flags, gboolean tunnel);
+                                guint64 ts, guint16 * flags, flow_parse_info_t * info,
+                                gboolean tunnel);
 static gboolean flow_parse_ipv6(GInetTuple * f, const guint8 * data, guint32 length,
                                 GInetFragList * fragments, const uint8_t ** iphr,
-                                guint64 ts, guint16 * flags, gboolean tunnel);
+                                guint64 ts, guint16 * flags, flow_parse_info_t * info,
+                                gboolean tunnel);
 
 static inline guint64 get_time_us(void)
 {
@@ -231,24 +386,95 @@ static inline guint64 get_time_us(void)
         return 0;
 }
 
+static inline guint64 get_time_ns(void)
+{
+    struct timespec now;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &now) == 0)
+        return (now.tv_sec * (guint64) 1000000000 + now.tv_nsec);
+    else
+        return 0;
+}
+
 static guint32 get_hdr_len(guint8 hdr_ext_len)
 {
     return (hdr_ext_len + IPV6_FIRST_8_OCTETS) * EIGHT_OCTET_UNITS;
 }
 
-static guint32 flow_hash(GInetFlow * f)
+#define flow_from_node(n) ((GInetFlow *) ((guint8 *) (n) - G_STRUCT_OFFSET(GInetFlow, node)))
+
+static inline guint64 flow_hash_address(guint64 h, struct sockaddr_storage *address)
+{
+    guint64 words[2];
+
+    if (address->ss_family == AF_INET6) {
+        memcpy(words, &((struct sockaddr_in6 *) address)->sin6_addr, sizeof(words));
+        h = (h ^ words[0]) * 0x9E3779B97F4A7C15ULL;
+        h = (h ^ words[1]) * 0x9E3779B97F4A7C15ULL;
+    } else {
+        h = (h ^ ((struct sockaddr_in *) address)->sin_addr.s_addr) * 0x9E3779B97F4A7C15ULL;
+    }
+    return h;
+}
+
+/* Table hash of the whole tuple. The tuple hash (the flow's hash property)
+ * only covers the ports and the table indexes buckets by its low bits, so
+ * mix in every word of the canonical key, which is the same both ways.
+ * Callers key the tuple first. */
+static guint32 flow_table_hash(GInetTuple * tuple)
+{
+    guint64 words[sizeof(GInetTupleKey) / sizeof(guint64)];
+    guint64 h = 0;
+    guint i;
+
+    memcpy(words, &tuple->key, sizeof(words));
+    for (i = 0; i < G_N_ELEMENTS(words); i++)
+        h = (h ^ words[i]) * 0x9E3779B97F4A7C15ULL;
+    h ^= h >> 32;
+    return (guint32) h;
+}
+
+static gboolean flow_equal(GInetHashNode * node, gconstpointer tuple)
+{
+    return g_inet_tuple_equal(&flow_from_node(node)->tuple, (GInetTuple *) tuple);
+}
+
+/* Packets come in trains, so the last flow seen in a slot is likely to be
+ * wanted again. The stored hash rules out most misses without touching the
+ * flow, and flows leaving the table clear their slot. */
+static inline GInetFlow *flow_cache_lookup(GInetFlowTable * table, guint32 hashval,
+                                           GInetTuple * tuple)
 {
-    if (f->hash)
-        return f->hash;
+    flow_cache_t *entry = &table->cache[hashval & table->cache_mask];
+
+    if (entry->flow && entry->hash == hashval && flow_equal(&entry->flow->node, tuple)) {
+        flow_stats(table)->cache_hits++;
+        return entry->flow;
+    }
+    flow_stats(table)->cache_misses++;
+    return NULL;
+}
 
-    f->hash = g_inet_tuple_hash(&f->tuple);
+static inline void flow_cache_insert(GInetFlowTable * table, GInetFlow * flow)
+{
+    flow_cache_t *entry;
 
-    return f->hash;
+    if (table->cache) {
+        entry = &table->cache[flow->node.hash & table->cache_mask];
+        entry->hash = flow->node.hash;
+        entry->flow = flow;
+    }
 }
 
-static gboolean flow_compare(GInetFlow * f1, GInetFlow * f2)
+static inline void flow_cache_remove(GInetFlowTable * table, GInetFlow * flow)
 {
-    return g_inet_tuple_equal(&f1->tuple, &f2->tuple);
+    flow_cache_t *entry;
+
+    if (table->cache) {
+        entry = &table->cache[flow->node.hash & table->cache_mask];
+        if (entry->flow == flow)
+            entry->flow = NULL;
+    }
 }
 
 static gboolean flow_parse_tcp(GInetTuple * f, const guint8 * data, guint32 length,
@@ -297,9 +523,27 @@ static gboolean flow_parse_sctp(GInetTuple * f, const guint8 * data, guint32 len
     return TRUE;
 }
 
+static gboolean flow_parse_fragment(GInetTuple * f, GInetFragList * fragments,
+                                    GInetFragment * entry, gboolean more_fragments,
+                                    flow_parse_info_t * info)
+{
+    guint64 start = info && info->timed ? get_time_ns() : 0;
+    gboolean result = g_inet_frag_list_update(fragments, entry, more_fragments);
+
+    *f = entry->tuple;
+    if (info) {
+        info->resolved += entry->packets;
+        if (info->timed)
+            info->frag_time += get_time_ns() - start;
+    }
+    if (!result)
+        return flow_parse_failed(info, G_INET_FLOW_PARSE_FRAGMENT);
+    return TRUE;
+}
+
 static gboolean flow_parse_gre(GInetTuple * f, const guint8 * data, guint32 length,
                                GInetFragList * fragments, const uint8_t ** iphr, guint64 ts,
-                               guint16 * tcp_flags)
+                               guint16 * tcp_flags, flow_parse_info_t * info)
 {
     gre_hdr_t *gre = (gre_hdr_t *) data;
     if (length < sizeof(gre_hdr_t))
@@ -320,13 +564,17 @@ static gboolean flow_parse_gre(GInetTuple * f, const guint8 * data, guint32 leng
     DEBUG("Protocol: %d\n", proto);
     switch (proto) {
     case ETH_PROTOCOL_IP:
+        flow_parse_tunnel(info);
         if (!flow_parse_ipv4
-            (f, data + offset, length - offset, fragments, iphr, ts, tcp_flags, TRUE))
+            (f, data + offset, length - offset, fragments, iphr, ts, tcp_flags, info,
+             TRUE))
             return FALSE;
         break;
     case ETH_PROTOCOL_IPV6:
+        flow_parse_tunnel(info);
         if (!flow_parse_ipv6
-            (f, data + offset, length - offset, fragments, iphr, ts, tcp_flags, TRUE))
+            (f, data + offset, length - offset, fragments, iphr, ts, tcp_flags, info,
+             TRUE))
             return FALSE;
         break;
     default:
@@ -337,7 +585,8 @@ static gboolean flow_parse_gre(GInetTuple * f, const guint8 * data, guint32 leng
 
 static gboolean flow_parse_ipv4(GInetTuple * f, const guint8 * data, guint32 length,
                                 GInetFragList * fragments, const uint8_t ** iphr,
-                                guint64 ts, guint16 * tcp_flags, gboolean tunnel)
+                                guint64 ts, guint16 * tcp_flags, flow_parse_info_t * info,
+                                gboolean tunnel)
 {
     ip_hdr_t *iph = (ip_hdr_t *) data;
     if (length < sizeof(ip_hdr_t))
@@ -374,7 +623,7 @@ static gboolean flow_parse_ipv4(GInetTuple * f, const guint8 * data, guint32 len
         case IP_PROTOCOL_GRE:
             if (tunnel) {
                 if (!flow_parse_gre(f, data + sizeof(ip_hdr_t), length - sizeof(ip_hdr_t),
-                                    fragments, iphr, ts, tcp_flags))
+                                    fragments, iphr, ts, tcp_flags, info))
                     return FALSE;
             }
             break;
@@ -394,12 +643,12 @@ static gboolean flow_parse_ipv4(GInetTuple * f, const guint8 * data, guint32 len
         entry.id = iph->id;
         entry.tuple = *f;
         entry.timestamp = ts;
+        entry.offset = GUINT16_FROM_BE(iph->frag_off) & 0x1FFF;
+        entry.bytes = length - sizeof(ip_hdr_t);
 
         gboolean more_fragments = ! !(GUINT16_FROM_BE(iph->frag_off) & 0x2000);
 
-        gboolean result = g_inet_frag_list_update(fragments, &entry, more_fragments);
-        *f = entry.tuple;
-        return result;
+        return flow_parse_fragment(f, fragments, &entry, more_fragments, info);
     }
 
     return TRUE;
@@ -407,7 +656,8 @@ static gboolean flow_parse_ipv4(GInetTuple * f, const guint8 * data, guint32 len
 
 static gboolean flow_parse_ipv6(GInetTuple * f, const guint8 * data, guint32 length,
                                 GInetFragList * fragments, const uint8_t ** iphr,
-                                guint64 ts, guint16 * tcp_flags, gboolean tunnel)
+                                guint64 ts, guint16 * tcp_flags, flow_parse_info_t * info,
+                                gboolean tunnel)
 {
     ip6_hdr_t *iph = (ip6_hdr_t *) data;
     frag_hdr_t *fragment_hdr = NULL;
@@ -450,20 +700,26 @@ static gboolean flow_parse_ipv6(GInetTuple * f, const guint8 * data, guint32 len
         }
         break;
     case IP_PROTOCOL_IPV4:
-        if (tunnel)
-            if (!flow_parse_ipv4(f, data, length, fragments, iphr, ts, tcp_flags, tunnel)) {
+        if (tunnel) {
+            flow_parse_tunnel(info);
+            if (!flow_parse_ipv4
+                (f, data, length, fragments, iphr, ts, tcp_flags, info, tunnel)) {
                 return FALSE;
             }
+        }
         break;
     case IP_PROTOCOL_IPV6:
-        if (tunnel)
-            if (!flow_parse_ipv6(f, data, length, fragments, iphr, ts, tcp_flags, tunnel)) {
+        if (tunnel) {
+            flow_parse_tunnel(info);
+            if (!flow_parse_ipv6
+                (f, data, length, fragments, iphr, ts, tcp_flags, info, tunnel)) {
                 return FALSE;
             }
+        }
         break;
     case IP_PROTOCOL_GRE:
         if (tunnel)
-            if (!flow_parse_gre(f, data, length, fragments, iphr, ts, tcp_flags)) {
+            if (!flow_parse_gre(f, data, length, fragments, iphr, ts, tcp_flags, info)) {
                 return FALSE;
             }
         break;
@@ -525,13 +781,13 @@ static gboolean flow_parse_ipv6(GInetTuple * f, const guint8 * data, guint32 len
         entry.id = fragment_hdr->id;
         entry.tuple = *f;
         entry.timestamp = ts;
+        entry.offset = GUINT16_FROM_BE(fragment_hdr->fo_res_mflag) >> 3;
+        entry.bytes = length;
 
         gboolean more_fragments =
          ! !(GUINT16_FROM_BE(fragment_hdr->fo_res_mflag) & 0x1);
 
-        gboolean result = g_inet_frag_list_update(fragments, &entry, more_fragments);
-        *f = entry.tuple;
-        return result;
+        return flow_parse_fragment(f, fragments, &entry, more_fragments, info);
     }
 
     return TRUE;
@@ -540,7 +796,7 @@ static gboolean flow_parse_ipv6(GInetTuple * f, const guint8 * data, guint32 len
 static gboolean flow_parse_ip(GInetTuple * f, const guint8 * data, guint32 length,
                               GInetFragList * fragments,
                               const uint8_t ** iphr, guint64 ts, guint16 * flags,
-                              gboolean tunnel)
+                              flow_parse_info_t * info, gboolean tunnel)
 {
     guint8 version;
 
@@ -551,14 +807,14 @@ static gboolean flow_parse_ip(GInetTuple * f, const guint8 * data, guint32 lengt
     version = 0x0f & (version >> 4);
 
     if (version == 4) {
-        if (!flow_parse_ipv4(f, data, length, fragments, iphr, ts, flags, tunnel))
+        if (!flow_parse_ipv4(f, data, length, fragments, iphr, ts, flags, info, tunnel))
             return FALSE;
     } else if (version == 6) {
-        if (!flow_parse_ipv6(f, data, length, fragments, iphr, ts, flags, tunnel))
+        if (!flow_parse_ipv6(f, data, length, fragments, iphr, ts, flags, info, tunnel))
             return FALSE;
     } else {
         DEBUG("Unsupported ip version: %d\n", version);
-        return FALSE;
+        return flow_parse_failed(info, G_INET_FLOW_PARSE_UNSUPPORTED_IP_VERSION);
     }
     return TRUE;
 }
@@ -568,13 +824,14 @@ GInetTuple *g_inet_flow_parse_ip(const guint8 * iphdr, guint length, GInetFragLi
 {
     if (!result)
         result = calloc(1, sizeof(GInetTuple));
-    flow_parse_ip(result, iphdr, length, fragments, NULL, 0, NULL, inspect_tunnel);
+    flow_parse_ip(result, iphdr, length, fragments, NULL, 0, NULL, NULL, inspect_tunnel);
+    g_inet_tuple_canonicalize(result);
     return result;
 }
 
 static gboolean flow_parse(GInetTuple * f, const guint8 * data, guint32 length,
                            GInetFragList * fragments, const uint8_t ** iphr,
-                           guint64 ts, guint16 * flags, gboolean tunnel)
+                           guint64 ts, guint16 * flags, flow_parse_info_t * info, gboolean tunnel)
 {
     ethernet_hdr_t *e;
     vlan_hdr_t *v;
@@ -605,7 +862,7 @@ static gboolean flow_parse(GInetTuple * f, const guint8 * data, guint32 length,
     case ETH_PROTOCOL_8021AD:
         tags++;
         if (tags > 2)
-            return FALSE;
+            return flow_parse_failed(info, G_INET_FLOW_PARSE_TOO_MANY_TAGS);
         if (length < sizeof(vlan_hdr_t))
             return FALSE;
         v = (vlan_hdr_t *) data;
@@ -618,7 +875,7 @@ static gboolean flow_parse(GInetTuple * f, const guint8 * data, guint32 length,
     case ETH_PROTOCOL_MPLS_MC:
         labels++;
         if (labels > 3)
-            return FALSE;
+            return flow_parse_failed(info, G_INET_FLOW_PARSE_TOO_MANY_TAGS);
         if (length < sizeof(guint32))
             return FALSE;
         label = GUINT32_FROM_BE(*((guint32 *) data));
@@ -632,7 +889,7 @@ static gboolean flow_parse(GInetTuple * f, const guint8 * data, guint32 length,
         goto try_again;
     case ETH_PROTOCOL_IP:
     case ETH_PROTOCOL_IPV6:
-        if (!flow_parse_ip(f, data, length, fragments, iphr, ts, flags, tunnel))
+        if (!flow_parse_ip(f, data, length, fragments, iphr, ts, flags, info, tunnel))
             return FALSE;
         break;
     case ETH_PROTOCOL_PPPOE_SESS:
@@ -645,7 +902,7 @@ static gboolean flow_parse(GInetTuple * f, const guint8 * data, guint32 length,
             type = ETH_PROTOCOL_IPV6;
         } else {
             DEBUG("Unsupported PPPOE protocol: 0x%04x\n", g_ntohs(pppoe->ppp_protocol_id));
-            return FALSE;
+            return flow_parse_failed(info, G_INET_FLOW_PARSE_UNSUPPORTED_ETHERTYPE);
         }
         data += sizeof(pppoe_sess_hdr_t);
         length -= sizeof(pppoe_sess_hdr_t);
@@ -653,7 +910,7 @@ static gboolean flow_parse(GInetTuple * f, const guint8 * data, guint32 length,
         goto try_again;
     default:
         DEBUG("Unsupported ethernet protocol: 0x%04x\n", type);
-        return FALSE;
+        return flow_parse_failed(info, G_INET_FLOW_PARSE_UNSUPPORTED_ETHERTYPE);
     }
     return TRUE;
 }
@@ -673,6 +930,7 @@ enum {
     FLOW_DIRECTION,
     FLOW_LIFETIME,
     FLOW_TIMESTAMP,
+    FLOW_TCP_STATE,
 };
 
 static int find_expiry_index(guint64 lifetime)
@@ -701,6 +959,90 @@ static void insert_flow_by_expiry(GInetFlowTable * table, GInetFlow * flow,
     g_queue_push_tail_link(table->expire_queue[index], &flow->list);
 }
 
+/* Flows the state quota lets go are looked for this far into each queue */
+#define FLOW_RECYCLE_SCAN   16
+
+/* Least recently active flow in state, other than skip. Expired flows
+ * already belong to the caller of g_inet_flow_expire. */
+static GInetFlow *flow_table_oldest(GInetFlowTable * table, GInetFlowState state,
+                                    GInetFlow * skip)
+{
+    GInetFlow *oldest = NULL;
+    GList *link;
+    int i, n;
+
+    for (i = 0; i < LIFETIME_COUNT; i++) {
+        link = g_queue_peek_head_link(table->expire_queue[i]);
+        for (n = 0; link && n < FLOW_RECYCLE_SCAN; link = link->next, n++) {
+            GInetFlow *flow = (GInetFlow *) link->data;
+
+            if (flow->state == state && flow != skip && !flow->expired) {
+                if (!oldest || flow->timestamp < oldest->timestamp)
+                    oldest = flow;
+                break;
+            }
+        }
+    }
+    return oldest;
+}
+
+/* Take a flow out of the table, so no packet finds it again, and queue it
+ * first for g_inet_flow_expire. Callers see it end like any other flow. */
+static void flow_table_recycle(GInetFlowTable * table, GInetFlow * flow)
+{
+    remove_flow_by_expiry(table, flow, flow->lifetime);
+    g_inet_hash_remove(table->flows, &flow->node);
+    flow_cache_remove(table, flow);
+    table->state_count[flow->state]--;
+    flow_stats(table)->recycled[flow->state]++;
+    G_INET_PROBE(flow__recycle, table, flow, flow->state);
+    flow->recycled = TRUE;
+    flow->expired = TRUE;
+    g_queue_push_tail_link(table->recycled, &flow->list);
+}
+
+static inline gboolean flow_table_at_quota(GInetFlowTable * table, GInetFlowState state)
+{
+    return table->state_max[state] && table->state_count[state] >= table->state_max[state];
+}
+
+/* Make room for flow (NULL for one about to be created) in NEW at its
+ * quota. FALSE if no other new flow could be found to recycle. */
+static gboolean flow_table_quota(GInetFlowTable * table, GInetFlow * flow)
+{
+    GInetFlow *oldest;
+
+    if (!flow_table_at_quota(table, FLOW_NEW))
+        return TRUE;
+    if (!(oldest = flow_table_oldest(table, FLOW_NEW, flow)))
+        return FALSE;
+    flow_table_recycle(table, oldest);
+    return TRUE;
+}
+
+/* Count a change of state. Joining a full NEW recycles the oldest new flow,
+ * but a full OPEN or CLOSED, or a full NEW with nothing to recycle, keeps
+ * the flow in its old state (and lifetime) rather than end a connection
+ * the table already tracks. */
+static void flow_state_changed(GInetFlow * flow, GInetFlowState old, guint64 lifetime)
+{
+    GInetFlowTable *table = flow->table;
+
+    if (table && !flow->recycled &&
+        (flow->state == FLOW_NEW ? !flow_table_quota(table, flow) :
+         flow_table_at_quota(table, flow->state))) {
+        flow_stats(table)->refused[flow->state]++;
+        flow->state = old;
+        flow->lifetime = lifetime;
+        return;
+    }
+    G_INET_PROBE(flow__state, flow, old, flow->state);
+    if (!table || flow->recycled)
+        return;
+    table->state_count[old]--;
+    table->state_count[flow->state]++;
+}
+
 static void g_inet_flow_get_property(GObject * object, guint prop_id,
                                      GValue * value, GParamSpec * pspec)
 {
@@ -712,6 +1054,9 @@ static void g_inet_flow_get_property(GObject * object, guint prop_id,
     case FLOW_LIFETIME:
         g_value_set_uint64(value, flow->lifetime);
         break;
+    case FLOW_TCP_STATE:
+        g_value_set_uint(value, flow->tcp_state);
+        break;
     case FLOW_TIMESTAMP:
         g_value_set_uint64(value, flow->timestamp);
         break;
@@ -771,9 +1116,16 @@ static void g_inet_flow_get_property(GObject * object, guint prop_id,
 static void g_inet_flow_finalize(GObject * object)
 {
     GInetFlow *flow = G_INET_FLOW(object);
-    int index = find_expiry_index(flow->lifetime);
-    g_queue_unlink(flow->table->expire_queue[index], &flow->list);
-    g_hash_table_steal(flow->table->table, flow);
+
+    if (flow->table && flow->recycled) {
+        /* Recycling already took it out of the hash and the counts */
+        g_queue_unlink(flow->table->recycled, &flow->list);
+    } else if (flow->table) {
+        remove_flow_by_expiry(flow->table, flow, flow->lifetime);
+        g_inet_hash_remove(flow->table->flows, &flow->node);
+        flow_cache_remove(flow->table, flow);
+        flow->table->state_count[flow->state]--;
+    }
     G_OBJECT_CLASS(g_inet_flow_parent_class)->finalize(object);
 }
 
@@ -786,6 +1138,11 @@ static void g_inet_flow_class_init(GInetFlowClass * class)
                                                       "State of the flow",
                                                       FLOW_NEW, FLOW_CLOSED,
                                                       0, G_PARAM_READABLE));
+    g_object_class_install_property(object_class, FLOW_TCP_STATE,
+                                    g_param_spec_uint("tcp-state", "TCP state",
+                                                      "TCP connection state of the flow",
+                                                      FLOW_TCP_NONE, FLOW_TCP_CLOSE,
+                                                      0, G_PARAM_READABLE));
     g_object_class_install_property(object_class, FLOW_LIFETIME,
                                     g_param_spec_uint64("lifetime", "Lifetime",
                                                       "Lifetime of flow",
@@ -845,46 +1202,113 @@ static void g_inet_flow_class_init(GInetFlowClass * class)
     object_class->finalize = g_inet_flow_finalize;
 }
 
+/* TCP flags */
+#define TCP_FIN (1 << 0)
+#define TCP_SYN (1 << 1)
+#define TCP_RST (1 << 2)
+#define TCP_ACK (1 << 4)
+
+/* What each end of a TCP connection has sent */
+#define TCP_SEEN_PACKET     (1 << 0)
+#define TCP_SEEN_FIN        (1 << 1)
+/* The other end has acknowledged this end's FIN */
+#define TCP_SEEN_FIN_ACKED  (1 << 2)
+
+static const struct {
+    GInetFlowState state;
+    guint64 lifetime;
+} tcp_states[] = {
+    [FLOW_TCP_NONE] = {FLOW_NEW, G_INET_FLOW_DEFAULT_NEW_TIMEOUT},
+    [FLOW_TCP_SYN_SENT] = {FLOW_NEW, G_INET_FLOW_DEFAULT_NEW_TIMEOUT},
+    [FLOW_TCP_SYN_RECV] = {FLOW_OPEN, G_INET_FLOW_DEFAULT_NEW_TIMEOUT},
+    [FLOW_TCP_ESTABLISHED] = {FLOW_OPEN, G_INET_FLOW_DEFAULT_OPEN_TIMEOUT},
+    [FLOW_TCP_FIN_WAIT] = {FLOW_OPEN, G_INET_FLOW_DEFAULT_HALF_CLOSED_TIMEOUT},
+    [FLOW_TCP_CLOSE_WAIT] = {FLOW_OPEN, G_INET_FLOW_DEFAULT_HALF_CLOSED_TIMEOUT},
+    [FLOW_TCP_LAST_ACK] = {FLOW_CLOSED, G_INET_FLOW_DEFAULT_CLOSED_TIMEOUT},
+    [FLOW_TCP_TIME_WAIT] = {FLOW_CLOSED, G_INET_FLOW_DEFAULT_TIME_WAIT_TIMEOUT},
+    [FLOW_TCP_CLOSE] = {FLOW_CLOSED, G_INET_FLOW_DEFAULT_TIME_WAIT_TIMEOUT},
+};
+
+/* Connection state from the FINs each end has sent and had acknowledged */
+static GInetFlowTcpState tcp_state_closing(GInetFlow * flow)
+{
+    guint8 client = flow->tcp_seen[0];
+    guint8 server = flow->tcp_seen[1];
+
+    if ((client & TCP_SEEN_FIN) && (server & TCP_SEEN_FIN))
+        return (client & server & TCP_SEEN_FIN_ACKED) ? FLOW_TCP_TIME_WAIT : FLOW_TCP_LAST_ACK;
+    if ((client | server) & TCP_SEEN_FIN_ACKED)
+        return FLOW_TCP_CLOSE_WAIT;
+    return FLOW_TCP_FIN_WAIT;
+}
+
 void g_inet_flow_update_tcp(GInetFlow * flow, GInetFlow * packet)
 {
-    /* FIN */
-    if (CHECK_BIT(packet->flags, 0)) {
-        /* ACK */
-        if (CHECK_BIT(packet->flags, 4)) {
-            flow->state = FLOW_CLOSED;
-            flow->lifetime = G_INET_FLOW_DEFAULT_CLOSED_TIMEOUT;
-        }
-    }
-    /* SYN */
-    else if (CHECK_BIT(packet->flags, 1)) {
-        /* ACK */
-        if (CHECK_BIT(packet->flags, 4)) {
-            flow->state = FLOW_OPEN;
-            flow->lifetime = G_INET_FLOW_DEFAULT_OPEN_TIMEOUT;
-        } else {
-            flow->state = FLOW_NEW;
-            flow->lifetime = G_INET_FLOW_DEFAULT_NEW_TIMEOUT;
+    GInetFlowTcpState state = flow->tcp_state;
+    gboolean swapped = g_inet_tuple_get_swapped(&packet->tuple);
+    guint16 flags = packet->flags;
+    int end;
+
+    if ((flags & TCP_SYN) && !(flags & TCP_ACK)) {
+        /* A SYN opens a connection, or reuses the ports of a finished one.
+         * Retransmitted SYNs change nothing. */
+        if (state == FLOW_TCP_NONE || state == FLOW_TCP_TIME_WAIT || state == FLOW_TCP_CLOSE) {
             flow->server_port = g_inet_tuple_get_dst_port(&packet->tuple);
+            flow->server_swapped = swapped;
+            flow->tcp_seen[0] = flow->tcp_seen[1] = 0;
+            state = FLOW_TCP_SYN_SENT;
         }
-    }
-    /* RST */
-    else if (CHECK_BIT(packet->flags, 2)) {
-        flow->state = FLOW_CLOSED;
-        flow->lifetime = G_INET_FLOW_DEFAULT_CLOSED_TIMEOUT;
+    } else if ((flags & TCP_SYN) && !flow->server_port) {
+        /* SYN-ACK without the SYN, so it comes from the server */
+        flow->server_port = g_inet_tuple_get_src_port(&packet->tuple);
+        flow->server_swapped = !swapped;
+    } else if (!flow->server_port) {
+        /* Picked up mid-stream - assume the server has the lower port */
+        flow->server_port = MIN(g_inet_tuple_get_src_port(&packet->tuple),
+                                g_inet_tuple_get_dst_port(&packet->tuple));
+        flow->server_swapped = TRUE;
     }
 
     if (packet->direction == FLOW_DIRECTION_UNKNOWN) {
-        packet->direction = g_inet_tuple_get_dst_port(&packet->tuple) == flow->server_port ?
+        packet->direction = swapped == flow->server_swapped ?
             FLOW_DIRECTION_ORIGINAL : FLOW_DIRECTION_REPLY;
     }
+    end = packet->direction == FLOW_DIRECTION_ORIGINAL ? 0 : 1;
+    flow->tcp_seen[end] |= TCP_SEEN_PACKET;
+
+    if (flags & TCP_RST) {
+        state = FLOW_TCP_CLOSE;
+    } else if (flags & TCP_SYN) {
+        if ((flags & TCP_ACK) && state <= FLOW_TCP_SYN_SENT)
+            state = FLOW_TCP_SYN_RECV;
+    } else if (state != FLOW_TCP_CLOSE) {
+        if ((flags & TCP_ACK) && (flow->tcp_seen[!end] & TCP_SEEN_FIN))
+            flow->tcp_seen[!end] |= TCP_SEEN_FIN_ACKED;
+        if (flags & TCP_FIN)
+            flow->tcp_seen[end] |= TCP_SEEN_FIN;
+        if ((flow->tcp_seen[0] | flow->tcp_seen[1]) & TCP_SEEN_FIN)
+            state = tcp_state_closing(flow);
+        else if (state == FLOW_TCP_SYN_RECV && end == 0 && (flags & TCP_ACK))
+            state = FLOW_TCP_ESTABLISHED;
+        else if (state == FLOW_TCP_NONE &&
+                 (flow->tcp_seen[0] & flow->tcp_seen[1] & TCP_SEEN_PACKET))
+            state = FLOW_TCP_ESTABLISHED;
+    }
+
+    /* Only transitions set the flow state, so g_inet_flow_establish and
+     * g_inet_flow_close hold until the connection moves on */
+    if (state != flow->tcp_state) {
+        flow->tcp_state = state;
+        flow->state = tcp_states[state].state;
+        flow->lifetime = tcp_states[state].lifetime;
+    }
 }
 
 void g_inet_flow_update_udp(GInetFlow * flow, GInetFlow * packet)
 {
-    packet->direction =
-            g_inet_tuple_get_dst_port(&packet->tuple) <
-            g_inet_tuple_get_src_port(&packet->
-                                      tuple) ? FLOW_DIRECTION_ORIGINAL : FLOW_DIRECTION_REPLY;
+    /* Packets to the lower port are taken to be going to the server */
+    packet->direction = g_inet_tuple_get_swapped(&packet->tuple) ?
+        FLOW_DIRECTION_ORIGINAL : FLOW_DIRECTION_REPLY;
 
     if (flow->direction && packet->direction && packet->direction != flow->direction) {
         flow->state = FLOW_OPEN;
@@ -894,12 +1318,17 @@ void g_inet_flow_update_udp(GInetFlow * flow, GInetFlow * packet)
 
 void g_inet_flow_update(GInetFlow * flow, GInetFlow * packet)
 {
+    GInetFlowState state = flow->state;
+    guint64 lifetime = flow->lifetime;
+
     if (g_inet_tuple_get_protocol(&flow->tuple) == IP_PROTOCOL_TCP) {
         g_inet_flow_update_tcp(flow, packet);
     } else if (g_inet_tuple_get_protocol(&flow->tuple) == IP_PROTOCOL_UDP) {
         g_inet_flow_update_udp(flow, packet);
     }
     flow->direction = packet->direction;
+    if (flow->state != state)
+        flow_state_changed(flow, state, lifetime);
 }
 
 static void g_inet_flow_init(GInetFlow * flow)
@@ -908,17 +1337,45 @@ static void g_inet_flow_init(GInetFlow * flow)
     flow->state = FLOW_NEW;
 }
 
+/* Shrink the hash once it has been mostly empty for a while */
+static void flow_table_compact_check(GInetFlowTable * table, guint64 ts)
+{
+    if ((table->flags & G_INET_FLOW_TABLE_NO_COMPACT) || !ts || table->flows->old)
+        return;
+    if (!g_inet_hash_sparse(table->flows)) {
+        table->sparse_since = 0;
+    } else if (!table->sparse_since) {
+        table->sparse_since = ts;
+    } else if (ts - table->sparse_since >=
+               G_INET_FLOW_DEFAULT_COMPACT_DELAY * TIMESTAMP_RESOLUTION_US) {
+        g_inet_hash_compact(table->flows, FALSE);
+        table->sparse_since = 0;
+    }
+}
+
 GInetFlow *g_inet_flow_expire(GInetFlowTable * table, guint64 ts)
 {
     GList *iter;
     int i;
 
+    /* Fragment entries age on the same timer as flows */
+    g_inet_frag_list_expire(table->frag_info_list, ts);
+    flow_table_compact_check(table, ts);
+
+    if (!g_queue_is_empty(table->recycled))
+        return (GInetFlow *) g_queue_peek_head(table->recycled);
+
     for (i = 0; i < LIFETIME_COUNT; i++) {
         guint64 timeout = (lifetime_values[i] * TIMESTAMP_RESOLUTION_US);
         GList *first = g_queue_peek_head_link(table->expire_queue[i]);
         if (first) {
             GInetFlow *flow = (GInetFlow *) first->data;
             if (flow->timestamp + timeout <= ts) {
+                if (!flow->expired) {
+                    flow->expired = TRUE;
+                    flow_stats(table)->expired[flow->state]++;
+                    G_INET_PROBE(flow__expire, table, flow, flow->state);
+                }
                 return flow;
             }
         }
@@ -926,6 +1383,81 @@ GInetFlow *g_inet_flow_expire(GInetFlowTable * table, guint64 ts)
     return NULL;
 }
 
+/* Bytes used by the table if it held size flows */
+static guint64 flow_table_memory(GInetFlowTable * table, guint size,
+                                 GInetFlowTableMemory * memory)
+{
+    GInetFlowTableMemory tmp;
+    int i;
+
+    if (!memory)
+        memory = &tmp;
+    /* The expiry list link is embedded in each flow */
+    memory->flows = (guint64) size * sizeof(GInetFlow);
+    memory->hash = g_inet_hash_memory(table->flows, size);
+    memory->hugepages = g_inet_hash_memory_huge(table->flows);
+    memory->expiry = (LIFETIME_COUNT + 1) * sizeof(GQueue);
+    memory->fragments = g_inet_frag_list_memory(table->frag_info_list);
+    memory->other = sizeof(GInetFlowTable);
+    for (i = 0; i < G_INET_FLOW_STAGE_COUNT; i++) {
+        if (table->latency[i])
+            memory->other += sizeof(GInetHistogram);
+    }
+    if (table->admission)
+        memory->other += g_inet_filter_memory(table->admission);
+    if (table->source_limit)
+        memory->other += g_inet_limit_memory(table->source_limit);
+    memory->other += table->cache ? (table->cache_mask + 1) * sizeof(flow_cache_t) : 0;
+    if (table->top_flows)
+        memory->other += g_inet_sketch_memory(table->top_flows) +
+            g_inet_sketch_memory(table->top_hosts);
+    memory->other += g_atomic_int_get(&table->nstats) * (sizeof(flow_stats_t) + sizeof(GList));
+    memory->total = memory->flows + memory->hash + memory->expiry + memory->fragments +
+        memory->other;
+    return memory->total;
+}
+
+/* Whether the packet's source may create another flow now */
+static gboolean flow_source_allowed(GInetFlowTable * table, GInetTuple * tuple,
+                                    guint64 timestamp)
+{
+    gboolean throttled;
+
+    if (!table->source_limit)
+        return TRUE;
+    if (g_inet_limit_take(table->source_limit, flow_hash_address(0, &tuple->src),
+                          timestamp, &throttled))
+        return TRUE;
+    flow_stats(table)->throttled++;
+    if (throttled)
+        flow_stats(table)->throttled_sources++;
+    return FALSE;
+}
+
+/* Either limit reached - flow count or byte budget */
+static gboolean flow_table_full(GInetFlowTable * table)
+{
+    guint size = g_inet_hash_size(table->flows);
+
+    if (table->max > 0 && size >= table->max)
+        return TRUE;
+    if (table->memory_max > 0 && flow_table_memory(table, size + 1, NULL) > table->memory_max)
+        return TRUE;
+    return FALSE;
+}
+
+/* Record the time since start, less any time accounted elsewhere, and
+ * return the end time as the start of the next stage */
+static guint64 latency_record(GInetFlowTable * table, GInetFlowStage stage, guint64 start,
+                              guint64 exclude)
+{
+    guint64 now = get_time_ns();
+    guint64 elapsed = now - start;
+
+    g_inet_histogram_add(table->latency[stage], elapsed > exclude ? elapsed - exclude : 0);
+    return now;
+}
+
 GInetFlow *g_inet_flow_get(GInetFlowTable * table, const guint8 * frame, guint length)
 {
     return g_inet_flow_get_full(table, frame, length, 0, 0, FALSE, TRUE, FALSE, NULL, NULL);
@@ -941,7 +1473,12 @@ GInetFlow *g_inet_flow_get_full(GInetFlowTable * table,
     GInetTuple *tuple = NULL;
     GInetTuple tmp_tuple = { 0 };
     GInetFlow *flow = NULL;
+    flow_parse_info_t info = { 0 };
+    GInetHashNode *node;
+    guint32 hashval;
+    guint64 start = 0;
 
+    G_INET_PROBE(get__entry, table);
     if (ret_tuple) {
         tuple = calloc(1, sizeof(GInetTuple));
         *ret_tuple = tuple;
@@ -951,38 +1488,93 @@ GInetFlow *g_inet_flow_get_full(GInetFlowTable * table,
         tuple = &tmp_tuple;
     }
 
+    if (table->latency_rate && ++table->latency_count >= table->latency_rate) {
+        table->latency_count = 0;
+        info.timed = TRUE;
+        start = get_time_ns();
+    }
+
     if (l2) {
         if (!flow_parse(tuple, frame, length, table->frag_info_list, iphr, timestamp,
-             &packet.flags, inspect_tunnel)) {
+             &packet.flags, &info, inspect_tunnel)) {
+            flow_stats(table)->parse_failed[info.failure]++;
+            G_INET_PROBE(parse__fail, table, info.failure);
             goto exit;
         }
     } else
         if (!flow_parse_ip(tuple, frame, length, table->frag_info_list, iphr, timestamp,
-             &packet.flags, inspect_tunnel)) {
+             &packet.flags, &info, inspect_tunnel)) {
+        flow_stats(table)->parse_failed[info.failure]++;
+        G_INET_PROBE(parse__fail, table, info.failure);
         goto exit;
     }
+    if (info.tunnels)
+        flow_stats(table)->tunnels += info.tunnels;
 
+    if (info.timed) {
+        start = latency_record(table, G_INET_FLOW_STAGE_PARSE, start, info.frag_time);
+        if (info.frag_time)
+            g_inet_histogram_add(table->latency[G_INET_FLOW_STAGE_FRAGMENT], info.frag_time);
+    }
+
+    /* Key the tuple once so lookups compare it without ordering its ends */
+    g_inet_tuple_canonicalize(tuple);
     packet.tuple = *tuple;
-    packet.hash = 0;
+    packet.hash = g_inet_tuple_hash(&packet.tuple);
+    hashval = flow_table_hash(&packet.tuple);
+    /* Both directions share the hash so a flow is sampled whole */
+    if (hashval > table->sample_max) {
+        flow_stats(table)->unsampled++;
+        goto exit;
+    }
+    if (table->top_flows && update) {
+        g_inet_sketch_add(table->top_flows, hashval, &packet.tuple, 1 + info.resolved, length);
+        g_inet_sketch_add(table->top_hosts, flow_hash_address(0, &packet.tuple.src),
+                          &packet.tuple.src, 1 + info.resolved, length);
+    }
 
-    flow = (GInetFlow *) g_hash_table_lookup(table->table, &packet);
+    if (!table->cache || !(flow = flow_cache_lookup(table, hashval, &packet.tuple))) {
+        node = g_inet_hash_lookup(table->flows, hashval, &packet.tuple);
+        flow = node ? flow_from_node(node) : NULL;
+        if (flow)
+            flow_cache_insert(table, flow);
+    }
+    if (info.timed)
+        start = latency_record(table, G_INET_FLOW_STAGE_LOOKUP, start, 0);
     if (flow) {
         if (update) {
             remove_flow_by_expiry(table, flow, flow->lifetime);
             g_inet_flow_update(flow, &packet);
             insert_flow_by_expiry(table, flow, flow->lifetime);
             flow->timestamp = timestamp ? : get_time_us();
-            flow->packets++;
+            /* Include any fragments that arrived before the first one */
+            flow->packets += 1 + info.resolved;
+            G_INET_PROBE(flow__update, flow, flow->packets);
+            if (info.timed)
+                latency_record(table, G_INET_FLOW_STAGE_EXPIRY, start, 0);
         }
         table->hits++;
     } else {
+        /* Single packets of scans and floods are only counted */
+        if (table->admission &&
+            !g_inet_filter_admit(table->admission, hashval,
+                                 g_inet_tuple_get_swapped(&packet.tuple),
+                                 timestamp ? : get_time_us())) {
+            flow_stats(table)->unadmitted++;
+            goto exit;
+        }
+        if (!flow_source_allowed(table, &packet.tuple, timestamp ? : get_time_us()))
+            goto exit;
         /* Check if max table size is reached */
-        if (table->max > 0 && g_hash_table_size(table->table) >= table->max) {
+        if (flow_table_full(table) || !flow_table_quota(table, NULL)) {
+            flow_stats(table)->create_failed++;
+            G_INET_PROBE(flow__reject, table, g_inet_hash_size(table->flows));
             goto exit;
         }
 
         flow = (GInetFlow *) g_object_new(G_INET_TYPE_FLOW, NULL);
         flow->table = table;
+        table->state_count[FLOW_NEW]++;
         flow->list.data = flow;
         /* Set default lifetime before processing further - this may be over written */
         flow->lifetime = G_INET_FLOW_DEFAULT_NEW_TIMEOUT;
@@ -995,14 +1587,20 @@ GInetFlow *g_inet_flow_get_full(GInetFlowTable * table,
             flow->server_port = packet.server_port;
         }
         memcpy(flow->server_ip, packet.server_ip, sizeof(packet.server_ip));
-        g_hash_table_replace(table->table, (gpointer) flow, (gpointer) flow);
+        g_inet_hash_insert(table->flows, &flow->node, hashval);
+        flow_cache_insert(table, flow);
         table->misses++;
         flow->timestamp = timestamp ? : get_time_us();
         g_inet_flow_update(flow, &packet);
         insert_flow_by_expiry(table, flow, flow->lifetime);
-        flow->packets++;
+        flow->packets += 1 + info.resolved;
+        flow_stats(table)->created++;
+        G_INET_PROBE(flow__create, table, flow, flow->hash);
+        if (info.timed)
+            latency_record(table, G_INET_FLOW_STAGE_CREATE, start, 0);
     }
   exit:
+    G_INET_PROBE(get__return, table, flow);
     return flow;
 }
 
@@ -1010,37 +1608,65 @@ GInetFlow *g_inet_flow_create(GInetFlowTable * table, GInetTuple * tuple, uint64
 {
     GInetFlow *flow;
 
+    /* Callers may have changed the tuple since it was keyed */
+    g_inet_tuple_canonicalize(tuple);
+    if (!flow_source_allowed(table, tuple, timestamp ? : get_time_us()))
+        return NULL;
     /* Check if max table size is reached */
-    if (table->max > 0 && g_hash_table_size(table->table) >= table->max) {
+    if (flow_table_full(table) || !flow_table_quota(table, NULL)) {
+        flow_stats(table)->create_failed++;
+        G_INET_PROBE(flow__reject, table, g_inet_hash_size(table->flows));
         return NULL;
     }
 
     flow = (GInetFlow *) g_object_new(G_INET_TYPE_FLOW, NULL);
     flow->table = table;
+    table->state_count[FLOW_NEW]++;
     flow->list.data = flow;
     /* Set default lifetime before processing further */
     flow->lifetime = G_INET_FLOW_DEFAULT_NEW_TIMEOUT;
     flow->family = ((struct sockaddr *) &(tuple->src))->sa_family;
     flow->hash = g_inet_tuple_hash(tuple);
     flow->tuple = *tuple;
-    g_hash_table_replace(table->table, (gpointer) flow, (gpointer) flow);
+    g_inet_hash_insert(table->flows, &flow->node, flow_table_hash(&flow->tuple));
     flow->timestamp = timestamp ?: get_time_us();
     insert_flow_by_expiry(table, flow, flow->lifetime);
+    flow_stats(table)->created++;
+    G_INET_PROBE(flow__create, table, flow, flow->hash);
 
     return flow;
 }
 
+static void flow_node_unref(GInetHashNode * node, gpointer user_data)
+{
+    g_object_unref(flow_from_node(node));
+}
+
 static void g_inet_flow_table_finalize(GObject * object)
 {
     int i;
 
     GInetFlowTable *table = G_INET_FLOW_TABLE(object);
-    g_hash_table_remove_all(table->table);
-    g_hash_table_destroy(table->table);
+    g_inet_hash_remove_all(table->flows, flow_node_unref, NULL);
+    /* Recycled flows nobody collected */
+    while (!g_queue_is_empty(table->recycled))
+        g_object_unref(g_queue_peek_head(table->recycled));
+    g_queue_free(table->recycled);
+    g_inet_hash_free(table->flows);
     g_inet_frag_list_free(table->frag_info_list);
     for (i = 0; i < LIFETIME_COUNT; i++) {
         g_queue_free(table->expire_queue[i]);
     }
+    for (i = 0; i < G_INET_FLOW_STAGE_COUNT; i++) {
+        g_inet_histogram_free(table->latency[i]);
+    }
+    g_inet_filter_free(table->admission);
+    g_inet_limit_free(table->source_limit);
+    g_inet_sketch_free(table->top_flows);
+    g_inet_sketch_free(table->top_hosts);
+    g_free(table->cache);
+    g_list_free_full(table->stats, free);
+    g_mutex_clear(&table->stats_lock);
     G_OBJECT_CLASS(g_inet_flow_table_parent_class)->finalize(object);
 }
 
@@ -1048,16 +1674,30 @@ enum {
     TABLE_SIZE = 1,
     TABLE_HITS,
     TABLE_MISSES,
-    TABLE_MAX
+    TABLE_MAX,
+    TABLE_FRAG_EXPIRY,
+    TABLE_FRAG_STORED,
+    TABLE_FRAG_MATCHED,
+    TABLE_FRAG_EXPIRED,
+    TABLE_FRAG_DROPPED,
+    TABLE_FRAG_DEPTH,
+    TABLE_MEMORY,
+    TABLE_MEMORY_MAX,
+    TABLE_CAPACITY,
+    TABLE_NUMA_NODE,
+    TABLE_SAMPLE_RATE,
 };
 
 static void g_inet_flow_table_get_property(GObject * object, guint prop_id,
                                            GValue * value, GParamSpec * pspec)
 {
     GInetFlowTable *table = G_INET_FLOW_TABLE(object);
+    GInetFragStats frag_stats;
+
+    g_inet_frag_list_stats_get(table->frag_info_list, &frag_stats);
     switch (prop_id) {
     case TABLE_SIZE:
-        g_value_set_uint64(value, g_hash_table_size(table->table));
+        g_value_set_uint64(value, g_inet_hash_size(table->flows));
         break;
     case TABLE_HITS:
         g_value_set_uint64(value, table->hits);
@@ -1068,6 +1708,40 @@ static void g_inet_flow_table_get_property(GObject * object, guint prop_id,
     case TABLE_MAX:
         g_value_set_uint64(value, table->max);
         break;
+    case TABLE_FRAG_EXPIRY:
+        g_value_set_uint64(value, table->frag_info_list->expiry);
+        break;
+    case TABLE_FRAG_STORED:
+        g_value_set_uint64(value, frag_stats.stored);
+        break;
+    case TABLE_FRAG_MATCHED:
+        g_value_set_uint64(value, frag_stats.matched);
+        break;
+    case TABLE_FRAG_EXPIRED:
+        g_value_set_uint64(value, frag_stats.expired);
+        break;
+    case TABLE_FRAG_DROPPED:
+        g_value_set_uint64(value, frag_stats.dropped);
+        break;
+    case TABLE_FRAG_DEPTH:
+        g_value_set_uint64(value, frag_stats.depth);
+        break;
+    case TABLE_MEMORY:
+        g_value_set_uint64(value,
+                           flow_table_memory(table, g_inet_hash_size(table->flows), NULL));
+        break;
+    case TABLE_MEMORY_MAX:
+        g_value_set_uint64(value, table->memory_max);
+        break;
+    case TABLE_CAPACITY:
+        g_value_set_uint64(value, table->capacity);
+        break;
+    case TABLE_NUMA_NODE:
+        g_value_set_int(value, table->flows->node);
+        break;
+    case TABLE_SAMPLE_RATE:
+        g_value_set_uint64(value, MAX(table->sample_rate, 1));
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(table, prop_id, pspec);
         break;
@@ -1094,6 +1768,50 @@ static void g_inet_flow_table_class_init(GInetFlowTableClass * class)
                                     g_param_spec_uint64("max", "Max",
                                                         "Maximum number of flows allowed in the table",
                                                         0, 0, 0, G_PARAM_READABLE));
+    g_object_class_install_property(object_class, TABLE_FRAG_EXPIRY,
+                                    g_param_spec_uint64("frag-expiry", "Fragment expiry",
+                                                        "Seconds a fragment entry is kept waiting for the rest of its datagram",
+                                                        0, 0, 0, G_PARAM_READABLE));
+    g_object_class_install_property(object_class, TABLE_FRAG_STORED,
+                                    g_param_spec_uint64("frag-stored", "Fragments stored",
+                                                        "Total number of fragment entries created",
+                                                        0, 0, 0, G_PARAM_READABLE));
+    g_object_class_install_property(object_class, TABLE_FRAG_MATCHED,
+                                    g_param_spec_uint64("frag-matched", "Fragments matched",
+                                                        "Total number of fragments that matched a stored entry",
+                                                        0, 0, 0, G_PARAM_READABLE));
+    g_object_class_install_property(object_class, TABLE_FRAG_EXPIRED,
+                                    g_param_spec_uint64("frag-expired", "Fragments expired",
+                                                        "Total number of fragment entries that timed out",
+                                                        0, 0, 0, G_PARAM_READABLE));
+    g_object_class_install_property(object_class, TABLE_FRAG_DROPPED,
+                                    g_param_spec_uint64("frag-dropped", "Fragments dropped",
+                                                        "Total number of fragments not tracked because the list was full",
+                                                        0, 0, 0, G_PARAM_READABLE));
+    g_object_class_install_property(object_class, TABLE_FRAG_DEPTH,
+                                    g_param_spec_uint64("frag-depth", "Fragment depth",
+                                                        "Number of fragment entries currently held",
+                                                        0, 0, 0, G_PARAM_READABLE));
+    g_object_class_install_property(object_class, TABLE_MEMORY,
+                                    g_param_spec_uint64("memory", "Memory",
+                                                        "Bytes allocated for flows, hash table, expiry queues and fragments",
+                                                        0, 0, 0, G_PARAM_READABLE));
+    g_object_class_install_property(object_class, TABLE_MEMORY_MAX,
+                                    g_param_spec_uint64("memory-max", "Memory max",
+                                                        "Maximum number of bytes the table may use",
+                                                        0, 0, 0, G_PARAM_READABLE));
+    g_object_class_install_property(object_class, TABLE_CAPACITY,
+                                    g_param_spec_uint64("capacity", "Capacity",
+                                                        "Number of flows the hash table is sized for and never shrinks below",
+                                                        0, 0, 0, G_PARAM_READABLE));
+    g_object_class_install_property(object_class, TABLE_NUMA_NODE,
+                                    g_param_spec_int("numa-node", "NUMA node",
+                                                     "NUMA node the hash table is kept on (-1 for any)",
+                                                     -1, G_MAXINT, -1, G_PARAM_READABLE));
+    g_object_class_install_property(object_class, TABLE_SAMPLE_RATE,
+                                    g_param_spec_uint64("sample-rate", "Sample rate",
+                                                        "One in this many flows is tracked",
+                                                        0, 0, 0, G_PARAM_READABLE));
     object_class->finalize = g_inet_flow_table_finalize;
 }
 
@@ -1101,12 +1819,18 @@ static void g_inet_flow_table_init(GInetFlowTable * table)
 {
     int i;
 
-    table->table = g_hash_table_new_full((GHashFunc) flow_hash, (GEqualFunc) flow_compare, NULL, g_object_unref);
+    table->flows = g_inet_hash_new(flow_equal);
     table->frag_info_list = g_inet_frag_list_new();
+    table->sample_max = G_MAXUINT32;
+    g_inet_flow_table_cache_set(table, G_INET_FLOW_DEFAULT_CACHE_ENTRIES);
+    /* Never 0, which marks an unused per-thread cache slot */
+    table->id = g_atomic_int_add(&flow_table_ids, 1) + 1;
+    g_mutex_init(&table->stats_lock);
 
     for (i = 0; i < LIFETIME_COUNT; i++) {
         table->expire_queue[i] = g_queue_new();
     }
+    table->recycled = g_queue_new();
 }
 
 GInetFlowTable *g_inet_flow_table_new(void)
@@ -1114,11 +1838,243 @@ GInetFlowTable *g_inet_flow_table_new(void)
     return (GInetFlowTable *) g_object_new(G_INET_TYPE_FLOW_TABLE, NULL);
 }
 
+GInetFlowTable *g_inet_flow_table_new_full(guint64 capacity, guint64 max, guint64 memory_max,
+                                           guint frag_capacity, GInetFlowTableFlags flags)
+{
+    GInetFlowTable *table = g_inet_flow_table_new();
+
+    table->capacity = capacity;
+    table->max = max;
+    table->memory_max = memory_max;
+    table->flags = flags;
+    if (flags & G_INET_FLOW_TABLE_CUCKOO) {
+        g_inet_hash_free(table->flows);
+        table->flows = g_inet_hash_new_cuckoo(flow_equal);
+    }
+    table->flows->hugepages = ! !(flags & G_INET_FLOW_TABLE_HUGEPAGES);
+    g_inet_hash_reserve(table->flows, MIN(capacity, G_MAXUINT));
+    if (frag_capacity) {
+        g_inet_frag_list_depth_max_set(table->frag_info_list, frag_capacity);
+        g_inet_frag_list_pending_max_set(table->frag_info_list, frag_capacity,
+                                         table->frag_info_list->max_pending_bytes,
+                                         table->frag_info_list->max_pending_per_source);
+    }
+    return table;
+}
+
+/* Shrink the hash to the flows it holds now and hand freed memory back */
+void g_inet_flow_table_compact(GInetFlowTable * table)
+{
+    g_inet_hash_compact(table->flows, TRUE);
+    table->sparse_since = 0;
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+}
+
+gboolean g_inet_flow_table_numa_node_set(GInetFlowTable * table, gint node)
+{
+    return g_inet_hash_node_set(table->flows, node);
+}
+
 void g_inet_flow_table_max_set(GInetFlowTable * table, guint64 value)
 {
     table->max = value;
 }
 
+void g_inet_flow_table_state_max_set(GInetFlowTable * table, GInetFlowState state,
+                                     guint64 value)
+{
+    if (state < G_INET_FLOW_STATES)
+        table->state_max[state] = value;
+}
+
+void g_inet_flow_table_memory_max_set(GInetFlowTable * table, guint64 bytes)
+{
+    table->memory_max = bytes;
+}
+
+void g_inet_flow_table_memory_get(GInetFlowTable * table, GInetFlowTableMemory * memory)
+{
+    flow_table_memory(table, g_inet_hash_size(table->flows), memory);
+}
+
+void g_inet_flow_table_frag_expiry_set(GInetFlowTable * table, guint64 seconds)
+{
+    g_inet_frag_list_expiry_set(table->frag_info_list, seconds);
+}
+
+void g_inet_flow_table_latency_set(GInetFlowTable * table, guint sample_rate)
+{
+    int i;
+
+    for (i = 0; i < G_INET_FLOW_STAGE_COUNT; i++) {
+        if (!sample_rate) {
+            g_inet_histogram_free(table->latency[i]);
+            table->latency[i] = NULL;
+        } else if (!table->latency[i]) {
+            table->latency[i] = g_inet_histogram_new();
+        } else {
+            g_inet_histogram_reset(table->latency[i]);
+        }
+    }
+    table->latency_rate = sample_rate;
+    table->latency_count = 0;
+}
+
+void g_inet_flow_table_admission_set(GInetFlowTable * table, guint packets, guint cells)
+{
+    g_inet_filter_free(table->admission);
+    table->admission = NULL;
+    if (packets > 1)
+        table->admission =
+            g_inet_filter_new(cells ? : G_INET_FLOW_DEFAULT_ADMISSION_CELLS, packets,
+                              G_INET_FLOW_DEFAULT_NEW_TIMEOUT * TIMESTAMP_RESOLUTION_US);
+}
+
+void g_inet_flow_table_sample_set(GInetFlowTable * table, guint rate)
+{
+    table->sample_rate = rate;
+    /* The top bits pick the sample - buckets are indexed by the low ones */
+    table->sample_max = rate > 1 ? G_MAXUINT32 / rate : G_MAXUINT32;
+}
+
+void g_inet_flow_table_source_limit_set(GInetFlowTable * table, guint rate, guint burst,
+                                        guint sources)
+{
+    g_inet_limit_free(table->source_limit);
+    table->source_limit = NULL;
+    if (rate)
+        table->source_limit =
+            g_inet_limit_new(sources ? : G_INET_FLOW_DEFAULT_LIMIT_SOURCES, rate, burst);
+}
+
+void g_inet_flow_table_cache_set(GInetFlowTable * table, guint entries)
+{
+    guint32 size = 64;
+
+    g_free(table->cache);
+    table->cache = NULL;
+    table->cache_mask = 0;
+    if (entries) {
+        while (size < entries && size < (1U << 24))
+            size <<= 1;
+        table->cache = g_new0(flow_cache_t, size);
+        table->cache_mask = size - 1;
+    }
+}
+
+void g_inet_flow_table_top_set(GInetFlowTable * table, guint k, guint width,
+                               GInetFlowTopRank rank)
+{
+    GInetSketchRank by = rank == G_INET_FLOW_TOP_BYTES ? G_INET_SKETCH_BYTES :
+        G_INET_SKETCH_PACKETS;
+
+    g_inet_sketch_free(table->top_flows);
+    g_inet_sketch_free(table->top_hosts);
+    table->top_flows = table->top_hosts = NULL;
+    if (k) {
+        width = width ? : G_INET_FLOW_DEFAULT_TOP_WIDTH;
+        table->top_flows = g_inet_sketch_new(width, k, sizeof(GInetTuple), by);
+        table->top_hosts = g_inet_sketch_new(width, k, sizeof(struct sockaddr_storage), by);
+    }
+}
+
+guint g_inet_flow_table_top_flows(GInetFlowTable * table, GInetFlowTop * top, guint n)
+{
+    GInetSketchEntry *entries;
+    guint count, i;
+
+    if (!table->top_flows)
+        return 0;
+    entries = g_new(GInetSketchEntry, table->top_flows->k);
+    count = MIN(g_inet_sketch_top(table->top_flows, entries), n);
+    for (i = 0; i < count; i++) {
+        memcpy(&top[i].tuple, g_inet_sketch_key(table->top_flows, &entries[i]),
+               sizeof(GInetTuple));
+        top[i].packets = entries[i].count[G_INET_SKETCH_PACKETS];
+        top[i].bytes = entries[i].count[G_INET_SKETCH_BYTES];
+    }
+    g_free(entries);
+    return count;
+}
+
+guint g_inet_flow_table_top_hosts(GInetFlowTable * table, GInetFlowTopHost * top, guint n)
+{
+    GInetSketchEntry *entries;
+    guint count, i;
+
+    if (!table->top_hosts)
+        return 0;
+    entries = g_new(GInetSketchEntry, table->top_hosts->k);
+    count = MIN(g_inet_sketch_top(table->top_hosts, entries), n);
+    for (i = 0; i < count; i++) {
+        memcpy(&top[i].address, g_inet_sketch_key(table->top_hosts, &entries[i]),
+               sizeof(struct sockaddr_storage));
+        top[i].packets = entries[i].count[G_INET_SKETCH_PACKETS];
+        top[i].bytes = entries[i].count[G_INET_SKETCH_BYTES];
+    }
+    g_free(entries);
+    return count;
+}
+
+gboolean g_inet_flow_table_latency_get(GInetFlowTable * table, GInetFlowStage stage,
+                                       GInetFlowLatency * latency)
+{
+    GInetHistogram *histogram;
+
+    if (stage >= G_INET_FLOW_STAGE_COUNT || !(histogram = table->latency[stage]))
+        return FALSE;
+    latency->samples = histogram->count;
+    latency->p50 = g_inet_histogram_percentile(histogram, 50.0);
+    latency->p99 = g_inet_histogram_percentile(histogram, 99.0);
+    latency->p999 = g_inet_histogram_percentile(histogram, 99.9);
+    latency->max = histogram->max;
+    return TRUE;
+}
+
+void g_inet_flow_table_stats_get(GInetFlowTable * table, GInetFlowTableStats * stats)
+{
+    GList *iter;
+    int i;
+
+    memset(stats, 0, sizeof(GInetFlowTableStats));
+    stats->size = g_inet_hash_size(table->flows);
+    stats->hits = table->hits;
+    stats->misses = table->misses;
+    stats->sample_rate = MAX(table->sample_rate, 1);
+    for (i = 0; i < G_INET_FLOW_STATES; i++)
+        stats->states[i] = table->state_count[i];
+
+    g_mutex_lock(&table->stats_lock);
+    for (iter = table->stats; iter; iter = iter->next) {
+        flow_stats_t *thread = (flow_stats_t *) iter->data;
+        stats->created += __atomic_load_n(&thread->created, __ATOMIC_RELAXED);
+        stats->create_failed += __atomic_load_n(&thread->create_failed, __ATOMIC_RELAXED);
+        for (i = 0; i < G_INET_FLOW_STATES; i++) {
+            stats->expired[i] += __atomic_load_n(&thread->expired[i], __ATOMIC_RELAXED);
+            stats->recycled[i] += __atomic_load_n(&thread->recycled[i], __ATOMIC_RELAXED);
+            stats->refused[i] += __atomic_load_n(&thread->refused[i], __ATOMIC_RELAXED);
+        }
+        for (i = 0; i < G_INET_FLOW_PARSE_FAILURE_COUNT; i++)
+            stats->parse_failed[i] +=
+                __atomic_load_n(&thread->parse_failed[i], __ATOMIC_RELAXED);
+        stats->tunnels += __atomic_load_n(&thread->tunnels, __ATOMIC_RELAXED);
+        stats->unadmitted += __atomic_load_n(&thread->unadmitted, __ATOMIC_RELAXED);
+        stats->throttled += __atomic_load_n(&thread->throttled, __ATOMIC_RELAXED);
+        stats->throttled_sources +=
+            __atomic_load_n(&thread->throttled_sources, __ATOMIC_RELAXED);
+        stats->unsampled += __atomic_load_n(&thread->unsampled, __ATOMIC_RELAXED);
+        stats->cache_hits += __atomic_load_n(&thread->cache_hits, __ATOMIC_RELAXED);
+        stats->cache_misses += __atomic_load_n(&thread->cache_misses, __ATOMIC_RELAXED);
+    }
+    g_mutex_unlock(&table->stats_lock);
+
+    g_inet_frag_list_stats_get(table->frag_info_list, &stats->fragments);
+
+    g_inet_hash_chains(table->flows, &stats->chains, &stats->chain_max);
+}
+
 void g_inet_flow_foreach(GInetFlowTable * table, GIFFunc func, gpointer user_data)
 {
     int i;
@@ -1135,31 +2091,47 @@ GInetTuple *g_inet_flow_parse(const guint8 * frame, guint length, GInetFragList
 {
     if (!result)
         result = calloc(1, sizeof(GInetTuple));
-    flow_parse(result, frame, length, fragments, NULL, 0, NULL, inspect_tunnel);
+    flow_parse(result, frame, length, fragments, NULL, 0, NULL, NULL, inspect_tunnel);
+    g_inet_tuple_canonicalize(result);
     return result;
 }
 
 GInetFlow *g_inet_flow_lookup(GInetFlowTable * table, GInetTuple * tuple)
 {
-    GInetFlow packet;
+    GInetHashNode *node;
 
-    packet.tuple = *tuple;
-    packet.hash = 0;
-    return (GInetFlow *) g_hash_table_lookup(table->table, &packet);
+    g_inet_tuple_canonicalize(tuple);
+    node = g_inet_hash_lookup(table->flows, flow_table_hash(tuple), tuple);
+    return node ? flow_from_node(node) : NULL;
 }
 
 void g_inet_flow_establish(GInetFlowTable * table, GInetFlow * flow)
 {
+    GInetFlowState state = flow->state;
+    guint64 lifetime = flow->lifetime;
+
+    /* A recycled flow stays first in line for g_inet_flow_expire */
+    if (flow->recycled)
+        return;
     remove_flow_by_expiry(table, flow, flow->lifetime);
     flow->state = FLOW_OPEN;
     flow->lifetime = G_INET_FLOW_DEFAULT_OPEN_TIMEOUT;
+    if (flow->state != state)
+        flow_state_changed(flow, state, lifetime);
     insert_flow_by_expiry(table, flow, flow->lifetime);
 }
 
 void g_inet_flow_close(GInetFlowTable * table, GInetFlow * flow)
 {
+    GInetFlowState state = flow->state;
+    guint64 lifetime = flow->lifetime;
+
+    if (flow->recycled)
+        return;
     remove_flow_by_expiry(table, flow, flow->lifetime);
     flow->state = FLOW_CLOSED;
     flow->lifetime = G_INET_FLOW_DEFAULT_CLOSED_TIMEOUT;
+    if (flow->state != state)
+        flow_state_changed(flow, state, lifetime);
     insert_flow_by_expiry(table, flow, flow->lifetime);
 }
@@ -40,6 +40,26 @@ typedef enum {
     FLOW_CLOSED,
 } GInetFlowState;
 
+#define G_INET_FLOW_STATES   (FLOW_CLOSED + 1)
+
+/* TCP connection states, tracked from the flags seen in each direction.
+ * Each maps to one of the flow states above and its own timeout. */
+typedef enum {
+    FLOW_TCP_NONE,
+    FLOW_TCP_SYN_SENT,
+    FLOW_TCP_SYN_RECV,
+    FLOW_TCP_ESTABLISHED,
+    /* One end has sent a FIN, not yet acknowledged */
+    FLOW_TCP_FIN_WAIT,
+    /* One end's FIN is acknowledged and the other end may still send */
+    FLOW_TCP_CLOSE_WAIT,
+    /* Both ends have sent a FIN, the last not yet acknowledged */
+    FLOW_TCP_LAST_ACK,
+    FLOW_TCP_TIME_WAIT,
+    /* Reset */
+    FLOW_TCP_CLOSE,
+} GInetFlowTcpState;
+
 /* Flow Directions */
 typedef enum {
     FLOW_DIRECTION_UNKNOWN,
@@ -47,13 +67,153 @@ typedef enum {
     FLOW_DIRECTION_REPLY,
 } GInetFlowDirection;
 
+/* Stages of g_inet_flow_get_full timed when latency sampling is enabled */
+typedef enum {
+    G_INET_FLOW_STAGE_PARSE,
+    G_INET_FLOW_STAGE_LOOKUP,
+    G_INET_FLOW_STAGE_CREATE,
+    G_INET_FLOW_STAGE_EXPIRY,
+    G_INET_FLOW_STAGE_FRAGMENT,
+    G_INET_FLOW_STAGE_COUNT,
+} GInetFlowStage;
+
+/* Latency of a stage in nanoseconds */
+typedef struct _GInetFlowLatency {
+    guint64 samples;
+    guint64 p50;
+    guint64 p99;
+    guint64 p999;
+    guint64 max;
+} GInetFlowLatency;
+
+/* Why a packet could not be parsed into a tuple */
+typedef enum {
+    G_INET_FLOW_PARSE_TRUNCATED,
+    G_INET_FLOW_PARSE_UNSUPPORTED_ETHERTYPE,
+    G_INET_FLOW_PARSE_TOO_MANY_TAGS,
+    G_INET_FLOW_PARSE_UNSUPPORTED_IP_VERSION,
+    G_INET_FLOW_PARSE_FRAGMENT,
+    G_INET_FLOW_PARSE_FAILURE_COUNT,
+} GInetFlowParseFailure;
+
+/* What the heaviest flows and hosts are ranked by */
+typedef enum {
+    G_INET_FLOW_TOP_PACKETS,
+    G_INET_FLOW_TOP_BYTES,
+} GInetFlowTopRank;
+
+/* A heavy hitter's estimated packets and bytes (frame lengths). Estimates
+ * never undercount and overcount by a small fraction of all traffic. */
+typedef struct _GInetFlowTop {
+    GInetTuple tuple;
+    guint64 packets;
+    guint64 bytes;
+} GInetFlowTop;
+
+/* A source address and what it has sent */
+typedef struct _GInetFlowTopHost {
+    struct sockaddr_storage address;
+    guint64 packets;
+    guint64 bytes;
+} GInetFlowTopHost;
+
+/* Snapshot of table health */
+typedef struct _GInetFlowTableStats {
+    guint64 size;
+    guint64 hits;
+    guint64 misses;
+    guint64 created;
+    /* Flows not created because the table was at max */
+    guint64 create_failed;
+    /* Flows returned by g_inet_flow_expire, by state */
+    guint64 expired[G_INET_FLOW_STATES];
+    /* Flows in each state now, those dropped for its quota and the moves
+     * into it the quota turned down */
+    guint64 states[G_INET_FLOW_STATES];
+    guint64 recycled[G_INET_FLOW_STATES];
+    guint64 refused[G_INET_FLOW_STATES];
+    guint64 parse_failed[G_INET_FLOW_PARSE_FAILURE_COUNT];
+    /* Tunnel headers (GRE, IP in IPv6) stripped */
+    guint64 tunnels;
+    /* Packets given no flow because their tuple was not yet admitted */
+    guint64 unadmitted;
+    /* Flows not created as their source was over its rate, and the number
+     * of times a source went over */
+    guint64 throttled;
+    guint64 throttled_sources;
+    /* One in sample_rate flows is tracked - scale flow counts by it. Packets
+     * of the others are only counted. */
+    guint64 sample_rate;
+    guint64 unsampled;
+    /* Lookups answered by the flow cache, and those that went to the hash */
+    guint64 cache_hits;
+    guint64 cache_misses;
+    GInetFragStats fragments;
+    /* Hash buckets in use and the longest chain of flows in one */
+    guint64 chains;
+    guint64 chain_max;
+} GInetFlowTableStats;
+
+/* Bytes allocated by a table. Data attached with g_object_set_data is
+ * owned by the caller and not included. */
+typedef struct _GInetFlowTableMemory {
+    guint64 flows;
+    guint64 hash;
+    /* Of hash, bytes on reserved huge pages */
+    guint64 hugepages;
+    guint64 expiry;
+    guint64 fragments;
+    /* Table, statistics, latency histograms, admission filter and source
+     * rate limits */
+    guint64 other;
+    guint64 total;
+} GInetFlowTableMemory;
+
 /* Default timeouts */
 #define G_INET_FLOW_DEFAULT_NEW_TIMEOUT         30
 #define G_INET_FLOW_DEFAULT_OPEN_TIMEOUT        300
 #define G_INET_FLOW_DEFAULT_CLOSED_TIMEOUT      10
+/* TCP connections with one end closed, and fully closed or reset */
+#define G_INET_FLOW_DEFAULT_HALF_CLOSED_TIMEOUT 60
+#define G_INET_FLOW_DEFAULT_TIME_WAIT_TIMEOUT   2
+/* Seconds the hash must stay under 1/8 full before it is shrunk */
+#define G_INET_FLOW_DEFAULT_COMPACT_DELAY       60
+/* Admission filter cells per generation, a byte each */
+#define G_INET_FLOW_DEFAULT_ADMISSION_CELLS     (1 << 20)
+/* Flow cache slots, 16 bytes each */
+#define G_INET_FLOW_DEFAULT_CACHE_ENTRIES       4096
+/* Heavy hitter sketch counters per row, 16 bytes each */
+#define G_INET_FLOW_DEFAULT_TOP_WIDTH           (1 << 14)
+/* Source addresses tracked for rate limiting */
+#define G_INET_FLOW_DEFAULT_LIMIT_SOURCES       (1 << 16)
+
+/* NUMA placement: no preference, or the node of the calling thread */
+#define G_INET_FLOW_NUMA_ANY                    (-1)
+#define G_INET_FLOW_NUMA_LOCAL                  (-2)
+
+typedef enum {
+    G_INET_FLOW_TABLE_DEFAULT = 0,
+    /* Keep the hash at its peak size rather than shrinking it from expiry */
+    G_INET_FLOW_TABLE_NO_COMPACT = 1 << 0,
+    /* Map hash buckets (2MB and up) on reserved huge pages, falling back to
+     * transparent huge pages. Flows come from the GObject allocator; with
+     * glibc 2.35+ set GLIBC_TUNABLES=glibc.malloc.hugetlb=1 to cover them. */
+    G_INET_FLOW_TABLE_HUGEPAGES = 1 << 1,
+    /* Keep flows in a bucketized cuckoo hash rather than chains. Lookups
+     * read at most two buckets and it runs up to 95% full, so a capacity
+     * of max holds the table at its limit in little more than 12 bytes a
+     * flow. Growing rebuilds it in one go. */
+    G_INET_FLOW_TABLE_CUCKOO = 1 << 2,
+} GInetFlowTableFlags;
 
 
 GInetFlowTable *g_inet_flow_table_new(void);
+/* Size the hash for capacity flows up front (it never shrinks below that),
+ * and limit the table to max flows, memory_max bytes (as
+ * g_inet_flow_table_memory_max_set) and frag_capacity fragment entries,
+ * all of which may be pending (0 leaves the defaults) */
+GInetFlowTable *g_inet_flow_table_new_full(guint64 capacity, guint64 max, guint64 memory_max,
+                                           guint frag_capacity, GInetFlowTableFlags flags);
 GInetFlow *g_inet_flow_get(GInetFlowTable * table, const guint8 * frame, guint length);
 GInetFlow *g_inet_flow_get_full(GInetFlowTable * table, const guint8 * frame,
                                 guint length, guint16 hash, guint64 timestamp,
@@ -74,6 +234,59 @@ GInetTuple *g_inet_flow_parse_ip(const guint8 * iphdr, guint length, GInetFragLi
 typedef void (*GIFFunc) (GInetFlow * flow, gpointer user_data);
 void g_inet_flow_foreach(GInetFlowTable * table, GIFFunc func, gpointer user_data);
 void g_inet_flow_table_max_set(GInetFlowTable * table, guint64 value);
+/* Limit the flows in one state (0 for no limit). A flow joining a full NEW,
+ * including a new flow, recycles the least recently active new flow: it
+ * leaves the hash and is the next flow g_inet_flow_expire returns. A flow
+ * moving into a full OPEN or CLOSED stays in its current state instead. */
+void g_inet_flow_table_state_max_set(GInetFlowTable * table, GInetFlowState state,
+                                     guint64 value);
+void g_inet_flow_table_compact(GInetFlowTable * table);
+/* Keep the flow hash on a NUMA node. Call with G_INET_FLOW_NUMA_LOCAL from
+ * the thread that will use the table. Flows are placed by the allocator of
+ * the thread creating them. FALSE if the hash could not be bound (no NUMA
+ * support, no such node or the local node is unknown), when it is left
+ * where the kernel puts it and "numa-node" reads G_INET_FLOW_NUMA_ANY. */
+gboolean g_inet_flow_table_numa_node_set(GInetFlowTable * table, gint node);
+/* Limit the table by bytes instead of (or as well as) by flow count */
+void g_inet_flow_table_memory_max_set(GInetFlowTable * table, guint64 bytes);
+void g_inet_flow_table_memory_get(GInetFlowTable * table, GInetFlowTableMemory * memory);
+void g_inet_flow_table_frag_expiry_set(GInetFlowTable * table, guint64 seconds);
+/* Time one in every sample_rate packets (0 disables and frees the histograms) */
+void g_inet_flow_table_latency_set(GInetFlowTable * table, guint sample_rate);
+/* Only create a flow once its tuple has been seen in packets packets, or in
+ * both directions, within the NEW timeout. Until then g_inet_flow_get_full
+ * returns NULL and counts the packet as unadmitted. cells sizes the filter
+ * (0 for the default) and packets below 2 turn it off. */
+void g_inet_flow_table_admission_set(GInetFlowTable * table, guint packets, guint cells);
+/* Track only the one in rate flows picked by their (direction independent)
+ * hash, skipping the others straight after parsing. Raising the rate keeps
+ * a subset of the flows sampled before; flows no longer sampled expire. */
+void g_inet_flow_table_sample_set(GInetFlowTable * table, guint rate);
+/* Let each source address create at most rate flows a second, in bursts of
+ * up to burst. Packets of flows refused return NULL and count as throttled.
+ * sources sizes the table of addresses (0 for the default), whose least
+ * recently seen entries are reused. A rate of 0 turns it off. */
+void g_inet_flow_table_source_limit_set(GInetFlowTable * table, guint rate, guint burst,
+                                        guint sources);
+/* Size the cache of recently used flows looked at before the hash (0 turns
+ * it off). It starts empty. */
+void g_inet_flow_table_cache_set(GInetFlowTable * table, guint entries);
+/* Keep a count-min sketch of the packets and bytes of every flow and
+ * source address, and the k of each counted highest by rank. Packets are
+ * counted once parsed whether or not they get a flow, except those skipped
+ * by sampling (g_inet_flow_table_sample_set) and lookups that do not
+ * update. width sizes
+ * the sketch (0 for the default), k of 0 turns it off, and setting it again
+ * starts the counts afresh. */
+void g_inet_flow_table_top_set(GInetFlowTable * table, guint k, guint width,
+                               GInetFlowTopRank rank);
+/* Copy up to n of the heaviest flows or sources into top, heaviest first,
+ * and return how many were copied */
+guint g_inet_flow_table_top_flows(GInetFlowTable * table, GInetFlowTop * top, guint n);
+guint g_inet_flow_table_top_hosts(GInetFlowTable * table, GInetFlowTopHost * top, guint n);
+gboolean g_inet_flow_table_latency_get(GInetFlowTable * table, GInetFlowStage stage,
+                                       GInetFlowLatency * latency);
+void g_inet_flow_table_stats_get(GInetFlowTable * table, GInetFlowTableStats * stats);
 GInetFlow *g_inet_flow_lookup(GInetFlowTable * table, GInetTuple * tuple);
 
 G_END_DECLS
@@ -18,28 +18,32 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <sys/time.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include <glib.h>
 #include <gio/gio.h>
 
 #include "ginettuple.h"
 #include "ginetfraglist.h"
+#include "ginetprobes.h"
 
 #include <netinet/in.h>
 
 #define DEBUG(fmt, args...)
 //#define DEBUG(fmt, args...) {g_printf("%s: ",__func__);g_printf (fmt, ## args);}
 
-#define FRAG_EXPIRY_TIME    30
 #define TIMESTAMP_RESOLUTION_US    1000000
-#define MAX_FRAG_DEPTH      128
 
+/* The flow clock, so entries stored without a timestamp age on the
+ * timer that drives g_inet_flow_expire */
 static inline guint64 get_time(void)
 {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return (tv.tv_sec * (guint64) TIMESTAMP_RESOLUTION_US + tv.tv_usec);
+    struct timespec now;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &now) == 0)
+        return (now.tv_sec * (guint64) TIMESTAMP_RESOLUTION_US + (now.tv_nsec / 1000));
+    else
+        return 0;
 }
 
 static int address_comparison(struct sockaddr_storage *a, struct sockaddr_storage *b)
@@ -85,70 +89,208 @@ static int find_flow_by_frag_info(gconstpointer a, gconstpointer b)
     return 1;
 }
 
-static gboolean frag_is_expired(GInetFragment * frag_info, guint64 timestamp)
+static guint frag_bucket_index(GInetFragment * f)
+{
+    guint32 hash = f->id;
+    int i;
+
+    /* Symmetric in the addresses, matching find_flow_by_frag_info */
+    if (f->tuple.src.ss_family == AF_INET) {
+        hash ^= ((struct sockaddr_in *) &f->tuple.src)->sin_addr.s_addr;
+        hash ^= ((struct sockaddr_in *) &f->tuple.dst)->sin_addr.s_addr;
+    } else {
+        guint32 *src = (guint32 *) & ((struct sockaddr_in6 *) &f->tuple.src)->sin6_addr;
+        guint32 *dst = (guint32 *) & ((struct sockaddr_in6 *) &f->tuple.dst)->sin6_addr;
+        for (i = 0; i < 4; i++)
+            hash ^= src[i] ^ dst[i];
+    }
+    hash ^= hash >> 16;
+    hash *= 0x45d9f3b;
+    hash ^= hash >> 16;
+    return hash % G_INET_FRAG_LIST_BUCKETS;
+}
+
+#define FRAG_STAT_INC(__s) __atomic_add_fetch(&(__s), 1, __ATOMIC_RELAXED)
+#define FRAG_STAT_ADD(__s, __v) __atomic_add_fetch(&(__s), (__v), __ATOMIC_RELAXED)
+#define FRAG_STAT_GET(__s) __atomic_load_n(&(__s), __ATOMIC_RELAXED)
+
+static guint frag_source_slot(GInetFragment * f)
+{
+    guint32 hash = 0;
+    int i;
+
+    if (f->tuple.src.ss_family == AF_INET) {
+        hash = ((struct sockaddr_in *) &f->tuple.src)->sin_addr.s_addr;
+    } else {
+        guint32 *src = (guint32 *) & ((struct sockaddr_in6 *) &f->tuple.src)->sin6_addr;
+        for (i = 0; i < 4; i++)
+            hash ^= src[i];
+    }
+    hash ^= hash >> 16;
+    hash *= 0x45d9f3b;
+    hash ^= hash >> 16;
+    return hash % G_INET_FRAG_LIST_SOURCE_SLOTS;
+}
+
+static gboolean frag_is_expired(GInetFragList * fragments, GInetFragment * frag_info,
+                                guint64 timestamp)
 {
-    if (timestamp - frag_info->timestamp > FRAG_EXPIRY_TIME * TIMESTAMP_RESOLUTION_US)
+    if (timestamp > frag_info->timestamp &&
+        timestamp - frag_info->timestamp > fragments->expiry * TIMESTAMP_RESOLUTION_US)
         return TRUE;
     return FALSE;
 }
 
-static guint16 clear_expired_frag_info(GInetFragList * frag_info_list, guint64 timestamp)
+static void release_pending_frag_info(GInetFragList * fragments, GInetFragment * entry)
+{
+    g_atomic_int_add(&fragments->pending, -1);
+    g_atomic_int_add(&fragments->pending_bytes, -(gint) entry->bytes);
+    g_atomic_int_add(&fragments->pending_per_source[frag_source_slot(entry)], -1);
+    entry->pending = FALSE;
+    entry->packets = 0;
+    entry->bytes = 0;
+}
+
+/* Caller must hold the bucket writer lock */
+static void free_frag_info(GInetFragList * fragments, GInetFragBucket * bucket, GList * link)
+{
+    GInetFragment *entry = link->data;
+
+    if (entry->pending)
+        release_pending_frag_info(fragments, entry);
+    g_queue_delete_link(&bucket->queue, link);
+    g_atomic_int_add(&fragments->count, -1);
+    free(entry);
+}
+
+/* Entries are queued in arrival order so only the tail needs checking.
+ * Caller must hold the bucket writer lock */
+static guint16 clear_expired_bucket(GInetFragList * fragments, GInetFragBucket * bucket,
+                                    guint64 timestamp)
 {
     guint16 cleared = 0;
-    GList *l = frag_info_list->head;
-    while (l != NULL) {
-        GList *next = l->next;
-        if (frag_is_expired(l->data, timestamp)) {
-            struct frag_info *frag_info = (struct frag_info *) (l->data);
-            free(l->data);
-            frag_info_list->head = g_list_delete_link(frag_info_list->head, l);
-            cleared += 1;
-        }
-        l = next;
+    GList *l;
+
+    while ((l = g_queue_peek_tail_link(&bucket->queue)) != NULL &&
+           frag_is_expired(fragments, l->data, timestamp)) {
+        free_frag_info(fragments, bucket, l);
+        cleared += 1;
+    }
+    if (cleared) {
+        FRAG_STAT_ADD(fragments->expired, cleared);
+        G_INET_PROBE(frag__expire, fragments, cleared);
     }
     return cleared;
 }
 
-static gboolean store_frag_info(GInetFragList * fragments, GInetFragment * f, guint64 ts)
+/* Called with the writer lock of "locked" held - other buckets are only
+ * swept if they can be taken without waiting, to avoid lock ordering issues. */
+static guint16 clear_expired_other_buckets(GInetFragList * fragments,
+                                           GInetFragBucket * locked, guint64 timestamp)
+{
+    guint16 cleared = 0;
+    int i;
+
+    for (i = 0; i < G_INET_FRAG_LIST_BUCKETS; i++) {
+        GInetFragBucket *bucket = &fragments->buckets[i];
+        if (bucket == locked || !g_rw_lock_writer_trylock(&bucket->lock))
+            continue;
+        cleared += clear_expired_bucket(fragments, bucket, timestamp);
+        g_rw_lock_writer_unlock(&bucket->lock);
+    }
+    return cleared;
+}
+
+/* Count one more entry unless the list is full. Other buckets store at
+ * the same time, so the check and the increment are one step. */
+static gboolean frag_count_take(GInetFragList * fragments)
+{
+    gint count = g_atomic_int_get(&fragments->count);
+
+    do {
+        if (count >= (gint) fragments->max_depth)
+            return FALSE;
+    } while (!__atomic_compare_exchange_n(&fragments->count, &count, count + 1, TRUE,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return TRUE;
+}
+
+/* Caller must hold the bucket writer lock */
+static GInetFragment *store_frag_info(GInetFragList * fragments, GInetFragBucket * bucket,
+                                      GInetFragment * f, guint64 ts)
 {
     uint64_t timestamp = ts ? : get_time();
     guint32 id = f->id;
 
-    g_rw_lock_writer_lock(&fragments->lock);
-    if (g_list_length(fragments->head) >= MAX_FRAG_DEPTH) {
-        if (clear_expired_frag_info(fragments, timestamp) == 0) {
-            DEBUG("Fragment tracking limit reached\n");
-            g_rw_lock_writer_unlock(&fragments->lock);
-            return FALSE;
-        }
+    if (!frag_count_take(fragments) &&
+        ((clear_expired_bucket(fragments, bucket, timestamp) == 0 &&
+          clear_expired_other_buckets(fragments, bucket, timestamp) == 0) ||
+         !frag_count_take(fragments))) {
+        DEBUG("Fragment tracking limit reached\n");
+        FRAG_STAT_INC(fragments->dropped);
+        G_INET_PROBE(frag__drop, fragments, id);
+        return NULL;
     }
     GInetFragment *entry = g_malloc0(sizeof(GInetFragment));
     entry->id = id;
     entry->tuple = f->tuple;
     entry->timestamp = timestamp;
-    fragments->head = g_list_prepend(fragments->head, entry);
-    g_rw_lock_writer_unlock(&fragments->lock);
-    return TRUE;
+    g_queue_push_head(&bucket->queue, entry);
+    FRAG_STAT_INC(fragments->stored);
+    G_INET_PROBE(frag__store, fragments, id, f->offset != 0);
+    return entry;
 }
 
-gboolean g_inet_frag_list_update(GInetFragList * fragments, GInetFragment * entry,
-                                 gboolean more_fragments)
+static gboolean pending_frag_fits(GInetFragList * fragments, guint32 bytes)
 {
-    GList *match;
+    return g_atomic_int_get(&fragments->pending_bytes) + (guint64) bytes <=
+        fragments->max_pending_bytes;
+}
 
-    /* If there are no more fragments, we need a write lock to remove the entry */
-    (more_fragments ? g_rw_lock_reader_lock : g_rw_lock_writer_lock) (&fragments->lock);
-    match = g_list_find_custom(fragments->head, entry, find_flow_by_frag_info);
+/* Hold the metadata of a non-first fragment until its first fragment
+ * arrives. Caller must hold the bucket writer lock */
+static void store_pending_frag_info(GInetFragList * fragments, GInetFragBucket * bucket,
+                                    GInetFragment * f, guint64 ts)
+{
+    gint *source = &fragments->pending_per_source[frag_source_slot(f)];
+    GInetFragment *entry;
 
-    /* If we didn't find a match, store this fragment for later */
-    if (!match) {
-        (more_fragments ? g_rw_lock_reader_unlock : g_rw_lock_writer_unlock) (&fragments->
-                                                                              lock);
-        return store_frag_info(fragments, entry, entry->timestamp);
+    if (g_atomic_int_get(&fragments->pending) >= (gint) fragments->max_pending ||
+        g_atomic_int_get(source) >= (gint) fragments->max_pending_per_source ||
+        !pending_frag_fits(fragments, f->bytes)) {
+        DEBUG("Pending fragment limit reached\n");
+        FRAG_STAT_INC(fragments->dropped);
+        G_INET_PROBE(frag__drop, fragments, f->id);
+        return;
     }
+    entry = store_frag_info(fragments, bucket, f, ts);
+    if (!entry)
+        return;
+    entry->pending = TRUE;
+    entry->packets = 1;
+    entry->bytes = f->bytes;
+    g_atomic_int_add(&fragments->pending, 1);
+    g_atomic_int_add(&fragments->pending_bytes, f->bytes);
+    g_atomic_int_add(source, 1);
+}
 
-    GInetFragment *found_flow = match->data;
+/* Another non-first fragment for a datagram that is still pending */
+static void add_pending_frag_info(GInetFragList * fragments, GInetFragment * found,
+                                  GInetFragment * f)
+{
+    if (!pending_frag_fits(fragments, f->bytes)) {
+        DEBUG("Pending fragment byte limit reached\n");
+        FRAG_STAT_INC(fragments->dropped);
+        G_INET_PROBE(frag__drop, fragments, f->id);
+        return;
+    }
+    found->packets++;
+    found->bytes += f->bytes;
+    g_atomic_int_add(&fragments->pending_bytes, f->bytes);
+}
 
+static void copy_frag_ports(GInetFragment * entry, GInetFragment * found_flow)
+{
     /* Match source port / address etc - could be either way around */
     if (found_flow->tuple.src.ss_family == AF_INET) {
         ((struct sockaddr_in *) &entry->tuple.src)->sin_port =
@@ -161,26 +303,168 @@ gboolean g_inet_frag_list_update(GInetFragList * fragments, GInetFragment * entr
         ((struct sockaddr_in6 *) &entry->tuple.dst)->sin6_port =
             ((struct sockaddr_in6 *) &found_flow->tuple.dst)->sin6_port;
     }
-    /* If this is the last IP fragment (MF is unset), clean up the list */
-    if (!more_fragments) {
-        fragments->head = g_list_remove_link(fragments->head, match);
-        free(match->data);
-        g_list_free(match);
+}
+
+gboolean g_inet_frag_list_update(GInetFragList * fragments, GInetFragment * entry,
+                                 gboolean more_fragments)
+{
+    GInetFragBucket *bucket = &fragments->buckets[frag_bucket_index(entry)];
+    GInetFragment *found;
+    GList *match;
+    gboolean result = TRUE;
+
+    /* Middle fragments of a known datagram only read the stored ports,
+     * so share the bucket */
+    if (more_fragments) {
+        g_rw_lock_reader_lock(&bucket->lock);
+        match = g_queue_find_custom(&bucket->queue, entry, find_flow_by_frag_info);
+        if (match && !((GInetFragment *) match->data)->pending) {
+            copy_frag_ports(entry, match->data);
+            FRAG_STAT_INC(fragments->matched);
+            G_INET_PROBE(frag__match, fragments, entry->id);
+            g_rw_lock_reader_unlock(&bucket->lock);
+            return TRUE;
+        }
+        g_rw_lock_reader_unlock(&bucket->lock);
     }
-    (more_fragments ? g_rw_lock_reader_unlock : g_rw_lock_writer_unlock) (&fragments->lock);
-    return TRUE;
+
+    /* Search again with the writer lock held so that the lookup and any
+     * store or removal are atomic - two threads cannot both store the
+     * same first fragment. */
+    g_rw_lock_writer_lock(&bucket->lock);
+    match = g_queue_find_custom(&bucket->queue, entry, find_flow_by_frag_info);
+
+    if (!match) {
+        if (entry->offset == 0) {
+            /* First fragment - store the ports for the rest of the datagram */
+            result = store_frag_info(fragments, bucket, entry, entry->timestamp) != NULL;
+        } else {
+            /* Arrived before the first fragment - no ports to report yet */
+            store_pending_frag_info(fragments, bucket, entry, entry->timestamp);
+            result = FALSE;
+        }
+    } else if ((found = match->data)->pending) {
+        if (entry->offset == 0) {
+            /* Hand back everything held so the caller can account for it */
+            entry->packets = found->packets;
+            release_pending_frag_info(fragments, found);
+            found->tuple = entry->tuple;
+            FRAG_STAT_INC(fragments->matched);
+            G_INET_PROBE(frag__match, fragments, entry->id);
+        } else {
+            add_pending_frag_info(fragments, found, entry);
+            result = FALSE;
+        }
+    } else {
+        copy_frag_ports(entry, found);
+        FRAG_STAT_INC(fragments->matched);
+        G_INET_PROBE(frag__match, fragments, entry->id);
+        /* If this is the last IP fragment (MF is unset), clean up the list */
+        if (!more_fragments) {
+            free_frag_info(fragments, bucket, match);
+        }
+    }
+    g_rw_lock_writer_unlock(&bucket->lock);
+    return result;
+}
+
+guint g_inet_frag_list_length(GInetFragList * fragments)
+{
+    return g_atomic_int_get(&fragments->count);
+}
+
+guint g_inet_frag_list_pending(GInetFragList * fragments)
+{
+    return g_atomic_int_get(&fragments->pending);
+}
+
+void g_inet_frag_list_depth_max_set(GInetFragList * fragments, guint entries)
+{
+    fragments->max_depth = MIN(entries, G_MAXINT);
+}
+
+void g_inet_frag_list_pending_max_set(GInetFragList * fragments, guint entries, guint bytes,
+                                      guint per_source)
+{
+    fragments->max_pending = entries;
+    fragments->max_pending_bytes = bytes;
+    fragments->max_pending_per_source = per_source;
+}
+
+void g_inet_frag_list_expiry_set(GInetFragList * fragments, guint64 seconds)
+{
+    fragments->expiry = seconds;
+}
+
+/* Age out stale entries. Meant to be called from the same timer as flow
+ * expiry, so at most one sweep per second is done and busy buckets are
+ * left for the next one. */
+guint g_inet_frag_list_expire(GInetFragList * fragments, guint64 ts)
+{
+    guint64 last = FRAG_STAT_GET(fragments->last_expired);
+    guint cleared = 0;
+    int i;
+
+    if (ts < last + TIMESTAMP_RESOLUTION_US ||
+        !__atomic_compare_exchange_n(&fragments->last_expired, &last, ts, FALSE,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return 0;
+
+    for (i = 0; i < G_INET_FRAG_LIST_BUCKETS; i++) {
+        GInetFragBucket *bucket = &fragments->buckets[i];
+        if (g_queue_is_empty(&bucket->queue) || !g_rw_lock_writer_trylock(&bucket->lock))
+            continue;
+        cleared += clear_expired_bucket(fragments, bucket, ts);
+        g_rw_lock_writer_unlock(&bucket->lock);
+    }
+    return cleared;
+}
+
+guint64 g_inet_frag_list_memory(GInetFragList * fragments)
+{
+    return sizeof(GInetFragList) +
+        (guint64) g_atomic_int_get(&fragments->count) * (sizeof(GInetFragment) + sizeof(GList));
+}
+
+void g_inet_frag_list_stats_get(GInetFragList * fragments, GInetFragStats * stats)
+{
+    stats->stored = FRAG_STAT_GET(fragments->stored);
+    stats->matched = FRAG_STAT_GET(fragments->matched);
+    stats->expired = FRAG_STAT_GET(fragments->expired);
+    stats->dropped = FRAG_STAT_GET(fragments->dropped);
+    stats->depth = g_atomic_int_get(&fragments->count);
 }
 
 void g_inet_frag_list_free(GInetFragList * finished)
 {
-    g_rw_lock_writer_lock(&finished->lock);
-    g_rw_lock_clear(&finished->lock);
+    int i;
+
+    for (i = 0; i < G_INET_FRAG_LIST_BUCKETS; i++) {
+        GInetFragBucket *bucket = &finished->buckets[i];
+        g_rw_lock_writer_lock(&bucket->lock);
+        g_list_free_full(bucket->queue.head, free);
+        g_queue_init(&bucket->queue);
+        g_rw_lock_writer_unlock(&bucket->lock);
+        g_rw_lock_clear(&bucket->lock);
+    }
     free(finished);
 }
 
 GInetFragList *g_inet_frag_list_new()
 {
-    GInetFragList *new_list = calloc(1, sizeof(GInetFragList));
-    g_rw_lock_init(&new_list->lock);
+    GInetFragList *new_list;
+    int i;
+
+    if (posix_memalign((void **) &new_list, sizeof(GInetFragBucket), sizeof(GInetFragList)))
+        return NULL;
+    memset(new_list, 0, sizeof(GInetFragList));
+    new_list->max_depth = G_INET_FRAG_LIST_DEFAULT_MAX_DEPTH;
+    new_list->max_pending = G_INET_FRAG_LIST_DEFAULT_MAX_PENDING;
+    new_list->max_pending_bytes = G_INET_FRAG_LIST_DEFAULT_MAX_PENDING_BYTES;
+    new_list->max_pending_per_source = G_INET_FRAG_LIST_DEFAULT_MAX_PENDING_PER_SOURCE;
+    new_list->expiry = G_INET_FRAG_LIST_DEFAULT_EXPIRY;
+    for (i = 0; i < G_INET_FRAG_LIST_BUCKETS; i++) {
+        g_rw_lock_init(&new_list->buckets[i].lock);
+    }
     return new_list;
 }
@@ -25,16 +25,80 @@ typedef struct _GInetFragment {
     guint32 id;
     GInetTuple tuple;
     guint64 timestamp;
+    /* Fragment offset (in 8 byte units) and payload length of this fragment */
+    guint16 offset;
+    guint32 bytes;
+    /* Set when only non-first fragments have been seen (no ports known yet) */
+    gboolean pending;
+    /* Non-first fragments held while pending, returned once resolved */
+    guint32 packets;
 } GInetFragment;
 
-typedef struct _GInetFragList {
+/* Fragments are spread over independently locked buckets so that
+ * threads handling unrelated datagrams do not contend on one lock. */
+#define G_INET_FRAG_LIST_BUCKETS    64
+
+typedef struct _GInetFragBucket {
     GRWLock lock;
-    GList *head;
+    /* Newest entry at the head, oldest at the tail */
+    GQueue queue;
+} __attribute__ ((aligned(64))) GInetFragBucket;
+
+/* Seconds an entry is kept waiting for the rest of its datagram */
+#define G_INET_FRAG_LIST_DEFAULT_EXPIRY     30
+
+/* Entries held at once, pending ones included */
+#define G_INET_FRAG_LIST_DEFAULT_MAX_DEPTH              128
+
+/* Limits on fragments that arrive before their first fragment */
+#define G_INET_FRAG_LIST_DEFAULT_MAX_PENDING            64
+#define G_INET_FRAG_LIST_DEFAULT_MAX_PENDING_BYTES      (256 * 1024)
+#define G_INET_FRAG_LIST_DEFAULT_MAX_PENDING_PER_SOURCE 8
+#define G_INET_FRAG_LIST_SOURCE_SLOTS                   256
+
+typedef struct _GInetFragList {
+    GInetFragBucket buckets[G_INET_FRAG_LIST_BUCKETS];
+    gint count;
+    gint pending;
+    gint pending_bytes;
+    gint pending_per_source[G_INET_FRAG_LIST_SOURCE_SLOTS];
+    guint max_depth;
+    guint max_pending;
+    guint max_pending_bytes;
+    guint max_pending_per_source;
+    guint64 expiry;
+    guint64 last_expired;
+    guint64 stored;
+    guint64 matched;
+    guint64 expired;
+    guint64 dropped;
 } GInetFragList;
 
+typedef struct _GInetFragStats {
+    /* Entries created for first or early non-first fragments */
+    guint64 stored;
+    /* Fragments that found the ports of their datagram */
+    guint64 matched;
+    /* Entries aged out before the last fragment was seen */
+    guint64 expired;
+    /* Fragments not tracked because a limit was reached */
+    guint64 dropped;
+    /* Entries currently held */
+    guint64 depth;
+} GInetFragStats;
+
 GInetFragList *g_inet_frag_list_new();
 void g_inet_frag_list_free(GInetFragList * finished);
 gboolean g_inet_frag_list_update(GInetFragList * fragments, GInetFragment * entry,
                                  gboolean more_fragments);
+guint g_inet_frag_list_length(GInetFragList * fragments);
+guint g_inet_frag_list_pending(GInetFragList * fragments);
+void g_inet_frag_list_depth_max_set(GInetFragList * fragments, guint entries);
+void g_inet_frag_list_pending_max_set(GInetFragList * fragments, guint entries, guint bytes,
+                                      guint per_source);
+void g_inet_frag_list_expiry_set(GInetFragList * fragments, guint64 seconds);
+guint g_inet_frag_list_expire(GInetFragList * fragments, guint64 ts);
+void g_inet_frag_list_stats_get(GInetFragList * fragments, GInetFragStats * stats);
+guint64 g_inet_frag_list_memory(GInetFragList * fragments);
 
 #endif                          /* __G_INET_FRAG_LIST_H__ */
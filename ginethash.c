@@ -0,0 +1,941 @@
+/* GInetFlow - Incrementally Resized Hash Table
+ *
+ * Copyright (C) 2017 Allied Telesis Ltd
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <glib.h>
+
+#include "ginethash.h"
+
+/* From <numaif.h>, which would need libnuma to build */
+#define HASH_MPOL_PREFERRED 1
+#define HASH_MPOL_MF_MOVE   (1 << 1)
+#define HASH_MAX_NODES      256
+
+/* Prefer node for the pages of a mapping, moving any already there. FALSE
+ * when the kernel has no NUMA support or the node does not exist. */
+static gboolean hash_bind(void *addr, gsize bytes, gint node)
+{
+#ifdef SYS_mbind
+    unsigned long mask[HASH_MAX_NODES / (8 * sizeof(unsigned long))] = { 0 };
+    const guint bits = 8 * sizeof(unsigned long);
+
+    if (node < 0 || node >= HASH_MAX_NODES)
+        return FALSE;
+    mask[node / bits] = 1UL << (node % bits);
+    return syscall(SYS_mbind, addr, bytes, HASH_MPOL_PREFERRED, mask, HASH_MAX_NODES + 1,
+                   HASH_MPOL_MF_MOVE) == 0;
+#else
+    return FALSE;
+#endif
+}
+
+/* Whether pages can be bound to node at all, tried on a page of its own so
+ * the answer does not depend on the size of the arrays */
+static gboolean hash_node_valid(gint node)
+{
+    gsize bytes = sysconf(_SC_PAGESIZE);
+    void *page = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    gboolean valid;
+
+    if (page == MAP_FAILED)
+        return FALSE;
+    valid = hash_bind(page, bytes, node);
+    munmap(page, bytes);
+    return valid;
+}
+
+static inline gboolean hash_buckets_mapped(GInetHash * hash, guint32 count)
+{
+    return (hash->hugepages || hash->node >= 0) &&
+        count * sizeof(GInetHashNode *) >= G_INET_HASH_HUGE_PAGE;
+}
+
+/* Zeroed array of count pointer sized words. Large ones are mapped, on
+ * reserved huge pages if there are any, otherwise on normal pages advised
+ * to become transparent huge pages, and bound to the preferred node before
+ * first touch. Large arrays are whole pages long. */
+static gpointer hash_buckets_new(GInetHash * hash, guint32 count, guint * flags)
+{
+    gsize bytes = (gsize) count * sizeof(GInetHashNode *);
+    void *buckets = MAP_FAILED;
+
+    *flags = 0;
+    if (!hash_buckets_mapped(hash, count))
+        return g_new0(GInetHashNode *, count);
+    *flags = G_INET_HASH_MAPPED;
+#ifdef MAP_HUGETLB
+    if (hash->hugepages) {
+        buckets = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (buckets != MAP_FAILED)
+            *flags |= G_INET_HASH_HUGETLB;
+    }
+#endif
+    if (buckets == MAP_FAILED) {
+        buckets = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buckets == MAP_FAILED)
+            g_error("Failed to map %zu bytes of hash buckets", bytes);
+#ifdef MADV_HUGEPAGE
+        if (hash->hugepages)
+            madvise(buckets, bytes, MADV_HUGEPAGE);
+#endif
+    }
+    if (hash->node >= 0 && hash_bind(buckets, bytes, hash->node))
+        *flags |= G_INET_HASH_BOUND;
+    return buckets;
+}
+
+static void hash_buckets_free(gpointer buckets, guint32 count, guint flags)
+{
+    if (flags & G_INET_HASH_MAPPED)
+        munmap(buckets, (gsize) count * sizeof(GInetHashNode *));
+    else
+        g_free(buckets);
+}
+
+#define HASH_CHAIN_WORDS    (sizeof(GInetHashChain) / sizeof(GInetHashNode *))
+
+static inline GInetHashChain *hash_chains_new(GInetHash * hash, guint32 count,
+                                              guint * flags)
+{
+    return hash_buckets_new(hash, count * HASH_CHAIN_WORDS, flags);
+}
+
+static inline void hash_chains_free(GInetHashChain * chains, guint32 count, guint flags)
+{
+    hash_buckets_free(chains, count * HASH_CHAIN_WORDS, flags);
+}
+
+/* One of 32 bits picked by all bits of the hash, as the low ones also pick
+ * the bucket and callers may restrict the high ones */
+static inline guint32 hash_tag(guint32 hashval)
+{
+    return 1U << ((hashval * 0x9E3779B1U) >> 27);
+}
+
+static inline void hash_chain_push(GInetHashChain * bucket, GInetHashNode * node)
+{
+    node->next = bucket->head;
+    bucket->head = node;
+    bucket->hash = node->hash;
+    bucket->tags |= hash_tag(node->hash);
+}
+
+/* Move up to count old buckets into the new array */
+static void hash_migrate(GInetHash * hash, guint count)
+{
+    while (hash->old && count--) {
+        GInetHashNode *node = hash->old[hash->migrated].head;
+
+        while (node) {
+            GInetHashNode *next = node->next;
+
+            hash_chain_push(&hash->buckets[node->hash & hash->mask], node);
+            node = next;
+        }
+        memset(&hash->old[hash->migrated], 0, sizeof(GInetHashChain));
+        if (hash->migrated++ == hash->old_mask) {
+            hash_chains_free(hash->old, hash->old_mask + 1, hash->old_flags);
+            hash->old = NULL;
+            hash->migrated = 0;
+        }
+    }
+}
+
+static void hash_resize(GInetHash * hash, guint32 buckets)
+{
+    /* One resize at a time - finish any previous one first */
+    hash_migrate(hash, G_MAXUINT);
+    hash->old = hash->buckets;
+    hash->old_mask = hash->mask;
+    hash->old_flags = hash->buckets_flags;
+    hash->migrated = 0;
+    hash->buckets = hash_chains_new(hash, buckets, &hash->buckets_flags);
+    hash->mask = buckets - 1;
+}
+
+/* Grow past one entry per bucket */
+static void hash_check_size(GInetHash * hash)
+{
+    guint32 buckets = hash->mask + 1;
+
+    if (!hash->old && hash->size > buckets && buckets < (1U << 30))
+        hash_resize(hash, buckets * 2);
+}
+
+/* Smallest bucket count holding size entries, at least min_buckets */
+static guint32 hash_fit(GInetHash * hash, guint size)
+{
+    guint32 buckets = hash->min_buckets;
+
+    while (buckets < size && buckets < (1U << 30))
+        buckets <<= 1;
+    return buckets;
+}
+
+/* The chain in the old array still holds hashval if its bucket has not moved */
+static inline GInetHashChain *hash_old_bucket(GInetHash * hash, guint32 hashval)
+{
+    guint32 index;
+
+    if (!hash->old)
+        return NULL;
+    index = hashval & hash->old_mask;
+    return index >= hash->migrated ? &hash->old[index] : NULL;
+}
+
+static GInetHashNode *hash_chain_find(GInetHashChain * bucket, guint32 hashval,
+                                      GInetHashEqual equal, gconstpointer key)
+{
+    GInetHashNode *node = bucket->head;
+
+    if (!(bucket->tags & hash_tag(hashval)))
+        return NULL;
+    if (bucket->hash == hashval && equal(node, key))
+        return node;
+    for (node = node->next; node; node = node->next) {
+        if (node->hash == hashval && equal(node, key))
+            return node;
+    }
+    return NULL;
+}
+
+static gboolean hash_chain_unlink(GInetHashChain * bucket, GInetHashNode * node)
+{
+    GInetHashNode **link;
+
+    if (!(bucket->tags & hash_tag(node->hash)))
+        return FALSE;
+    for (link = &bucket->head; *link; link = &(*link)->next) {
+        if (*link == node) {
+            *link = node->next;
+            node->next = NULL;
+            /* Summarise what is left */
+            bucket->hash = bucket->head ? bucket->head->hash : 0;
+            bucket->tags = 0;
+            for (node = bucket->head; node; node = node->next)
+                bucket->tags |= hash_tag(node->hash);
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* Cuckoo bucket arrays are allocated as words so large ones fill whole
+ * huge pages, the spare space becoming extra buckets */
+#define CUCKOO_BUCKET_WORDS (sizeof(GInetHashBucket) / sizeof(GInetHashNode *))
+#define CUCKOO_PAGE_WORDS   (G_INET_HASH_HUGE_PAGE / sizeof(GInetHashNode *))
+/* Entries moved to make room before one goes to the stash */
+#define CUCKOO_KICKS        256
+/* Largest array, and doublings a rebuild tries before it gives up on
+ * fitting every entry and chains the rest */
+#define CUCKOO_MAX_BUCKETS  (1U << 28)
+#define CUCKOO_GROWS        3
+
+static guint32 cuckoo_words(GInetHash * hash, guint32 count)
+{
+    guint32 words = count * CUCKOO_BUCKET_WORDS;
+
+    if (hash_buckets_mapped(hash, words))
+        words = (words + CUCKOO_PAGE_WORDS - 1) / CUCKOO_PAGE_WORDS * CUCKOO_PAGE_WORDS;
+    return words;
+}
+
+/* The two buckets of a hash. Multiplying first spreads every bit of the
+ * hash into the high bits that pick the bucket, so callers that restrict
+ * some bits (as flow sampling does) still use the whole array. */
+static inline guint32 cuckoo_first(guint32 hashval, guint32 count)
+{
+    return ((guint64) (hashval * 0x85EBCA6BU) * count) >> 32;
+}
+
+static inline guint32 cuckoo_second(guint32 hashval, guint32 count)
+{
+    return ((guint64) ((hashval >> 16 | hashval << 16) * 0x9E3779B1U) * count) >> 32;
+}
+
+static inline guint32 cuckoo_other(guint32 hashval, guint32 index, guint32 count)
+{
+    guint32 first = cuckoo_first(hashval, count);
+
+    return index == first ? cuckoo_second(hashval, count) : first;
+}
+
+/* Slots are matched on the stored hash, so only likely matches touch the
+ * node */
+static inline GInetHashNode *cuckoo_find(GInetHashBucket * bucket, guint32 hashval,
+                                         GInetHashEqual equal, gconstpointer key)
+{
+    int i;
+
+    for (i = 0; i < G_INET_HASH_SLOTS; i++) {
+        if (bucket->hash[i] == hashval && bucket->node[i] && equal(bucket->node[i], key))
+            return bucket->node[i];
+    }
+    return NULL;
+}
+
+static gboolean cuckoo_put(GInetHashBucket * bucket, GInetHashNode * node)
+{
+    int i;
+
+    for (i = 0; i < G_INET_HASH_SLOTS; i++) {
+        if (!bucket->node[i]) {
+            bucket->hash[i] = node->hash;
+            bucket->node[i] = node;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static gboolean cuckoo_unlink(GInetHashBucket * bucket, GInetHashNode * node)
+{
+    int i;
+
+    for (i = 0; i < G_INET_HASH_SLOTS; i++) {
+        if (bucket->node[i] == node) {
+            bucket->hash[i] = 0;
+            bucket->node[i] = NULL;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* Put node in one of its buckets, moving other entries to their other
+ * bucket to make room. Returns the entry left without a place, which need
+ * not be node, or NULL. */
+static GInetHashNode *cuckoo_place(GInetHashBucket * buckets, guint32 count,
+                                   GInetHashNode * node, guint32 * kick)
+{
+    guint32 index = cuckoo_first(node->hash, count);
+    int i;
+
+    if (cuckoo_put(&buckets[index], node))
+        return NULL;
+    index = cuckoo_second(node->hash, count);
+    for (i = 0; i < CUCKOO_KICKS; i++) {
+        GInetHashBucket *bucket = &buckets[index];
+        GInetHashNode *victim;
+        guint slot;
+
+        if (cuckoo_put(bucket, node))
+            return NULL;
+        slot = (*kick)++ % G_INET_HASH_SLOTS;
+        victim = bucket->node[slot];
+        bucket->hash[slot] = node->hash;
+        bucket->node[slot] = node;
+        node = victim;
+        index = cuckoo_other(node->hash, index, count);
+    }
+    return node;
+}
+
+static inline void cuckoo_chain(GInetHashNode ** overflow, GInetHashNode * node)
+{
+    node->next = *overflow;
+    *overflow = node;
+}
+
+/* Place node, stash it, or if overflow is given chain it there. FALSE if
+ * it found no room. */
+static gboolean cuckoo_move(GInetHashBucket * buckets, guint32 count, GInetHashNode * node,
+                            GInetHashNode ** stash, guint * stashed,
+                            GInetHashNode ** overflow, guint32 * kick)
+{
+    if (!(node = cuckoo_place(buckets, count, node, kick)))
+        return TRUE;
+    if (*stashed < G_INET_HASH_STASH)
+        stash[(*stashed)++] = node;
+    else if (overflow)
+        cuckoo_chain(overflow, node);
+    else
+        return FALSE;
+    return TRUE;
+}
+
+/* Move the entries of the current array, stash and overflow into another
+ * array of count buckets. FALSE, leaving the table as it was, if they do
+ * not fit, which cannot happen when overflow is given. */
+static gboolean cuckoo_fill(GInetHash * hash, GInetHashBucket * buckets, guint32 count,
+                            GInetHashNode ** stash, guint * stashed,
+                            GInetHashNode ** overflow)
+{
+    GInetHashNode *node, *next;
+    guint32 i;
+    int j;
+
+    for (i = 0; i < hash->count; i++) {
+        for (j = 0; j < G_INET_HASH_SLOTS; j++) {
+            if (hash->slots[i].node[j] &&
+                !cuckoo_move(buckets, count, hash->slots[i].node[j], stash, stashed,
+                             overflow, &hash->kick))
+                return FALSE;
+        }
+    }
+    for (i = 0; i < hash->stashed; i++) {
+        if (!cuckoo_move(buckets, count, hash->stash[i], stash, stashed, overflow,
+                         &hash->kick))
+            return FALSE;
+    }
+    for (node = hash->overflow; node; node = next) {
+        next = node->next;
+        if (!cuckoo_move(buckets, count, node, stash, stashed, overflow, &hash->kick))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* Rebuild with at least count buckets, doubling them until all fit. At
+ * the largest array, or after CUCKOO_GROWS doublings, growing is not
+ * helping, so entries left without a place are chained. */
+static void cuckoo_rebuild(GInetHash * hash, guint32 count)
+{
+    GInetHashNode *stash[G_INET_HASH_STASH];
+    GInetHashNode *overflow;
+    GInetHashBucket *buckets;
+    gboolean last;
+    guint32 words;
+    guint stashed;
+    guint flags;
+    int grows;
+
+    for (grows = 0;; grows++, count *= 2) {
+        count = MIN(count, CUCKOO_MAX_BUCKETS);
+        last = grows == CUCKOO_GROWS || count == CUCKOO_MAX_BUCKETS;
+        words = cuckoo_words(hash, count);
+        count = words / CUCKOO_BUCKET_WORDS;
+        buckets = hash_buckets_new(hash, words, &flags);
+        stashed = 0;
+        overflow = NULL;
+        if (!hash->slots ||
+            cuckoo_fill(hash, buckets, count, stash, &stashed, last ? &overflow : NULL))
+            break;
+        hash_buckets_free(buckets, words, flags);
+    }
+    if (hash->slots)
+        hash_buckets_free(hash->slots, hash->slots_words, hash->buckets_flags);
+    hash->slots = buckets;
+    hash->slots_words = words;
+    hash->count = count;
+    hash->buckets_flags = flags;
+    memcpy(hash->stash, stash, stashed * sizeof(GInetHashNode *));
+    hash->stashed = stashed;
+    hash->overflow = overflow;
+}
+
+/* Smallest bucket count holding size entries, at least min_buckets */
+static guint32 cuckoo_fit(GInetHash * hash, guint size)
+{
+    const guint per_bucket = G_INET_HASH_SLOTS * G_INET_HASH_CUCKOO_LOAD;
+    guint64 count = ((guint64) size * 100 + per_bucket - 1) / per_bucket;
+
+    return MAX(MIN(count, CUCKOO_MAX_BUCKETS), hash->min_buckets);
+}
+
+static inline gboolean cuckoo_full(guint size, guint32 count)
+{
+    return (guint64) size * 100 >
+        (guint64) count * G_INET_HASH_SLOTS * G_INET_HASH_CUCKOO_LOAD;
+}
+
+static GInetHashNode *cuckoo_lookup(GInetHash * hash, guint32 hashval, gconstpointer key)
+{
+    GInetHashBucket *second = &hash->slots[cuckoo_second(hashval, hash->count)];
+    GInetHashNode *node;
+    guint i;
+
+    __builtin_prefetch(second);
+    node = cuckoo_find(&hash->slots[cuckoo_first(hashval, hash->count)], hashval,
+                       hash->equal, key);
+    if (!node)
+        node = cuckoo_find(second, hashval, hash->equal, key);
+    for (i = 0; !node && i < hash->stashed; i++) {
+        if (hash->stash[i]->hash == hashval && hash->equal(hash->stash[i], key))
+            node = hash->stash[i];
+    }
+    if (node)
+        return node;
+    for (node = hash->overflow; node; node = node->next) {
+        if (node->hash == hashval && hash->equal(node, key))
+            break;
+    }
+    return node;
+}
+
+static void cuckoo_insert(GInetHash * hash, GInetHashNode * node)
+{
+    gboolean rebuilt = FALSE;
+
+    if (cuckoo_full(hash->size + 1, hash->count))
+        cuckoo_rebuild(hash, hash->count * 2);
+    hash->size++;
+    while ((node = cuckoo_place(hash->slots, hash->count, node, &hash->kick))) {
+        if (hash->stashed < G_INET_HASH_STASH) {
+            hash->stash[hash->stashed++] = node;
+            break;
+        }
+        /* Once entries are chained, or a rebuild did not make room, a
+         * bigger array would not either */
+        if (rebuilt || hash->overflow) {
+            cuckoo_chain(&hash->overflow, node);
+            break;
+        }
+        cuckoo_rebuild(hash, hash->count * 2);
+        rebuilt = TRUE;
+    }
+}
+
+static gboolean cuckoo_unchain(GInetHash * hash, GInetHashNode * node)
+{
+    GInetHashNode **link;
+
+    for (link = &hash->overflow; *link; link = &(*link)->next) {
+        if (*link == node) {
+            *link = node->next;
+            node->next = NULL;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static gboolean cuckoo_remove(GInetHash * hash, GInetHashNode * node)
+{
+    guint i;
+
+    if (!cuckoo_unlink(&hash->slots[cuckoo_first(node->hash, hash->count)], node) &&
+        !cuckoo_unlink(&hash->slots[cuckoo_second(node->hash, hash->count)], node)) {
+        for (i = 0; i < hash->stashed && hash->stash[i] != node; i++);
+        if (i < hash->stashed)
+            hash->stash[i] = hash->stash[--hash->stashed];
+        else if (!cuckoo_unchain(hash, node))
+            return FALSE;
+    }
+    hash->size--;
+    /* The free slot may take a stashed entry back */
+    for (i = 0; i < hash->stashed;) {
+        node = hash->stash[i];
+        if (cuckoo_put(&hash->slots[cuckoo_first(node->hash, hash->count)], node) ||
+            cuckoo_put(&hash->slots[cuckoo_second(node->hash, hash->count)], node))
+            hash->stash[i] = hash->stash[--hash->stashed];
+        else
+            i++;
+    }
+    /* and room in the stash takes chained entries */
+    while (hash->overflow && hash->stashed < G_INET_HASH_STASH) {
+        node = hash->overflow;
+        hash->overflow = node->next;
+        node->next = NULL;
+        hash->stash[hash->stashed++] = node;
+    }
+    return TRUE;
+}
+
+static void cuckoo_foreach(GInetHash * hash, GInetHashFunc func, gpointer user_data)
+{
+    GInetHashNode *node, *next;
+    guint32 i;
+    int j;
+
+    for (i = 0; i < hash->count; i++) {
+        for (j = 0; j < G_INET_HASH_SLOTS; j++) {
+            if (hash->slots[i].node[j])
+                func(hash->slots[i].node[j], user_data);
+        }
+    }
+    for (i = 0; i < hash->stashed; i++)
+        func(hash->stash[i], user_data);
+    for (node = hash->overflow; node; node = next) {
+        next = node->next;
+        func(node, user_data);
+    }
+}
+
+GInetHash *g_inet_hash_new(GInetHashEqual equal)
+{
+    GInetHash *hash = g_malloc0(sizeof(GInetHash));
+
+    hash->equal = equal;
+    hash->min_buckets = G_INET_HASH_MIN_BUCKETS;
+    hash->node = G_INET_HASH_NODE_ANY;
+    hash->buckets = hash_chains_new(hash, hash->min_buckets, &hash->buckets_flags);
+    hash->mask = hash->min_buckets - 1;
+    return hash;
+}
+
+GInetHash *g_inet_hash_new_cuckoo(GInetHashEqual equal)
+{
+    GInetHash *hash = g_malloc0(sizeof(GInetHash));
+
+    hash->equal = equal;
+    hash->min_buckets = G_INET_HASH_CUCKOO_MIN;
+    hash->node = G_INET_HASH_NODE_ANY;
+    cuckoo_rebuild(hash, hash->min_buckets);
+    return hash;
+}
+
+void g_inet_hash_free(GInetHash * hash)
+{
+    if (hash && hash->slots) {
+        hash_buckets_free(hash->slots, hash->slots_words, hash->buckets_flags);
+        g_free(hash);
+    } else if (hash) {
+        if (hash->old)
+            hash_chains_free(hash->old, hash->old_mask + 1, hash->old_flags);
+        hash_chains_free(hash->buckets, hash->mask + 1, hash->buckets_flags);
+        g_free(hash);
+    }
+}
+
+/* Never shrink below capacity entries, and grow to hold them now */
+void g_inet_hash_reserve(GInetHash * hash, guint capacity)
+{
+    if (hash->slots) {
+        hash->min_buckets = G_INET_HASH_CUCKOO_MIN;
+        hash->min_buckets = cuckoo_fit(hash, capacity);
+        if (hash->count < hash->min_buckets)
+            cuckoo_rebuild(hash, hash->min_buckets);
+        return;
+    }
+    hash->min_buckets = G_INET_HASH_MIN_BUCKETS;
+    hash->min_buckets = hash_fit(hash, capacity);
+    if (hash->mask + 1 < hash->min_buckets) {
+        hash_resize(hash, hash->min_buckets);
+        hash_migrate(hash, G_MAXUINT);
+    }
+}
+
+/* Under one entry per eight buckets and above the reserved size */
+gboolean g_inet_hash_sparse(GInetHash * hash)
+{
+    guint32 buckets = hash->old ? hash->old_mask + 1 : hash->mask + 1;
+
+    if (hash->slots)
+        return hash->size < hash->count * G_INET_HASH_SLOTS / 8 &&
+            cuckoo_words(hash, cuckoo_fit(hash, hash->size)) < hash->slots_words;
+    return hash->size < buckets / 8 && buckets > hash->min_buckets;
+}
+
+/* Shrink to fit the current entries. The move is spread over later inserts
+ * and removes unless now is set (cuckoo arrays always move at once).
+ * Returns FALSE if already the right size. */
+gboolean g_inet_hash_compact(GInetHash * hash, gboolean now)
+{
+    guint32 buckets;
+
+    if (hash->slots) {
+        buckets = cuckoo_fit(hash, hash->size);
+        if (cuckoo_words(hash, buckets) >= hash->slots_words)
+            return FALSE;
+        cuckoo_rebuild(hash, buckets);
+        return TRUE;
+    }
+    /* Growth still moving in is only finished off when asked to be quick */
+    if (hash->old) {
+        if (!now)
+            return FALSE;
+        hash_migrate(hash, G_MAXUINT);
+    }
+    buckets = hash_fit(hash, hash->size);
+    if (buckets >= hash->mask + 1)
+        return FALSE;
+    hash_resize(hash, buckets);
+    if (now)
+        hash_migrate(hash, G_MAXUINT);
+    return TRUE;
+}
+
+GInetHashNode *g_inet_hash_lookup(GInetHash * hash, guint32 hashval, gconstpointer key)
+{
+    GInetHashNode *node;
+    GInetHashChain *old;
+
+    if (hash->slots)
+        return cuckoo_lookup(hash, hashval, key);
+    node = hash_chain_find(&hash->buckets[hashval & hash->mask], hashval, hash->equal, key);
+    if (!node && (old = hash_old_bucket(hash, hashval)))
+        node = hash_chain_find(old, hashval, hash->equal, key);
+    return node;
+}
+
+void g_inet_hash_insert(GInetHash * hash, GInetHashNode * node, guint32 hashval)
+{
+    guint32 index = hashval & hash->mask;
+
+    node->hash = hashval;
+    if (hash->slots) {
+        node->next = NULL;
+        cuckoo_insert(hash, node);
+        return;
+    }
+    hash_chain_push(&hash->buckets[index], node);
+    hash->size++;
+    hash_migrate(hash, G_INET_HASH_MIGRATE_BUCKETS);
+    hash_check_size(hash);
+}
+
+gboolean g_inet_hash_remove(GInetHash * hash, GInetHashNode * node)
+{
+    GInetHashChain *old;
+
+    if (hash->slots)
+        return cuckoo_remove(hash, node);
+    /* Nodes added during a resize are in the new array whatever their bucket */
+    if (!hash_chain_unlink(&hash->buckets[node->hash & hash->mask], node) &&
+        (!(old = hash_old_bucket(hash, node->hash)) || !hash_chain_unlink(old, node)))
+        return FALSE;
+    hash->size--;
+    hash_migrate(hash, G_INET_HASH_MIGRATE_BUCKETS);
+    hash_check_size(hash);
+    return TRUE;
+}
+
+static void hash_array_detach(GInetHashChain * buckets, guint32 count, GInetHashFunc func,
+                              gpointer user_data)
+{
+    guint32 i;
+
+    for (i = 0; i < count; i++) {
+        GInetHashNode *node = buckets[i].head;
+
+        memset(&buckets[i], 0, sizeof(GInetHashChain));
+        while (node) {
+            GInetHashNode *next = node->next;
+
+            node->next = NULL;
+            if (func)
+                func(node, user_data);
+            node = next;
+        }
+    }
+}
+
+/* Empty the table, then call func on each node that was in it. The nodes
+ * are no longer in the table so func may free them. */
+void g_inet_hash_remove_all(GInetHash * hash, GInetHashFunc func, gpointer user_data)
+{
+    GInetHashChain *buckets = hash->buckets;
+    GInetHashChain *old = hash->old;
+    guint32 count = hash->mask + 1;
+    guint32 old_count = hash->old_mask + 1;
+    guint flags = hash->buckets_flags;
+    GInetHash detached;
+
+    if (hash->slots) {
+        detached = *hash;
+        hash->slots = NULL;
+        hash->size = 0;
+        hash->stashed = 0;
+        hash->overflow = NULL;
+        cuckoo_rebuild(hash, hash->min_buckets);
+        if (func)
+            cuckoo_foreach(&detached, func, user_data);
+        hash_buckets_free(detached.slots, detached.slots_words, detached.buckets_flags);
+        return;
+    }
+    hash->buckets = hash_chains_new(hash, hash->min_buckets, &hash->buckets_flags);
+    hash->mask = hash->min_buckets - 1;
+    hash->old = NULL;
+    hash->migrated = 0;
+    hash->size = 0;
+    hash_array_detach(buckets, count, func, user_data);
+    hash_chains_free(buckets, count, flags);
+    if (old) {
+        hash_array_detach(old, old_count, func, user_data);
+        hash_chains_free(old, old_count, hash->old_flags);
+    }
+}
+
+guint g_inet_hash_size(GInetHash * hash)
+{
+    return hash->size;
+}
+
+void g_inet_hash_foreach(GInetHash * hash, GInetHashFunc func, gpointer user_data)
+{
+    GInetHashNode *node;
+    guint32 i;
+
+    if (hash->slots) {
+        cuckoo_foreach(hash, func, user_data);
+        return;
+    }
+    for (i = 0; i <= hash->mask; i++) {
+        for (node = hash->buckets[i].head; node; node = node->next)
+            func(node, user_data);
+    }
+    for (i = hash->migrated; hash->old && i <= hash->old_mask; i++) {
+        for (node = hash->old[i].head; node; node = node->next)
+            func(node, user_data);
+    }
+}
+
+static void hash_array_chains(GInetHashChain * buckets, guint32 from, guint32 mask,
+                              guint64 * chains, guint64 * chain_max)
+{
+    GInetHashNode *node;
+    guint64 length;
+    guint32 i;
+
+    for (i = from; i <= mask; i++) {
+        for (length = 0, node = buckets[i].head; node; node = node->next)
+            length++;
+        if (length) {
+            (*chains)++;
+            *chain_max = MAX(*chain_max, length);
+        }
+    }
+}
+
+/* Non-empty buckets and the longest chain (the fullest cuckoo bucket) */
+void g_inet_hash_chains(GInetHash * hash, guint64 * chains, guint64 * chain_max)
+{
+    guint64 length;
+    guint32 i;
+    int j;
+
+    *chains = 0;
+    *chain_max = 0;
+    for (i = 0; hash->slots && i < hash->count; i++) {
+        for (length = 0, j = 0; j < G_INET_HASH_SLOTS; j++)
+            length += hash->slots[i].node[j] != NULL;
+        if (length) {
+            (*chains)++;
+            *chain_max = MAX(*chain_max, length);
+        }
+    }
+    if (hash->slots)
+        return;
+    hash_array_chains(hash->buckets, 0, hash->mask, chains, chain_max);
+    if (hash->old)
+        hash_array_chains(hash->old, hash->migrated, hash->old_mask, chains, chain_max);
+}
+
+/* Bytes of bucket arrays the table would hold with size entries. Nodes
+ * live in the entries so are not included. */
+guint64 g_inet_hash_memory(GInetHash * hash, guint size)
+{
+    guint64 buckets = hash->mask + 1;
+    guint64 needed = buckets;
+    guint32 count = hash->count;
+
+    if (hash->slots) {
+        while (cuckoo_full(size, count) && count < (1U << 28))
+            count *= 2;
+        if (count != hash->count)
+            /* The current array is kept until the rebuild is done */
+            return ((guint64) cuckoo_words(hash, count) + hash->slots_words) *
+                sizeof(GInetHashNode *);
+        return (guint64) hash->slots_words * sizeof(GInetHashNode *);
+    }
+    while (size > needed)
+        needed <<= 1;
+    if (needed != buckets)
+        /* Growing keeps the current array until its buckets have moved */
+        return (needed + buckets) * sizeof(GInetHashChain);
+    if (hash->old)
+        buckets += hash->old_mask + 1;
+    return buckets * sizeof(GInetHashChain);
+}
+
+/* Bytes of bucket arrays on reserved huge pages */
+guint64 g_inet_hash_memory_huge(GInetHash * hash)
+{
+    guint64 bytes = 0;
+
+    if (hash->slots)
+        return hash->buckets_flags & G_INET_HASH_HUGETLB ?
+            (guint64) hash->slots_words * sizeof(GInetHashNode *) : 0;
+    if (hash->buckets_flags & G_INET_HASH_HUGETLB)
+        bytes += (guint64) (hash->mask + 1) * sizeof(GInetHashChain);
+    if (hash->old && (hash->old_flags & G_INET_HASH_HUGETLB))
+        bytes += (guint64) (hash->old_mask + 1) * sizeof(GInetHashChain);
+    return bytes;
+}
+
+/* NUMA node of the CPU the calling thread is running on, or
+ * G_INET_HASH_NODE_ANY if that cannot be found */
+gint g_inet_hash_node_current(void)
+{
+#ifdef SYS_getcpu
+    unsigned cpu, node;
+
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0)
+        return node;
+#endif
+    return G_INET_HASH_NODE_ANY;
+}
+
+/* Drop the node preference if the array just placed did not take it */
+static gboolean hash_node_bound(GInetHash * hash)
+{
+    if (hash->buckets_flags & G_INET_HASH_BOUND)
+        return TRUE;
+    hash->node = G_INET_HASH_NODE_ANY;
+    return FALSE;
+}
+
+/* Keep bucket arrays on a NUMA node (or G_INET_HASH_NODE_ANY). Arrays too
+ * small to map stay on the heap; a large heap array is replaced with a
+ * mapped one now. FALSE, leaving no preference, on kernels without NUMA,
+ * for a node that does not exist or if the local node cannot be found,
+ * and if the large array could not be bound. */
+gboolean g_inet_hash_node_set(GInetHash * hash, gint node)
+{
+    if (node == G_INET_HASH_NODE_LOCAL && (node = g_inet_hash_node_current()) < 0) {
+        hash->node = G_INET_HASH_NODE_ANY;
+        return FALSE;
+    }
+    if (node >= 0 && !hash_node_valid(node)) {
+        hash->node = G_INET_HASH_NODE_ANY;
+        return FALSE;
+    }
+    hash->node = node;
+    if (node < 0)
+        return TRUE;
+    if (hash->slots) {
+        if (!hash_buckets_mapped(hash, hash->slots_words))
+            return TRUE;
+        if (!(hash->buckets_flags & G_INET_HASH_MAPPED))
+            cuckoo_rebuild(hash, hash->count);
+        else if (hash_bind(hash->slots, (gsize) hash->slots_words * sizeof(GInetHashNode *),
+                           node))
+            hash->buckets_flags |= G_INET_HASH_BOUND;
+        else
+            hash->buckets_flags &= ~G_INET_HASH_BOUND;
+        return hash_node_bound(hash);
+    }
+    hash_migrate(hash, G_MAXUINT);
+    if (!hash_buckets_mapped(hash, (hash->mask + 1) * HASH_CHAIN_WORDS))
+        return TRUE;
+    if (!(hash->buckets_flags & G_INET_HASH_MAPPED)) {
+        hash_resize(hash, hash->mask + 1);
+        hash_migrate(hash, G_MAXUINT);
+    } else if (hash_bind(hash->buckets, (gsize) (hash->mask + 1) * sizeof(GInetHashChain),
+                         node)) {
+        hash->buckets_flags |= G_INET_HASH_BOUND;
+    } else {
+        hash->buckets_flags &= ~G_INET_HASH_BOUND;
+    }
+    return hash_node_bound(hash);
+}
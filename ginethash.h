@@ -0,0 +1,123 @@
+/* GInetFlow - Incrementally Resized Hash Table
+ *
+ * Copyright (C) 2017 Allied Telesis Ltd
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef __G_INET_HASH_H__
+#define __G_INET_HASH_H__
+
+#include <glib.h>
+
+/* Chained hash of nodes embedded in the entries. Growing or shrinking
+ * allocates the new bucket array and then moves a few old buckets across
+ * on each insert and remove, so no single call rehashes the whole table.
+ * Until the move completes lookups search both arrays. Bucket indexes are
+ * the low bits of the hash so callers must supply well mixed hashes.
+ * The table grows by itself but only shrinks when compacted. Each bucket
+ * keeps its first node's hash and a one-bit tag of every node's hash, so
+ * most hits and nearly all misses are settled without reading a node. */
+#define G_INET_HASH_MIN_BUCKETS     64
+#define G_INET_HASH_MIGRATE_BUCKETS 16
+/* Bucket arrays at least this big are mapped on their own when huge pages
+ * or a NUMA node are asked for */
+#define G_INET_HASH_HUGE_PAGE       (2 * 1024 * 1024)
+/* No NUMA node preference, or the node of the calling thread */
+#define G_INET_HASH_NODE_ANY        (-1)
+#define G_INET_HASH_NODE_LOCAL      (-2)
+
+/* Bucketized cuckoo layout: each entry is in one of two buckets of slots,
+ * picked by different bits of its hash, so a lookup reads at most two
+ * buckets whatever the load. Inserts move entries to their other bucket to
+ * make room, and the few that find none wait in a small stash. Arrays grow
+ * past G_INET_HASH_CUCKOO_LOAD percent full and are rebuilt in one go. When
+ * growing does not help (entries sharing one hash) the rest are chained. */
+#define G_INET_HASH_SLOTS           4
+#define G_INET_HASH_STASH           8
+#define G_INET_HASH_CUCKOO_LOAD     95
+#define G_INET_HASH_CUCKOO_MIN      16
+
+/* How a bucket array was allocated */
+enum {
+    G_INET_HASH_MAPPED = 1 << 0,
+    G_INET_HASH_HUGETLB = 1 << 1,
+    G_INET_HASH_BOUND = 1 << 2,
+};
+
+typedef struct _GInetHashNode {
+    struct _GInetHashNode *next;
+    guint32 hash;
+} GInetHashNode;
+
+typedef struct _GInetHashChain {
+    GInetHashNode *head;
+    guint32 hash;
+    guint32 tags;
+} GInetHashChain;
+
+typedef struct _GInetHashBucket {
+    guint32 hash[G_INET_HASH_SLOTS];
+    GInetHashNode *node[G_INET_HASH_SLOTS];
+} GInetHashBucket;
+
+typedef gboolean(*GInetHashEqual) (GInetHashNode * node, gconstpointer key);
+typedef void (*GInetHashFunc) (GInetHashNode * node, gpointer user_data);
+
+typedef struct _GInetHash {
+    GInetHashChain *buckets;
+    guint32 mask;
+    /* Array being moved into buckets during a resize, NULL otherwise */
+    GInetHashChain *old;
+    guint32 old_mask;
+    /* Old buckets below this index have been moved */
+    guint32 migrated;
+    guint size;
+    guint32 min_buckets;
+    GInetHashEqual equal;
+    /* Map large arrays on huge pages and/or bind them to a node */
+    gboolean hugepages;
+    gint node;
+    guint buckets_flags;
+    guint old_flags;
+    /* Cuckoo bucket array (NULL for chains), its length in pointer sized
+     * words and bucket count (neither need be a power of two), stash and
+     * the chain of entries beyond it */
+    GInetHashBucket *slots;
+    guint32 slots_words;
+    guint32 count;
+    GInetHashNode *stash[G_INET_HASH_STASH];
+    guint stashed;
+    GInetHashNode *overflow;
+    guint32 kick;
+} GInetHash;
+
+GInetHash *g_inet_hash_new(GInetHashEqual equal);
+GInetHash *g_inet_hash_new_cuckoo(GInetHashEqual equal);
+void g_inet_hash_free(GInetHash * hash);
+GInetHashNode *g_inet_hash_lookup(GInetHash * hash, guint32 hashval, gconstpointer key);
+void g_inet_hash_reserve(GInetHash * hash, guint capacity);
+gboolean g_inet_hash_sparse(GInetHash * hash);
+gboolean g_inet_hash_compact(GInetHash * hash, gboolean now);
+void g_inet_hash_insert(GInetHash * hash, GInetHashNode * node, guint32 hashval);
+gboolean g_inet_hash_remove(GInetHash * hash, GInetHashNode * node);
+void g_inet_hash_remove_all(GInetHash * hash, GInetHashFunc func, gpointer user_data);
+guint g_inet_hash_size(GInetHash * hash);
+void g_inet_hash_foreach(GInetHash * hash, GInetHashFunc func, gpointer user_data);
+void g_inet_hash_chains(GInetHash * hash, guint64 * chains, guint64 * chain_max);
+guint64 g_inet_hash_memory(GInetHash * hash, guint size);
+guint64 g_inet_hash_memory_huge(GInetHash * hash);
+gboolean g_inet_hash_node_set(GInetHash * hash, gint node);
+gint g_inet_hash_node_current(void);
+
+#endif                          /* __G_INET_HASH_H__ */
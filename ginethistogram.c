@@ -0,0 +1,90 @@
+/* GInetFlow - Latency Histogram
+ *
+ * Copyright (C) 2017 Allied Telesis Ltd
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "ginethistogram.h"
+
+static guint histogram_index(guint64 value)
+{
+    guint msb;
+
+    /* Small values are recorded exactly */
+    if (value < G_INET_HISTOGRAM_SUB_COUNT)
+        return value;
+    msb = 63 - __builtin_clzll(value);
+    return (msb - G_INET_HISTOGRAM_SUB_BITS + 1) * G_INET_HISTOGRAM_SUB_COUNT +
+        ((value >> (msb - G_INET_HISTOGRAM_SUB_BITS)) & (G_INET_HISTOGRAM_SUB_COUNT - 1));
+}
+
+/* Largest value recorded in the bucket */
+static guint64 histogram_value(guint index)
+{
+    guint shift;
+    guint64 base;
+
+    if (index < G_INET_HISTOGRAM_SUB_COUNT)
+        return index;
+    shift = index / G_INET_HISTOGRAM_SUB_COUNT - 1;
+    base = (guint64) (G_INET_HISTOGRAM_SUB_COUNT + index % G_INET_HISTOGRAM_SUB_COUNT);
+    return (base << shift) + ((1ULL << shift) - 1);
+}
+
+void g_inet_histogram_add(GInetHistogram * histogram, guint64 value)
+{
+    histogram->buckets[histogram_index(value)]++;
+    histogram->count++;
+    if (value > histogram->max)
+        histogram->max = value;
+}
+
+/* percentile is 0-100, e.g. 99.9 */
+guint64 g_inet_histogram_percentile(GInetHistogram * histogram, gdouble percentile)
+{
+    guint64 rank;
+    guint64 seen = 0;
+    guint i;
+
+    if (histogram->count == 0)
+        return 0;
+    rank = (guint64) (percentile / 100.0 * histogram->count + 0.5);
+    if (rank == 0)
+        rank = 1;
+    for (i = 0; i < G_INET_HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank)
+            return MIN(histogram_value(i), histogram->max);
+    }
+    return histogram->max;
+}
+
+void g_inet_histogram_reset(GInetHistogram * histogram)
+{
+    memset(histogram, 0, sizeof(GInetHistogram));
+}
+
+GInetHistogram *g_inet_histogram_new(void)
+{
+    return calloc(1, sizeof(GInetHistogram));
+}
+
+void g_inet_histogram_free(GInetHistogram * histogram)
+{
+    free(histogram);
+}
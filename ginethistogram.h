@@ -0,0 +1,41 @@
+/* GInetFlow - Latency Histogram
+ *
+ * Copyright (C) 2017 Allied Telesis Ltd
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef __G_INET_HISTOGRAM_H__
+#define __G_INET_HISTOGRAM_H__
+
+#include <glib.h>
+
+/* Log-linear buckets: each power of two is split into 2^SUB_BITS linear
+ * buckets, giving a relative error of at most 1/16 over the full range. */
+#define G_INET_HISTOGRAM_SUB_BITS   4
+#define G_INET_HISTOGRAM_SUB_COUNT  (1 << G_INET_HISTOGRAM_SUB_BITS)
+#define G_INET_HISTOGRAM_BUCKETS    ((64 - G_INET_HISTOGRAM_SUB_BITS + 1) * G_INET_HISTOGRAM_SUB_COUNT)
+
+typedef struct _GInetHistogram {
+    guint64 count;
+    guint64 max;
+    guint64 buckets[G_INET_HISTOGRAM_BUCKETS];
+} GInetHistogram;
+
+GInetHistogram *g_inet_histogram_new(void);
+void g_inet_histogram_free(GInetHistogram * histogram);
+void g_inet_histogram_add(GInetHistogram * histogram, guint64 value);
+guint64 g_inet_histogram_percentile(GInetHistogram * histogram, gdouble percentile);
+void g_inet_histogram_reset(GInetHistogram * histogram);
+
+#endif                          /* __G_INET_HISTOGRAM_H__ */
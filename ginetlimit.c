@@ -0,0 +1,110 @@
+/* GInetFlow - Per-Source Rate Limit
+ *
+ * Copyright (C) 2017 Allied Telesis Ltd
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "ginetlimit.h"
+
+#define LIMIT_TOKEN     1000000ULL
+
+/* Track up to sources (rounded up to a power of two) sources, each
+ * allowed rate tokens a second and burst at once */
+GInetLimit *g_inet_limit_new(guint sources, guint rate, guint burst)
+{
+    GInetLimit *limit = g_malloc0(sizeof(GInetLimit));
+    guint32 sets = 1;
+
+    while (sets * G_INET_LIMIT_WAYS < sources && sets < (1U << 28))
+        sets <<= 1;
+    limit->entries = g_new0(GInetLimitEntry, sets * G_INET_LIMIT_WAYS);
+    limit->mask = sets - 1;
+    limit->rate = MAX(rate, 1);
+    limit->burst = MAX(burst, 1);
+    return limit;
+}
+
+void g_inet_limit_free(GInetLimit * limit)
+{
+    if (limit) {
+        g_free(limit->entries);
+        g_free(limit);
+    }
+}
+
+/* The entry for a source, claiming the least recently seen one in its set
+ * if it has none */
+static GInetLimitEntry *limit_entry(GInetLimit * limit, guint64 hash, guint64 timestamp)
+{
+    GInetLimitEntry *set, *oldest;
+    guint32 tag;
+    int i;
+
+    /* Address hashes may be a bare multiply, whose low bits only see the
+     * low bits of the address, so mix before picking the set */
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDULL;
+    hash ^= hash >> 33;
+    set = &limit->entries[(hash & limit->mask) * G_INET_LIMIT_WAYS];
+    oldest = set;
+    tag = (hash >> 32) | 1;
+
+    for (i = 0; i < G_INET_LIMIT_WAYS; i++) {
+        if (set[i].tag == tag)
+            return &set[i];
+        if (set[i].last < oldest->last)
+            oldest = &set[i];
+    }
+    oldest->tag = tag;
+    oldest->last = timestamp;
+    oldest->credit = limit->burst * LIMIT_TOKEN;
+    oldest->throttled = FALSE;
+    return oldest;
+}
+
+/* Take a token for the source with this address hash. FALSE if it has
+ * none left, with throttled set on the first refusal of a run. */
+gboolean g_inet_limit_take(GInetLimit * limit, guint64 hash, guint64 timestamp,
+                           gboolean * throttled)
+{
+    GInetLimitEntry *entry = limit_entry(limit, hash, timestamp);
+    guint64 full = limit->burst * LIMIT_TOKEN;
+
+    *throttled = FALSE;
+    if (timestamp > entry->last) {
+        guint64 elapsed = timestamp - entry->last;
+
+        entry->credit = elapsed >= full / limit->rate ? full :
+            MIN(entry->credit + elapsed * limit->rate, full);
+        entry->last = timestamp;
+    }
+    if (entry->credit < LIMIT_TOKEN) {
+        *throttled = !entry->throttled;
+        entry->throttled = TRUE;
+        return FALSE;
+    }
+    entry->credit -= LIMIT_TOKEN;
+    entry->throttled = FALSE;
+    return TRUE;
+}
+
+guint64 g_inet_limit_memory(GInetLimit * limit)
+{
+    return sizeof(GInetLimit) + ((guint64) limit->mask + 1) * G_INET_LIMIT_WAYS *
+        sizeof(GInetLimitEntry);
+}
@@ -0,0 +1,49 @@
+/* GInetFlow - Per-Source Rate Limit
+ *
+ * Copyright (C) 2017 Allied Telesis Ltd
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef __G_INET_LIMIT_H__
+#define __G_INET_LIMIT_H__
+
+#include <glib.h>
+
+/* Token buckets for a fixed number of sources, four to a set. A source
+ * not in its set takes the place of the least recently seen one there,
+ * starting with a full bucket, so idle sources age out without timers. */
+#define G_INET_LIMIT_WAYS   4
+
+typedef struct _GInetLimitEntry {
+    guint64 last;
+    /* Tokens in millionths, so refill is rate per microsecond */
+    guint64 credit;
+    guint32 tag;
+    gboolean throttled;
+} GInetLimitEntry;
+
+typedef struct _GInetLimit {
+    GInetLimitEntry *entries;
+    guint32 mask;
+    guint rate;
+    guint burst;
+} GInetLimit;
+
+GInetLimit *g_inet_limit_new(guint sources, guint rate, guint burst);
+void g_inet_limit_free(GInetLimit * limit);
+gboolean g_inet_limit_take(GInetLimit * limit, guint64 hash, guint64 timestamp,
+                           gboolean * throttled);
+guint64 g_inet_limit_memory(GInetLimit * limit);
+
+#endif                          /* __G_INET_LIMIT_H__ */
@@ -0,0 +1,55 @@
+/* GInetFlow - Static tracepoints
+ *
+ * Copyright (C) 2017 Allied Telesis Ltd
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef __G_INET_PROBES_H__
+#define __G_INET_PROBES_H__
+
+/* USDT probes in the "ginetflow" provider. With <sys/sdt.h> each probe is
+ * a single nop until a tracer (bpftrace, perf, SystemTap) attaches to it.
+ * Without it, or with G_INET_FLOW_NO_PROBES, they compile away entirely.
+ * G_INET_PROBE may be defined before this header to consume the probes
+ * directly, e.g. from the unit tests.
+ *
+ * Probes and arguments:
+ *   get__entry(table)                    g_inet_flow_get_full called
+ *   get__return(table, flow)             g_inet_flow_get_full done (flow may be NULL)
+ *   parse__fail(table, reason)           GInetFlowParseFailure
+ *   flow__create(table, flow, hash)
+ *   flow__reject(table, size)            table at max, flow not created
+ *   flow__recycle(table, flow, state)    flow dropped to make room under a state quota
+ *   flow__update(flow, packets)
+ *   flow__state(flow, old, new)          GInetFlowState change
+ *   flow__expire(table, flow, state)     flow returned by g_inet_flow_expire
+ *   frag__store(fragments, id, pending)
+ *   frag__match(fragments, id)
+ *   frag__drop(fragments, id)            limit reached, fragment not tracked
+ *   frag__expire(fragments, count)
+ */
+#ifndef G_INET_PROBE
+#if !defined(G_INET_FLOW_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define G_INET_PROBE(name, ...)     STAP_PROBEV(ginetflow, name, ##__VA_ARGS__)
+#endif
+#endif
+#endif
+
+#ifndef G_INET_PROBE
+#define G_INET_PROBE(name, ...)     do { } while (0)
+#endif
+
+#endif                          /* __G_INET_PROBES_H__ */
@@ -0,0 +1,242 @@
+/* GInetFlow - Heavy Hitter Sketch
+ *
+ * Copyright (C) 2017 Allied Telesis Ltd
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "ginetsketch.h"
+
+/* Sketch of width (rounded up to a power of two) cells per row keeping
+ * the top k keys of key_size bytes by rank */
+GInetSketch *g_inet_sketch_new(guint width, guint k, gsize key_size, GInetSketchRank rank)
+{
+    GInetSketch *sketch = g_malloc0(sizeof(GInetSketch));
+    guint32 size = 64;
+
+    while (size < width && size < (1U << 28))
+        size <<= 1;
+    sketch->cells = g_new0(guint64, (gsize) size * G_INET_SKETCH_DEPTH * 2);
+    sketch->mask = size - 1;
+    sketch->rank = rank;
+    sketch->k = MAX(k, 1);
+    sketch->heap = g_new0(GInetSketchEntry, sketch->k);
+    size = 16;
+    while (size < 2 * sketch->k)
+        size <<= 1;
+    sketch->index = g_new0(guint32, size);
+    sketch->index_mask = size - 1;
+    sketch->where = g_new0(guint32, sketch->k);
+    sketch->key_size = key_size;
+    sketch->keys = g_malloc0(sketch->k * key_size);
+    return sketch;
+}
+
+void g_inet_sketch_free(GInetSketch * sketch)
+{
+    if (sketch) {
+        g_free(sketch->cells);
+        g_free(sketch->heap);
+        g_free(sketch->index);
+        g_free(sketch->where);
+        g_free(sketch->keys);
+        g_free(sketch);
+    }
+}
+
+static inline guint64 sketch_count(GInetSketchEntry * entry, GInetSketchRank rank)
+{
+    return entry->count[rank];
+}
+
+/* Heap moves keep where (NULL when sorting a copy) up to date */
+static inline void sketch_place(GInetSketchEntry * heap, guint32 * where, guint i,
+                                GInetSketchEntry * entry)
+{
+    heap[i] = *entry;
+    if (where)
+        where[entry->slot] = i;
+}
+
+static void sketch_up(GInetSketchEntry * heap, guint32 * where, guint i,
+                      GInetSketchRank rank)
+{
+    GInetSketchEntry entry = heap[i];
+
+    while (i && sketch_count(&heap[(i - 1) / 2], rank) > sketch_count(&entry, rank)) {
+        sketch_place(heap, where, i, &heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    sketch_place(heap, where, i, &entry);
+}
+
+static void sketch_down(GInetSketchEntry * heap, guint32 * where, guint size, guint i,
+                        GInetSketchRank rank)
+{
+    GInetSketchEntry entry = heap[i];
+    guint child;
+
+    while ((child = 2 * i + 1) < size) {
+        if (child + 1 < size &&
+            sketch_count(&heap[child + 1], rank) < sketch_count(&heap[child], rank))
+            child++;
+        if (sketch_count(&heap[child], rank) >= sketch_count(&entry, rank))
+            break;
+        sketch_place(heap, where, i, &heap[child]);
+        i = child;
+    }
+    sketch_place(heap, where, i, &entry);
+}
+
+static inline guint64 sketch_mix(guint64 h)
+{
+    h = (h ^ (h >> 33)) * 0xFF51AFD7ED558CCDULL;
+    return h ^ (h >> 33);
+}
+
+static inline GInetSketchEntry *sketch_indexed(GInetSketch * sketch, guint32 i)
+{
+    return &sketch->heap[sketch->where[sketch->index[i] - 1]];
+}
+
+/* Index bucket of the kept key with this hash, or of the empty bucket
+ * ending its probe run */
+static guint32 sketch_find(GInetSketch * sketch, guint64 hash)
+{
+    guint32 i = (guint32) sketch_mix(hash) & sketch->index_mask;
+
+    while (sketch->index[i] && sketch_indexed(sketch, i)->hash != hash)
+        i = (i + 1) & sketch->index_mask;
+    return i;
+}
+
+/* Clear index bucket i, moving later entries of the run back into the gap
+ * unless that would put them before their home bucket */
+static void sketch_unindex(GInetSketch * sketch, guint32 i)
+{
+    guint32 mask = sketch->index_mask;
+    guint32 j, home;
+
+    for (j = (i + 1) & mask; sketch->index[j]; j = (j + 1) & mask) {
+        home = (guint32) sketch_mix(sketch_indexed(sketch, j)->hash) & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            sketch->index[i] = sketch->index[j];
+            i = j;
+        }
+    }
+    sketch->index[i] = 0;
+}
+
+/* Update the heap with a key's new estimate. Only keys heavier than the
+ * lightest kept are looked up, and the index finds them at once. */
+static void sketch_offer(GInetSketch * sketch, guint64 hash, gconstpointer key,
+                         guint64 * count)
+{
+    GInetSketchEntry *heap = sketch->heap;
+    guint32 slot;
+    guint i;
+
+    if (sketch->size == sketch->k &&
+        count[sketch->rank] <= sketch_count(heap, sketch->rank))
+        return;
+    i = sketch_find(sketch, hash);
+    if (sketch->index[i]) {
+        i = sketch->where[sketch->index[i] - 1];
+        heap[i].count[0] = count[0];
+        heap[i].count[1] = count[1];
+        sketch_down(heap, sketch->where, sketch->size, i, sketch->rank);
+        return;
+    }
+    if (sketch->size < sketch->k) {
+        slot = sketch->size++;
+        heap[slot].slot = slot;
+        sketch->where[slot] = slot;
+    } else {
+        /* Replace the lightest */
+        slot = heap[0].slot;
+        sketch_unindex(sketch, sketch_find(sketch, heap[0].hash));
+    }
+    i = sketch->where[slot];
+    heap[i].hash = hash;
+    heap[i].count[0] = count[0];
+    heap[i].count[1] = count[1];
+    memcpy(sketch->keys + slot * sketch->key_size, key, sketch->key_size);
+    sketch->index[sketch_find(sketch, hash)] = slot + 1;
+    if (i)
+        sketch_up(heap, sketch->where, i, sketch->rank);
+    else
+        sketch_down(heap, sketch->where, sketch->size, 0, sketch->rank);
+}
+
+/* Count packets and bytes against the key with this hash */
+void g_inet_sketch_add(GInetSketch * sketch, guint64 hash, gconstpointer key,
+                       guint64 packets, guint64 bytes)
+{
+    guint64 *cells[G_INET_SKETCH_DEPTH];
+    guint64 count[2] = { G_MAXUINT64, G_MAXUINT64 };
+    /* Callers' hashes may only be mixed in some bits */
+    guint64 h = sketch_mix(hash);
+    guint32 step;
+    int d;
+
+    step = (guint32) (h >> 32) | 1;
+    for (d = 0; d < G_INET_SKETCH_DEPTH; d++) {
+        guint32 index = ((guint32) h + d * step) & sketch->mask;
+
+        cells[d] = &sketch->cells[(((gsize) d * (sketch->mask + 1)) + index) * 2];
+        count[0] = MIN(count[0], cells[d][0]);
+        count[1] = MIN(count[1], cells[d][1]);
+    }
+    count[0] += packets;
+    count[1] += bytes;
+    for (d = 0; d < G_INET_SKETCH_DEPTH; d++) {
+        cells[d][0] = MAX(cells[d][0], count[0]);
+        cells[d][1] = MAX(cells[d][1], count[1]);
+    }
+    sketch_offer(sketch, hash, key, count);
+}
+
+/* Fill top (room for k entries) with the heavy hitters, heaviest first,
+ * returning how many there are */
+guint g_inet_sketch_top(GInetSketch * sketch, GInetSketchEntry * top)
+{
+    guint size = sketch->size;
+
+    /* Heap sort, taking the lightest off the end each time */
+    memcpy(top, sketch->heap, size * sizeof(GInetSketchEntry));
+    while (size > 1) {
+        GInetSketchEntry lightest = top[0];
+
+        top[0] = top[--size];
+        sketch_down(top, NULL, size, 0, sketch->rank);
+        top[size] = lightest;
+    }
+    return sketch->size;
+}
+
+gconstpointer g_inet_sketch_key(GInetSketch * sketch, GInetSketchEntry * entry)
+{
+    return sketch->keys + entry->slot * sketch->key_size;
+}
+
+guint64 g_inet_sketch_memory(GInetSketch * sketch)
+{
+    return sizeof(GInetSketch) + ((guint64) sketch->mask + 1) * G_INET_SKETCH_DEPTH * 2 *
+        sizeof(guint64) + sketch->k * (sizeof(GInetSketchEntry) + sizeof(guint32) +
+                                       sketch->key_size) +
+        ((guint64) sketch->index_mask + 1) * sizeof(guint32);
+}
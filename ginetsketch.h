@@ -0,0 +1,69 @@
+/* GInetFlow - Heavy Hitter Sketch
+ *
+ * Copyright (C) 2017 Allied Telesis Ltd
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef __G_INET_SKETCH_H__
+#define __G_INET_SKETCH_H__
+
+#include <glib.h>
+
+/* Count-min sketch of packets and bytes per key, with the k keys counted
+ * highest kept in a min-heap. Each key adds to one cell in every row and
+ * its estimate is the smallest of them; cells are only raised as far as
+ * that estimate needs (conservative update), which keeps the error from
+ * colliding keys low. Keys are identified by their hash alone and a copy
+ * of each heavy hitter's key is kept for reporting. A small open addressed
+ * index finds a key's place in the heap, so updates cost O(log k). */
+#define G_INET_SKETCH_DEPTH     4
+
+/* What the heap is ordered by */
+typedef enum {
+    G_INET_SKETCH_PACKETS,
+    G_INET_SKETCH_BYTES,
+} GInetSketchRank;
+
+typedef struct _GInetSketchEntry {
+    guint64 hash;
+    guint64 count[2];
+    /* Index of the key copy */
+    guint32 slot;
+} GInetSketchEntry;
+
+typedef struct _GInetSketch {
+    /* Rows of packet and byte counter pairs */
+    guint64 *cells;
+    guint32 mask;
+    GInetSketchRank rank;
+    GInetSketchEntry *heap;
+    /* Key slot + 1 (0 for empty) by hash, and heap position by key slot */
+    guint32 *index;
+    guint32 index_mask;
+    guint32 *where;
+    guint8 *keys;
+    gsize key_size;
+    guint k;
+    guint size;
+} GInetSketch;
+
+GInetSketch *g_inet_sketch_new(guint width, guint k, gsize key_size, GInetSketchRank rank);
+void g_inet_sketch_free(GInetSketch * sketch);
+void g_inet_sketch_add(GInetSketch * sketch, guint64 hash, gconstpointer key,
+                       guint64 packets, guint64 bytes);
+guint g_inet_sketch_top(GInetSketch * sketch, GInetSketchEntry * top);
+gconstpointer g_inet_sketch_key(GInetSketch * sketch, GInetSketchEntry * entry);
+guint64 g_inet_sketch_memory(GInetSketch * sketch);
+
+#endif                          /* __G_INET_SKETCH_H__ */
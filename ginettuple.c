@@ -39,6 +39,59 @@ static int sock_address_comparison(struct sockaddr_storage *a, struct sockaddr_s
 void clear_cached(GInetTuple * tuple)
 {
     tuple->hash = 0;
+    tuple->keyed = FALSE;
+}
+
+/* Address bytes zero padded to the size of an IPv6 address */
+static inline void tuple_address(struct sockaddr_storage *address, guint8 * bytes)
+{
+    memset(bytes, 0, 16);
+    if (address->ss_family == AF_INET6)
+        memcpy(bytes, &((struct sockaddr_in6 *) address)->sin6_addr, 16);
+    else
+        memcpy(bytes, &((struct sockaddr_in *) address)->sin_addr, 4);
+}
+
+/* The lower end has the lower port, or the lower address if the ports match */
+static gboolean tuple_swapped(GInetTuple * tuple, guint8 * src, guint8 * dst)
+{
+    guint16 sport = ((struct sockaddr_in *) &tuple->src)->sin_port;
+    guint16 dport = ((struct sockaddr_in *) &tuple->dst)->sin_port;
+
+    tuple_address(&tuple->src, src);
+    tuple_address(&tuple->dst, dst);
+    return dport < sport || (dport == sport && memcmp(dst, src, 16) < 0);
+}
+
+void g_inet_tuple_canonicalize(GInetTuple * tuple)
+{
+    GInetTupleKey *key = &tuple->key;
+    guint16 sport = ((struct sockaddr_in *) &tuple->src)->sin_port;
+    guint16 dport = ((struct sockaddr_in *) &tuple->dst)->sin_port;
+    guint8 src[16], dst[16];
+
+    tuple->swapped = tuple_swapped(tuple, src, dst);
+    memcpy(key->lower, tuple->swapped ? dst : src, sizeof(key->lower));
+    memcpy(key->upper, tuple->swapped ? src : dst, sizeof(key->upper));
+    key->lower_port = tuple->swapped ? dport : sport;
+    key->upper_port = tuple->swapped ? sport : dport;
+    key->protocol = tuple->protocol;
+    key->family = tuple->src.ss_family;
+    tuple->hash = key->lower_port << 16 | key->upper_port;
+    tuple->keyed = TRUE;
+}
+
+static inline GInetTupleKey *tuple_key(GInetTuple * tuple)
+{
+    if (!tuple->keyed)
+        g_inet_tuple_canonicalize(tuple);
+    return &tuple->key;
+}
+
+gboolean g_inet_tuple_get_swapped(GInetTuple * tuple)
+{
+    tuple_key(tuple);
+    return tuple->swapped;
 }
 
 guint16 g_inet_tuple_get_src_port(GInetTuple * tuple)
@@ -64,30 +117,23 @@ struct sockaddr_storage *g_inet_tuple_get_dst(GInetTuple * tuple)
 void g_inet_tuple_set_protocol(GInetTuple * tuple, guint16 protocol)
 {
     tuple->protocol = protocol;
+    tuple->keyed = FALSE;
 }
 
+/* Worked out afresh as the parser and fragment list ask part way through
+ * filling a tuple in */
 struct sockaddr_storage *g_inet_tuple_get_lower(GInetTuple * tuple)
 {
-    guint16 sport = ((struct sockaddr_in *) &tuple->src)->sin_port;
-    guint16 dport = ((struct sockaddr_in *) &tuple->dst)->sin_port;
-    if (sport < dport ||
-        (sport == 0 && dport == 0 &&
-         sock_address_comparison(&tuple->src, &tuple->dst) < 0))
-        return &tuple->src;
-    else
-        return &tuple->dst;
+    guint8 src[16], dst[16];
+
+    return tuple_swapped(tuple, src, dst) ? &tuple->dst : &tuple->src;
 }
 
 struct sockaddr_storage *g_inet_tuple_get_upper(GInetTuple * tuple)
 {
-    guint16 sport = ((struct sockaddr_in *) &tuple->src)->sin_port;
-    guint16 dport = ((struct sockaddr_in *) &tuple->dst)->sin_port;
-    if (dport > sport ||
-        (dport == 0 && sport == 0 &&
-         sock_address_comparison(&tuple->dst, &tuple->src) > 0))
-        return &tuple->dst;
-    else
-        return &tuple->src;
+    guint8 src[16], dst[16];
+
+    return tuple_swapped(tuple, src, dst) ? &tuple->src : &tuple->dst;
 }
 
 struct sockaddr_storage *g_inet_tuple_get_server(GInetTuple * tuple)
@@ -107,28 +153,7 @@ guint16 g_inet_tuple_get_protocol(GInetTuple * tuple)
 
 gboolean g_inet_tuple_equal(GInetTuple * a, GInetTuple * b)
 {
-    if (a->protocol != b->protocol) {
-        return FALSE;
-    }
-
-    struct sockaddr_storage *lower_a = g_inet_tuple_get_lower(a);
-    struct sockaddr_storage *upper_a = g_inet_tuple_get_upper(a);
-    struct sockaddr_storage *lower_b = g_inet_tuple_get_lower(b);
-    struct sockaddr_storage *upper_b = g_inet_tuple_get_upper(b);
-
-    if (sock_address_comparison(lower_a, lower_b)) {
-        return FALSE;
-    }
-    if (((struct sockaddr_in *)lower_a)->sin_port != ((struct sockaddr_in *)lower_b)->sin_port) {
-        return FALSE;
-    }
-    if (sock_address_comparison(upper_a, upper_b)) {
-        return FALSE;
-    }
-    if (((struct sockaddr_in *)upper_a)->sin_port != ((struct sockaddr_in *)upper_b)->sin_port) {
-       return FALSE;
-    }
-    return TRUE;
+    return memcmp(tuple_key(a), tuple_key(b), sizeof(GInetTupleKey)) == 0;
 }
 
 gboolean g_inet_tuple_exact(GInetTuple * a, GInetTuple *b)
@@ -153,15 +178,6 @@ gboolean g_inet_tuple_exact(GInetTuple * a, GInetTuple *b)
 
 guint g_inet_tuple_hash(GInetTuple * tuple)
 {
-    if (tuple->hash)
-        return tuple->hash;
-
-    struct sockaddr_storage *lower = g_inet_tuple_get_lower(tuple);
-    struct sockaddr_storage *upper = g_inet_tuple_get_upper(tuple);
-
-    tuple->hash =
-        ((struct sockaddr_in *) lower)->
-        sin_port << 16 | ((struct sockaddr_in *) upper)->sin_port;
-
+    tuple_key(tuple);
     return tuple->hash;
 }
@@ -24,6 +24,18 @@
 
 #include <netinet/in.h>
 
+/* Direction independent form of a tuple with the lower end first, so both
+ * directions of a flow have the same bytes. IPv4 addresses are zero padded
+ * and the size is a whole number of 64 bit words for hashing. */
+typedef struct _GInetTupleKey {
+    guint8 lower[16];
+    guint8 upper[16];
+    guint16 lower_port;
+    guint16 upper_port;
+    guint16 protocol;
+    guint16 family;
+} GInetTupleKey;
+
 typedef struct _GInetTuple {
     struct sockaddr_storage src;
     struct sockaddr_storage dst;
@@ -31,6 +43,11 @@ typedef struct _GInetTuple {
     guint16 offset;
     /* Internal use only */
     guint hash;
+    /* Filled in by parsing, or on first use. Swapped is set when dst is
+     * the lower end. */
+    GInetTupleKey key;
+    guint8 swapped;
+    guint8 keyed;
 } GInetTuple;
 
 guint16 g_inet_tuple_get_src_port(GInetTuple * tuple);
@@ -42,6 +59,8 @@ struct sockaddr_storage *g_inet_tuple_get_upper(GInetTuple * tuple);
 struct sockaddr_storage *g_inet_tuple_get_server(GInetTuple * tuple);
 void g_inet_tuple_set_protocol(GInetTuple * tuple, guint16 protocol);
 guint16 g_inet_tuple_get_protocol(GInetTuple * tuple);
+void g_inet_tuple_canonicalize(GInetTuple * tuple);
+gboolean g_inet_tuple_get_swapped(GInetTuple * tuple);
 gboolean g_inet_tuple_equal(GInetTuple * a, GInetTuple * b);
 gboolean g_inet_tuple_exact(GInetTuple * a, GInetTuple * b);
 guint g_inet_tuple_hash(GInetTuple * t);
@@ -0,0 +1,98 @@
+#!/bin/sh
+# Instructions per call of the hot paths under callgrind, compared with a baseline
+# LD_LIBRARY_PATH=. perf/icount.sh [--update]
+#
+# Each workload runs bench with collection switched on only inside
+# g_inet_flow_get_full, g_inet_flow_parse and g_inet_flow_lookup, so frame
+# generation and timing are not counted. The inclusive instruction count of
+# each function is divided by the number of calls bench made to it and
+# compared with perf/icount.baseline. A count more than ICOUNT_TOLERANCE
+# percent (default 2) above the baseline fails. --update rewrites the baseline.
+# Without a baseline there is nothing to compare, so the run is skipped.
+#
+# Counts depend on the compiler, GLib and valgrind, so the baseline records
+# them and a run with a different toolchain warns that it is not comparable.
+set -e
+
+cd "$(dirname "$0")/.."
+BASELINE=perf/icount.baseline
+TOLERANCE=${ICOUNT_TOLERANCE:-2}
+BENCH=${BENCH:-./bench}
+
+if [ "$1" != "--update" ] && [ ! -f $BASELINE ]; then
+    echo "No $BASELINE, skipping the comparison - record one with make icount-baseline"
+    exit 0
+fi
+
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+if ! command -v valgrind >/dev/null; then
+    echo "valgrind is needed to count instructions"
+    exit 1
+fi
+TOOLCHAIN="$(valgrind --version), $(${CC:-cc} --version | head -n 1),\
+ glib $(${PKG_CONFIG:-pkg-config} --modversion glib-2.0), $(uname -m)"
+
+# name:bench arguments
+WORKLOADS="
+ipv4:-p test.pcap -l 20000
+ipv6:-p testv6.pcap -l 20000
+burst:-s 1 -f 20000 -n 200000 -l 100000 -z 1.0 -6 20 --vlan 10 --mpls 5 --gre 5 --frag 5 -e 1000
+"
+
+# Inclusive instructions of function $2 in callgrind output $1
+instructions() {
+    callgrind_annotate --inclusive=yes --threshold=100 "$1" 2>/dev/null |
+        awk -v f="$2" '$0 ~ ":" f "( |$)" { gsub(",", "", $1); print $1; exit }'
+}
+
+# Value of key $2 in bench JSON output $1
+field() {
+    sed -n "s/.*\"$2\": \([0-9]*\).*/\1/p" "$1"
+}
+
+echo "$WORKLOADS" | while IFS=: read -r name args; do
+    [ -n "$name" ] || continue
+    # shellcheck disable=SC2086
+    valgrind --tool=callgrind --callgrind-out-file="$OUT/$name.out" \
+        --toggle-collect=g_inet_flow_get_full --toggle-collect=g_inet_flow_parse \
+        --toggle-collect=g_inet_flow_lookup $BENCH -j $args >"$OUT/$name.json" 2>/dev/null
+    packets=$(field "$OUT/$name.json" packets)
+    lookups=$(field "$OUT/$name.json" lookups)
+    for metric in get_full:$packets parse:$lookups lookup:$lookups; do
+        count=$(instructions "$OUT/$name.out" "g_inet_flow_${metric%%:*}")
+        calls=${metric#*:}
+        [ "${calls:-0}" -gt 0 ] || calls=1
+        echo "$name ${metric%%:*} $((${count:-0} / calls))"
+    done
+done >"$OUT/current"
+
+if [ "$1" = "--update" ]; then
+    {
+        echo "# toolchain: $TOOLCHAIN"
+        echo "# workload function instructions-per-call"
+        cat "$OUT/current"
+    } >$BASELINE
+    cat $BASELINE
+    exit 0
+fi
+
+RECORDED=$(sed -n 's/^# toolchain: //p' $BASELINE)
+if [ "$RECORDED" != "$TOOLCHAIN" ]; then
+    echo "Baseline recorded with: $RECORDED"
+    echo "Now running with:       $TOOLCHAIN"
+    echo "Counts may differ for that reason alone"
+fi
+
+awk -v tolerance="$TOLERANCE" '
+    NR == FNR { if ($1 !~ /^#/) base[$1 " " $2] = $3; next }
+    {
+        key = $1 " " $2
+        if (!(key in base)) { printf "%-16s %10d (new)\n", key, $3; next }
+        change = base[key] ? ($3 - base[key]) * 100.0 / base[key] : 0
+        status = change > tolerance ? "REGRESSED" : ""
+        if (status != "") failed = 1
+        printf "%-16s %10d %10d %+7.2f%% %s\n", key, base[key], $3, change, status
+    }
+    END { exit failed }' $BASELINE "$OUT/current"
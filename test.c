@@ -15,9 +15,20 @@
  * You should have received a copy of the GNU General Public License
  * along with this library. If not, see <http://www.gnu.org/licenses/>
  */
+#include <glib.h>
+
+/* Stub consumer for the static tracepoints - count hits by probe name */
+static void test_probe_fire(const gchar * name);
+#define G_INET_PROBE(name, ...) test_probe_fire(#name)
+
 #include "ginetflow.c"
 #include "ginettuple.c"
 #include "ginetfraglist.c"
+#include "ginethistogram.c"
+#include "ginethash.c"
+#include "ginetfilter.c"
+#include "ginetlimit.c"
+#include "ginetsketch.c"
 #include <arpa/inet.h>
 
 static GInetTuple _test_tuple;
@@ -554,19 +565,19 @@ static void setup_test()
 void test_flow_parse_null_flow()
 {
     setup_test();
-    g_assert_false(flow_parse(NULL, test_buffer, 64, NULL, NULL, 0, NULL, FALSE));
+    g_assert_false(flow_parse(NULL, test_buffer, 64, NULL, NULL, 0, NULL, NULL, FALSE));
 }
 
 void test_flow_parse_null_buffer()
 {
     setup_test();
-    g_assert_false(flow_parse(test_tuple, NULL, 64, NULL, NULL, 0, NULL, FALSE));
+    g_assert_false(flow_parse(test_tuple, NULL, 64, NULL, NULL, 0, NULL, NULL, FALSE));
 }
 
 void test_flow_parse_0_length()
 {
     setup_test();
-    g_assert_false(flow_parse(test_tuple, test_buffer, 0, NULL, NULL, 0, NULL, FALSE));
+    g_assert_false(flow_parse(test_tuple, test_buffer, 0, NULL, NULL, 0, NULL, NULL, FALSE));
 }
 
 void test_flow_parse_less_than_eth_length()
@@ -574,7 +585,7 @@ void test_flow_parse_less_than_eth_length()
     setup_test();
     g_assert_false(flow_parse
                     (test_tuple, test_buffer, sizeof(ethernet_hdr_t) - 1, NULL, NULL, 0,
-                     NULL, FALSE));
+                     NULL, NULL, FALSE));
 }
 
 void test_flow_parse_udp()
@@ -583,17 +594,17 @@ void test_flow_parse_udp()
 
     GInetTuple *test = calloc(1, sizeof(GInetTuple));
     guint len = make_pkt(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_UDP);
-    g_assert(flow_parse(test, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse(test, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 
     len = make_pkt(test_buffer, ETH_PROTOCOL_IPV6, IP_PROTOCOL_UDP);
-    g_assert(flow_parse(test, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse(test, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 
     /* Reverse */
     len = make_pkt_reverse(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_UDP);
-    g_assert(flow_parse(test, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse(test, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 
     len = make_pkt_reverse(test_buffer, ETH_PROTOCOL_IPV6, IP_PROTOCOL_UDP);
-    g_assert(flow_parse(test, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse(test, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
     free(test);
 }
 
@@ -602,17 +613,56 @@ void test_flow_parse_tcp()
     setup_test();
 
     guint len = make_pkt(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_TCP);
-    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 
     len = make_pkt(test_buffer, ETH_PROTOCOL_IPV6, IP_PROTOCOL_TCP);
-    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 
     /* Reverse */
     len = make_pkt_reverse(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_TCP);
-    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 
     len = make_pkt_reverse(test_buffer, ETH_PROTOCOL_IPV6, IP_PROTOCOL_TCP);
-    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
+}
+
+void test_flow_parse_canonical()
+{
+    GInetTuple forward = { 0 };
+    GInetTuple reverse = { 0 };
+    guint len;
+
+    setup_test();
+    len = make_pkt(test_buffer, ETH_PROTOCOL_IPV6, IP_PROTOCOL_UDP);
+    g_inet_flow_parse(test_buffer, len, NULL, &forward, FALSE);
+    len = make_pkt_reverse(test_buffer, ETH_PROTOCOL_IPV6, IP_PROTOCOL_UDP);
+    g_inet_flow_parse(test_buffer, len, NULL, &reverse, FALSE);
+
+    /* Both directions have the same key and only the swapped bit differs */
+    g_assert_true(forward.keyed && reverse.keyed);
+    g_assert_true(memcmp(&forward.key, &reverse.key, sizeof(GInetTupleKey)) == 0);
+    g_assert_true(g_inet_tuple_equal(&forward, &reverse));
+    g_assert_false(g_inet_tuple_exact(&forward, &reverse));
+    g_assert_cmpuint(g_inet_tuple_hash(&forward), ==, g_inet_tuple_hash(&reverse));
+    g_assert_cmpint(g_inet_tuple_get_swapped(&forward), !=, g_inet_tuple_get_swapped(&reverse));
+    g_assert_true(g_inet_tuple_get_lower(&forward) ==
+                  (g_inet_tuple_get_swapped(&forward) ? &forward.dst : &forward.src));
+
+    /* Matching ports fall back to the addresses */
+    TEST_DPORT = TEST_SPORT;
+    len = make_pkt(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_UDP);
+    g_inet_flow_parse(test_buffer, len, NULL, &forward, FALSE);
+    len = make_pkt_reverse(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_UDP);
+    g_inet_flow_parse(test_buffer, len, NULL, &reverse, FALSE);
+    g_assert_true(g_inet_tuple_equal(&forward, &reverse));
+    g_assert_cmpint(g_inet_tuple_get_swapped(&forward), !=, g_inet_tuple_get_swapped(&reverse));
+
+    /* Tuples filled in by hand are keyed on first use */
+    forward.keyed = FALSE;
+    g_inet_tuple_set_protocol(&reverse, IP_PROTOCOL_TCP);
+    g_assert_false(g_inet_tuple_equal(&forward, &reverse));
+    g_assert_true(forward.keyed && reverse.keyed);
+    TEST_DPORT = _TEST_DPORT;
 }
 
 void test_flow_parse_icmp()
@@ -620,10 +670,10 @@ void test_flow_parse_icmp()
     setup_test();
 
     guint len = make_pkt(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_ICMP);
-    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 
     len = make_pkt(test_buffer, ETH_PROTOCOL_IPV6, IP_PROTOCOL_ICMPV6);
-    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 }
 
 void test_flow_parse_pppoe()
@@ -631,10 +681,10 @@ void test_flow_parse_pppoe()
     setup_test();
 
     guint len = make_pkt_pppoe(test_buffer, IP_PROTOCOL_UDP, PPP_PROTOCOL_IPV4);
-    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 
     len = make_pkt_pppoe(test_buffer, IP_PROTOCOL_UDP, PPP_PROTOCOL_IPV6);
-    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 }
 
 void test_flow_parse_vlan()
@@ -644,25 +694,25 @@ void test_flow_parse_vlan()
     guint len =
         make_pkt_vlan(test_buffer, ETH_PROTOCOL_IP, ETH_PROTOCOL_8021Q, IP_PROTOCOL_ICMP,
                       1);
-    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 
     len =
         make_pkt_vlan(test_buffer, ETH_PROTOCOL_IP, ETH_PROTOCOL_8021Q, IP_PROTOCOL_ICMP,
                       2);
-    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 
     len =
         make_pkt_vlan(test_buffer, ETH_PROTOCOL_IPV6, ETH_PROTOCOL_8021AD,
                       IP_PROTOCOL_ICMPV6, 1);
-    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 
     len =
         make_pkt_vlan(test_buffer, ETH_PROTOCOL_IPV6, ETH_PROTOCOL_8021AD,
                       IP_PROTOCOL_ICMPV6, 2);
-    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 
     len = make_pkt_vlan_Q_AD(test_buffer, ETH_PROTOCOL_IPV6, IP_PROTOCOL_ICMPV6);
-    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 }
 
 void test_flow_parse_mpls()
@@ -671,16 +721,16 @@ void test_flow_parse_mpls()
     setup_test();
 
     len = make_pkt_mpls(test_buffer, 0x1, ETH_PROTOCOL_IP, IP_PROTOCOL_ICMP, 1);
-    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 
     len = make_pkt_mpls(test_buffer, 0x2, ETH_PROTOCOL_IP, IP_PROTOCOL_ICMP, 2);
-    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 
     len = make_pkt_mpls(test_buffer, 0x3, ETH_PROTOCOL_IPV6, IP_PROTOCOL_ICMPV6, 1);
-    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 
     len = make_pkt_mpls(test_buffer, 0x4, ETH_PROTOCOL_IPV6, IP_PROTOCOL_ICMPV6, 2);
-    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 }
 
 void test_flow_parse_ipv6_ext()
@@ -688,46 +738,46 @@ void test_flow_parse_ipv6_ext()
     setup_test();
 
     guint len = make_pkt_ipv6_ext(test_buffer, IP_PROTOCOL_HBH_OPT, FALSE);
-    g_assert(flow_parse_ipv6(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse_ipv6(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 
     len = make_pkt_ipv6_ext(test_buffer, IP_PROTOCOL_DEST_OPT, FALSE);
-    g_assert(flow_parse_ipv6(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse_ipv6(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 
     len = make_pkt_ipv6_ext(test_buffer, IP_PROTOCOL_ROUTING, FALSE);
-    g_assert(flow_parse_ipv6(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse_ipv6(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 
     len = make_pkt_ipv6_ext(test_buffer, IP_PROTOCOL_MOBILITY, FALSE);
-    g_assert(flow_parse_ipv6(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse_ipv6(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 
     len = make_pkt_ipv6_ext(test_buffer, IP_PROTOCOL_HIPV2, FALSE);
-    g_assert(flow_parse_ipv6(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse_ipv6(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 
     len = make_pkt_ipv6_ext(test_buffer, IP_PROTOCOL_SHIM6, FALSE);
-    g_assert(flow_parse_ipv6(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse_ipv6(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 
     len = make_pkt_ipv6_ext(test_buffer, IP_PROTOCOL_FRAGMENT, FALSE);
-    g_assert(flow_parse_ipv6(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse_ipv6(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 
     len = make_pkt_ipv6_ext(test_buffer, IP_PROTOCOL_AUTH, FALSE);
-    g_assert(flow_parse_ipv6(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse_ipv6(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 
     len = make_pkt_ipv6_ext(test_buffer, IP_PROTOCOL_SCTP, FALSE);
-    g_assert(flow_parse_ipv6(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse_ipv6(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 
     len = make_pkt_ipv6_ext(test_buffer, IP_PROTOCOL_SCTP, TRUE);
-    g_assert(flow_parse_ipv6(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse_ipv6(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 
     len = make_pkt_ipv6_ext(test_buffer, IP_PROTOCOL_IPV4, FALSE);
-    g_assert(flow_parse_ipv6(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse_ipv6(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 
     len = make_pkt_ipv6_ext(test_buffer, IP_PROTOCOL_IPV6, FALSE);
-    g_assert(flow_parse_ipv6(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse_ipv6(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 
     len = make_pkt_ipv6_ext(test_buffer, IP_PROTOCOL_ESP, FALSE);
-    g_assert(flow_parse_ipv6(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse_ipv6(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 
     len = make_pkt_ipv6_ext(test_buffer, IP_PROTOCOL_NO_NEXT_HDR, FALSE);
-    g_assert(flow_parse_ipv6(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse_ipv6(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 }
 
 void test_flow_parse_gre()
@@ -736,22 +786,22 @@ void test_flow_parse_gre()
     setup_test();
 
     len = make_pkt_gre(test_buffer, ETH_PROTOCOL_IP, ETH_PROTOCOL_IP, IP_PROTOCOL_ICMP);
-    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, TRUE));
+    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, TRUE));
     g_assert(g_inet_tuple_get_protocol(test_tuple) == IP_PROTOCOL_ICMP);
 
     len = make_pkt_gre(test_buffer, ETH_PROTOCOL_IP,
                        ETH_PROTOCOL_PPPOE_SESS, IP_PROTOCOL_ICMP);
-    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, TRUE));
+    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, TRUE));
     g_assert(g_inet_tuple_get_protocol(test_tuple) == IP_PROTOCOL_GRE);
 
     len = make_pkt_gre(test_buffer, ETH_PROTOCOL_IPV6,
                        ETH_PROTOCOL_IPV6, IP_PROTOCOL_ICMPV6);
-    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, TRUE));
+    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, TRUE));
     g_assert(g_inet_tuple_get_protocol(test_tuple) == IP_PROTOCOL_ICMPV6);
 
     len = make_pkt_gre(test_buffer, ETH_PROTOCOL_IPV6,
                        ETH_PROTOCOL_PPPOE_SESS, IP_PROTOCOL_ICMPV6);
-    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, TRUE));
+    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, TRUE));
     g_assert(g_inet_tuple_get_protocol(test_tuple) == IP_PROTOCOL_GRE);
 }
 
@@ -761,12 +811,12 @@ void test_flow_parse_gre_no_tunnel_inspection()
     setup_test();
 
     len = make_pkt_gre(test_buffer, ETH_PROTOCOL_IP, ETH_PROTOCOL_IP, IP_PROTOCOL_ICMP);
-    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
     g_assert(g_inet_tuple_get_protocol(test_tuple) == IP_PROTOCOL_GRE);
 
     len = make_pkt_gre(test_buffer, ETH_PROTOCOL_IPV6,
                        ETH_PROTOCOL_IPV6, IP_PROTOCOL_ICMPV6);
-    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
     g_assert(g_inet_tuple_get_protocol(test_tuple) == IP_PROTOCOL_GRE);
 }
 
@@ -776,19 +826,19 @@ void test_flow_parse_unsupported_eth_protocols()
 
     /* ARP */
     guint len = make_pkt(test_buffer, 0x0806, IP_PROTOCOL_ICMP);
-    g_assert_false(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert_false(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 
     /* AARP */
     len = make_pkt(test_buffer, 0x80F3, IP_PROTOCOL_ICMP);
-    g_assert_false(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert_false(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 
     /* IPX */
     len = make_pkt(test_buffer, 0x8137, IP_PROTOCOL_ICMP);
-    g_assert_false(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert_false(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 
     /* PPPoE Discovery */
     len = make_pkt(test_buffer, 0x8863, IP_PROTOCOL_ICMP);
-    g_assert_false(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert_false(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 }
 
 void test_flow_parse_not_ipv6_ext()
@@ -797,11 +847,11 @@ void test_flow_parse_not_ipv6_ext()
 
     /* KRYPTOLAN */
     guint len = make_pkt_ipv6_ext(test_buffer, 65, FALSE);
-    g_assert(flow_parse_ipv6(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse_ipv6(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 
     /* IGMP */
     len = make_pkt_ipv6_ext(test_buffer, 2, FALSE);
-    g_assert(flow_parse_ipv6(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse_ipv6(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 }
 
 void test_flow_parse_unsupported_transport_protocols()
@@ -810,19 +860,19 @@ void test_flow_parse_unsupported_transport_protocols()
 
     /* CRUDP */
     guint len = make_pkt(test_buffer, ETH_PROTOCOL_IP, 127);
-    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 
     /* UDPLite */
     len = make_pkt(test_buffer, ETH_PROTOCOL_IP, 136);
-    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 
     /* IL */
     len = make_pkt(test_buffer, ETH_PROTOCOL_IPV6, 40);
-    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 
     /* IPv4 SCTP */
     len = make_pkt(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_SCTP);
-    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 }
 
 void test_flow_parse_unsupported_ppp_protocols()
@@ -831,15 +881,15 @@ void test_flow_parse_unsupported_ppp_protocols()
 
     /* IPCP */
     guint len = make_pkt_pppoe(test_buffer, IP_PROTOCOL_UDP, 0x8021);
-    g_assert_false(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert_false(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 
     /* ATCP */
     len = make_pkt_pppoe(test_buffer, IP_PROTOCOL_UDP, 0x8029);
-    g_assert_false(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert_false(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 
     /* IPXCP */
     len = make_pkt_pppoe(test_buffer, IP_PROTOCOL_UDP, 0x802B);
-    g_assert_false(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert_false(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 }
 
 void test_flow_parse_more_than_2_vlan_tags()
@@ -849,12 +899,12 @@ void test_flow_parse_more_than_2_vlan_tags()
     guint len =
         make_pkt_vlan(test_buffer, ETH_PROTOCOL_IP, ETH_PROTOCOL_8021Q, IP_PROTOCOL_ICMP,
                       3);
-    g_assert_false(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert_false(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 
     len =
         make_pkt_vlan(test_buffer, ETH_PROTOCOL_IPV6, ETH_PROTOCOL_8021AD,
                       IP_PROTOCOL_ICMPV6, 3);
-    g_assert_false(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, FALSE));
+    g_assert_false(flow_parse(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, FALSE));
 }
 
 void test_flow_parse_malformed_vlan_hdr_length()
@@ -867,9 +917,9 @@ void test_flow_parse_malformed_vlan_hdr_length()
 
     /* No VLAN length */
     g_assert_false(flow_parse(test_tuple, test_buffer, len - sizeof(vlan_hdr_t), NULL, NULL, 0,
-                     NULL, TRUE));
+                     NULL, NULL, TRUE));
     /* Partial VLAN length */
-    g_assert_false(flow_parse(test_tuple, test_buffer, len - 1, NULL, NULL, 0, NULL, FALSE));
+    g_assert_false(flow_parse(test_tuple, test_buffer, len - 1, NULL, NULL, 0, NULL, NULL, FALSE));
 }
 
 void test_flow_parse_malformed_ipv4_hdr_length()
@@ -882,9 +932,9 @@ void test_flow_parse_malformed_ipv4_hdr_length()
 
     /* No IPv4 length */
     g_assert_false(flow_parse(test_tuple, test_buffer, len - sizeof(ip_hdr_t), NULL, NULL, 0,
-                     NULL, FALSE));
+                     NULL, NULL, FALSE));
     /* Partial IPv4 length */
-    g_assert_false(flow_parse(test_tuple, test_buffer, len - 8, NULL, NULL, 0, NULL, FALSE));
+    g_assert_false(flow_parse(test_tuple, test_buffer, len - 8, NULL, NULL, 0, NULL, NULL, FALSE));
 }
 
 void test_flow_parse_malformed_ipv6_hdr_length()
@@ -897,9 +947,9 @@ void test_flow_parse_malformed_ipv6_hdr_length()
 
     /* No IPv6 length */
     g_assert_false(flow_parse(test_tuple, test_buffer, len - sizeof(ip6_hdr_t), NULL, NULL, 0,
-                     NULL, FALSE));
+                     NULL, NULL, FALSE));
     /* Partial IPv6 length */
-    g_assert_false(flow_parse(test_tuple, test_buffer, len - 8, NULL, NULL, 0, NULL, FALSE));
+    g_assert_false(flow_parse(test_tuple, test_buffer, len - 8, NULL, NULL, 0, NULL, NULL, FALSE));
 }
 
 void test_flow_parse_malformed_pppoe_hdr_length()
@@ -912,9 +962,9 @@ void test_flow_parse_malformed_pppoe_hdr_length()
 
     /* No PPPoE length */
     g_assert_false(flow_parse(test_tuple, test_buffer, len - sizeof(pppoe_sess_hdr_t), NULL,
-                     NULL, 0, NULL, FALSE));
+                     NULL, 0, NULL, NULL, FALSE));
     /* Partial PPPoE length */
-    g_assert_false(flow_parse(test_tuple, test_buffer, len - 2, NULL, NULL, 0, NULL, FALSE));
+    g_assert_false(flow_parse(test_tuple, test_buffer, len - 2, NULL, NULL, 0, NULL, NULL, FALSE));
 }
 
 void test_flow_parse_malformed_tcp_hdr_length()
@@ -928,9 +978,9 @@ void test_flow_parse_malformed_tcp_hdr_length()
 
     /* No TCP length */
     g_assert_false(flow_parse(test_tuple, test_buffer, len - sizeof(tcp_hdr_t), NULL, NULL, 0,
-                     NULL, TRUE));
+                     NULL, NULL, TRUE));
     /* Partial TCP length */
-    g_assert_false(flow_parse(test_tuple, test_buffer, len - 4, NULL, NULL, 0, NULL, TRUE));
+    g_assert_false(flow_parse(test_tuple, test_buffer, len - 4, NULL, NULL, 0, NULL, NULL, TRUE));
 }
 
 void test_flow_parse_malformed_udp_hdr_length()
@@ -944,9 +994,9 @@ void test_flow_parse_malformed_udp_hdr_length()
 
     /* No UDP length */
     g_assert_false(flow_parse(test_tuple, test_buffer, len - sizeof(udp_hdr_t), NULL, NULL, 0,
-                     NULL, FALSE));
+                     NULL, NULL, FALSE));
     /* Partial UDP length */
-    g_assert_false(flow_parse(test_tuple, test_buffer, len - 4, NULL, NULL, 0, NULL, FALSE));
+    g_assert_false(flow_parse(test_tuple, test_buffer, len - 4, NULL, NULL, 0, NULL, NULL, FALSE));
 }
 
 void test_flow_parse_malformed_icmp_hdr_length()
@@ -956,10 +1006,10 @@ void test_flow_parse_malformed_icmp_hdr_length()
     guint len = make_pkt(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_ICMP);
 
     /* No ICMP length */
-    g_assert(flow_parse(test_tuple, test_buffer, len - sizeof(icmp_hdr_t), NULL, NULL, 0, NULL,
+    g_assert(flow_parse(test_tuple, test_buffer, len - sizeof(icmp_hdr_t), NULL, NULL, 0, NULL, NULL,
                FALSE));
     /* Partial ICMP length */
-    g_assert(flow_parse(test_tuple, test_buffer, len - 4, NULL, NULL, 0, NULL, FALSE));
+    g_assert(flow_parse(test_tuple, test_buffer, len - 4, NULL, NULL, 0, NULL, NULL, FALSE));
 }
 
 void test_flow_parse_malformed_ipv6_ext_hbh_length()
@@ -972,13 +1022,13 @@ void test_flow_parse_malformed_ipv6_ext_hbh_length()
 
     /* No HBH header length ( (4 + 1) * 8) */
     g_assert_false(flow_parse_ipv6
-                    (test_tuple, test_buffer, len - 40, NULL, NULL, 0, NULL, FALSE));
+                    (test_tuple, test_buffer, len - 40, NULL, NULL, 0, NULL, NULL, FALSE));
     /* Partial part HBH header length */
     g_assert_false(flow_parse_ipv6
-                    (test_tuple, test_buffer, len - 39, NULL, NULL, 0, NULL, FALSE));
+                    (test_tuple, test_buffer, len - 39, NULL, NULL, 0, NULL, NULL, FALSE));
     /* Partial full HBH length */
     g_assert_false(flow_parse_ipv6
-                    (test_tuple, test_buffer, len - 8, NULL, NULL, 0, NULL, FALSE));
+                    (test_tuple, test_buffer, len - 8, NULL, NULL, 0, NULL, NULL, FALSE));
 }
 
 void test_flow_parse_malformed_ipv6_ext_frag_length()
@@ -992,10 +1042,10 @@ void test_flow_parse_malformed_ipv6_ext_frag_length()
     /* No Fragment header length */
     g_assert_false(flow_parse_ipv6
                     (test_tuple, test_buffer, len - sizeof(frag_hdr_t), NULL, NULL, 0,
-                     NULL, FALSE));
+                     NULL, NULL, FALSE));
     /* Partial Fragment length */
     g_assert_false(flow_parse_ipv6
-                    (test_tuple, test_buffer, len - 4, NULL, NULL, 0, NULL, FALSE));
+                    (test_tuple, test_buffer, len - 4, NULL, NULL, 0, NULL, NULL, FALSE));
 }
 
 void test_flow_parse_malformed_ipv6_ext_auth_length()
@@ -1008,13 +1058,13 @@ void test_flow_parse_malformed_ipv6_ext_auth_length()
 
     /* No Auth length ( (4 + 2) * 4) */
     g_assert_false(flow_parse_ipv6
-                    (test_tuple, test_buffer, len - 24, NULL, NULL, 0, NULL, FALSE));
+                    (test_tuple, test_buffer, len - 24, NULL, NULL, 0, NULL, NULL, FALSE));
     /* Partial part Auth header length */
     g_assert_false(flow_parse_ipv6
-                    (test_tuple, test_buffer, len - 23, NULL, NULL, 0, NULL, FALSE));
+                    (test_tuple, test_buffer, len - 23, NULL, NULL, 0, NULL, NULL, FALSE));
     /* Partial full Auth length */
     g_assert_false(flow_parse_ipv6
-                    (test_tuple, test_buffer, len - 8, NULL, NULL, 0, NULL, FALSE));
+                    (test_tuple, test_buffer, len - 8, NULL, NULL, 0, NULL, NULL, FALSE));
 }
 
 void test_flow_parse_malformed_ipv6_ext_sctp_length()
@@ -1027,11 +1077,11 @@ void test_flow_parse_malformed_ipv6_ext_sctp_length()
 
     /* No SCTP length */
     g_assert_false(flow_parse_ipv6
-                    (test_tuple, test_buffer, sizeof(sctp_hdr_t), NULL, NULL, 0, NULL,
+                    (test_tuple, test_buffer, sizeof(sctp_hdr_t), NULL, NULL, 0, NULL, NULL,
                      FALSE));
     /* Partial SCTP length */
     g_assert_false(flow_parse_ipv6
-                    (test_tuple, test_buffer, len - 8, NULL, NULL, 0, NULL, FALSE));
+                    (test_tuple, test_buffer, len - 8, NULL, NULL, 0, NULL, NULL, FALSE));
 }
 
 gchar *num_to_string(guint8 * number, GSocketFamily family)
@@ -1429,6 +1479,734 @@ void test_flow_table_size()
     g_object_unref(table);
 }
 
+#define STATS_THREADS   4
+
+static gpointer stats_thread_func(gpointer data)
+{
+    GInetFlowTable *table = (GInetFlowTable *) data;
+    guint8 buffer[MAX_BUFFER_SIZE] = { 0 };
+
+    /* ARP */
+    guint len = make_pkt(buffer, 0x0806, IP_PROTOCOL_ICMP);
+    for (int i = 0; i < 100; i++)
+        g_assert_null(g_inet_flow_get_full(table, buffer, len, 0, 0, TRUE, TRUE, FALSE,
+                                           NULL, NULL));
+    return NULL;
+}
+
+void test_flow_table_stats()
+{
+    GInetFlowTable *table = g_inet_flow_table_new();
+    GInetFlowTableStats stats;
+    GThread *threads[STATS_THREADS];
+    guint64 now = get_time_us();
+    GInetFlow *flow;
+    guint len;
+    int i;
+
+    setup_test();
+    g_assert_nonnull(table);
+    g_inet_flow_table_max_set(table, 2);
+
+    len = make_pkt(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_UDP);
+    g_assert_nonnull((flow = g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE,
+                                                  FALSE, NULL, NULL)));
+    len = make_pkt_gre(test_buffer, ETH_PROTOCOL_IP, ETH_PROTOCOL_IP, IP_PROTOCOL_ICMP);
+    g_assert_nonnull(g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE,
+                                          TRUE, NULL, NULL));
+    len = make_pkt(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_TCP);
+    g_assert_null(g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE,
+                                       FALSE, NULL, NULL));
+    len = make_pkt_vlan(test_buffer, ETH_PROTOCOL_IP, ETH_PROTOCOL_8021Q, IP_PROTOCOL_ICMP, 3);
+    g_assert_null(g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE,
+                                       FALSE, NULL, NULL));
+    len = make_pkt(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_UDP);
+    g_assert_null(g_inet_flow_get_full(table, test_buffer, len - 1, 0, now, TRUE, TRUE,
+                                       FALSE, NULL, NULL));
+
+    /* Unsupported ethertype from several threads */
+    for (i = 0; i < STATS_THREADS; i++)
+        threads[i] = g_thread_new("stats", stats_thread_func, table);
+    for (i = 0; i < STATS_THREADS; i++)
+        g_thread_join(threads[i]);
+
+    /* Expired flows are only counted once */
+    g_assert(g_inet_flow_expire(table, now + 31 * 1000000) == flow);
+    g_assert(g_inet_flow_expire(table, now + 31 * 1000000) == flow);
+
+    g_inet_flow_table_stats_get(table, &stats);
+    g_assert_cmpuint(stats.size, ==, 2);
+    g_assert_cmpuint(stats.created, ==, 2);
+    g_assert_cmpuint(stats.create_failed, ==, 1);
+    g_assert_cmpuint(stats.expired[FLOW_NEW], ==, 1);
+    g_assert_cmpuint(stats.expired[FLOW_OPEN], ==, 0);
+    g_assert_cmpuint(stats.tunnels, ==, 1);
+    g_assert_cmpuint(stats.parse_failed[G_INET_FLOW_PARSE_TOO_MANY_TAGS], ==, 1);
+    g_assert_cmpuint(stats.parse_failed[G_INET_FLOW_PARSE_TRUNCATED], ==, 1);
+    g_assert_cmpuint(stats.parse_failed[G_INET_FLOW_PARSE_UNSUPPORTED_ETHERTYPE], ==,
+                     STATS_THREADS * 100);
+    g_assert_cmpuint(stats.chains, >=, 1);
+    g_assert_cmpuint(stats.chain_max, >=, 1);
+
+    g_object_unref(flow);
+    g_object_unref(table);
+}
+
+void test_flow_table_stats_switch()
+{
+    GInetFlowTable *tables[FLOW_STATS_CACHE + 1];
+    GInetFlowTableStats stats;
+    GInetFlowTableMemory memory;
+    guint64 other;
+    guint len;
+    int i;
+
+    setup_test();
+    for (i = 0; i <= FLOW_STATS_CACHE; i++)
+        tables[i] = g_inet_flow_table_new();
+    g_assert_cmpuint(tables[0]->id % FLOW_STATS_CACHE, ==,
+                     tables[FLOW_STATS_CACHE]->id % FLOW_STATS_CACHE);
+
+    /* Alternating between tables that share a cache slot reuses one block each */
+    len = make_pkt(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_UDP);
+    g_assert_null(g_inet_flow_get_full(tables[0], test_buffer, len - 1, 0, 0, TRUE, TRUE,
+                                       FALSE, NULL, NULL));
+    g_inet_flow_table_memory_get(tables[0], &memory);
+    other = memory.other;
+    for (i = 0; i < 100; i++) {
+        g_assert_null(g_inet_flow_get_full(tables[0], test_buffer, len - 1, 0, 0, TRUE, TRUE,
+                                           FALSE, NULL, NULL));
+        g_assert_null(g_inet_flow_get_full(tables[FLOW_STATS_CACHE], test_buffer, len - 1, 0,
+                                           0, TRUE, TRUE, FALSE, NULL, NULL));
+    }
+    g_assert_cmpint(tables[0]->nstats, ==, 1);
+    g_assert_cmpint(tables[FLOW_STATS_CACHE]->nstats, ==, 1);
+    g_inet_flow_table_memory_get(tables[0], &memory);
+    g_assert_cmpuint(memory.other, ==, other);
+    g_inet_flow_table_stats_get(tables[0], &stats);
+    g_assert_cmpuint(stats.parse_failed[G_INET_FLOW_PARSE_TRUNCATED], ==, 101);
+
+    for (i = 0; i <= FLOW_STATS_CACHE; i++)
+        g_object_unref(tables[i]);
+}
+
+#define TEST_PROBES     16
+
+static struct {
+    const gchar *name;
+    guint hits;
+} test_probes[TEST_PROBES];
+static GMutex test_probe_lock;
+
+static void test_probe_fire(const gchar * name)
+{
+    int i;
+
+    g_mutex_lock(&test_probe_lock);
+    for (i = 0; i < TEST_PROBES; i++) {
+        if (!test_probes[i].name)
+            test_probes[i].name = name;
+        if (strcmp(test_probes[i].name, name) == 0) {
+            test_probes[i].hits++;
+            break;
+        }
+    }
+    g_mutex_unlock(&test_probe_lock);
+}
+
+static guint test_probe_hits(const gchar * name)
+{
+    guint hits = 0;
+    int i;
+
+    g_mutex_lock(&test_probe_lock);
+    for (i = 0; i < TEST_PROBES && test_probes[i].name; i++) {
+        if (strcmp(test_probes[i].name, name) == 0)
+            hits = test_probes[i].hits;
+    }
+    g_mutex_unlock(&test_probe_lock);
+    return hits;
+}
+
+static void test_probe_reset(void)
+{
+    g_mutex_lock(&test_probe_lock);
+    memset(test_probes, 0, sizeof(test_probes));
+    g_mutex_unlock(&test_probe_lock);
+}
+
+void test_flow_probes()
+{
+    GInetFlowTable *table = g_inet_flow_table_new();
+    guint64 now = get_time_us();
+    GInetFlow *flow, *frag_flow;
+    guint8 *p;
+    guint len;
+
+    setup_test();
+    test_probe_reset();
+    g_assert_nonnull(table);
+    g_inet_flow_table_max_set(table, 1);
+
+    len = make_pkt(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_UDP);
+    g_assert_nonnull((flow = g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE,
+                                                  FALSE, NULL, NULL)));
+    len = make_pkt_reverse(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_UDP);
+    g_assert(flow == g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE,
+                                          FALSE, NULL, NULL));
+    len = make_pkt(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_TCP);
+    g_assert_null(g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE,
+                                       FALSE, NULL, NULL));
+    len = make_pkt(test_buffer, 0x0806, IP_PROTOCOL_ICMP);
+    g_assert_null(g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE,
+                                       FALSE, NULL, NULL));
+
+    /* First and last IP fragment */
+    g_inet_flow_table_max_set(table, 0);
+    p = build_hdr_eth(test_buffer, ETH_PROTOCOL_IP);
+    p = build_hdr_ip_fragment(p, ETH_PROTOCOL_IP, IP_PROTOCOL_UDP, FALSE, TRUE, 0, 0xbeef);
+    len = (guint) (p - test_buffer);
+    g_assert_nonnull((frag_flow =
+                        g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE,
+                                             FALSE, NULL, NULL)));
+    p = build_hdr_eth(test_buffer, ETH_PROTOCOL_IP);
+    p = build_hdr_ip_fragment(p, ETH_PROTOCOL_IP, IP_PROTOCOL_UDP, FALSE, FALSE, 0xb9,
+                              0xbeef);
+    g_assert(frag_flow == g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE,
+                                               FALSE, NULL, NULL));
+
+    g_assert(g_inet_flow_expire(table, now + 31 * 1000000) == frag_flow);
+
+    g_assert_cmpuint(test_probe_hits("get__entry"), ==, 6);
+    g_assert_cmpuint(test_probe_hits("get__return"), ==, 6);
+    g_assert_cmpuint(test_probe_hits("flow__create"), ==, 2);
+    g_assert_cmpuint(test_probe_hits("flow__reject"), ==, 1);
+    g_assert_cmpuint(test_probe_hits("flow__update"), ==, 2);
+    g_assert_cmpuint(test_probe_hits("flow__state"), ==, 1);
+    g_assert_cmpuint(test_probe_hits("flow__expire"), ==, 1);
+    g_assert_cmpuint(test_probe_hits("parse__fail"), ==, 1);
+    g_assert_cmpuint(test_probe_hits("frag__store"), ==, 1);
+    g_assert_cmpuint(test_probe_hits("frag__match"), ==, 1);
+    g_assert_cmpuint(test_probe_hits("frag__drop"), ==, 0);
+
+    g_object_unref(frag_flow);
+    g_object_unref(flow);
+    g_object_unref(table);
+}
+
+void test_histogram_percentile()
+{
+    GInetHistogram *histogram = g_inet_histogram_new();
+    guint64 value;
+
+    g_assert_nonnull(histogram);
+    g_assert_cmpuint(g_inet_histogram_percentile(histogram, 50.0), ==, 0);
+    for (value = 1; value <= 1000; value++)
+        g_inet_histogram_add(histogram, value);
+    g_inet_histogram_add(histogram, 1000000);
+
+    /* Within the 1/16 bucket resolution */
+    value = g_inet_histogram_percentile(histogram, 50.0);
+    g_assert_cmpuint(value, >=, 500);
+    g_assert_cmpuint(value, <=, 500 + 500 / 16);
+    value = g_inet_histogram_percentile(histogram, 99.0);
+    g_assert_cmpuint(value, >=, 990);
+    g_assert_cmpuint(value, <=, 990 + 990 / 16);
+    g_assert_cmpuint(g_inet_histogram_percentile(histogram, 100.0), ==, 1000000);
+    g_assert_cmpuint(histogram->count, ==, 1001);
+
+    g_inet_histogram_reset(histogram);
+    g_assert_cmpuint(histogram->count, ==, 0);
+    g_inet_histogram_free(histogram);
+}
+
+typedef struct test_hash_entry {
+    GInetHashNode node;
+    guint key;
+} test_hash_entry;
+
+static gboolean test_hash_equal(GInetHashNode * node, gconstpointer key)
+{
+    return ((test_hash_entry *) node)->key == GPOINTER_TO_UINT(key);
+}
+
+#define TEST_HASH_ENTRIES 10000
+#define TEST_HASH(key) ((key) * 2654435761U)
+
+void test_hash_resize()
+{
+    GInetHash *hash = g_inet_hash_new(test_hash_equal);
+    test_hash_entry *entries = g_new0(test_hash_entry, TEST_HASH_ENTRIES);
+    gboolean resized = FALSE;
+    guint64 chains, chain_max;
+    guint i, j;
+
+    for (i = 0; i < TEST_HASH_ENTRIES; i++) {
+        entries[i].key = i + 1;
+        g_inet_hash_insert(hash, &entries[i].node, TEST_HASH(i + 1));
+        /* Entries in both arrays are found part way through a resize */
+        if (hash->old && hash->migrated > 0 && !resized) {
+            resized = TRUE;
+            for (j = 0; j <= i; j++)
+                g_assert_true(g_inet_hash_lookup(hash, TEST_HASH(j + 1),
+                                                 GUINT_TO_POINTER(j + 1)) == &entries[j].node);
+            /* Compacting in the background leaves a growth to move on */
+            g_assert_false(g_inet_hash_compact(hash, FALSE));
+            g_assert_nonnull(hash->old);
+        }
+        /* Each insert moves a bounded number of buckets */
+        g_assert_cmpuint(hash->mask + 1, <=, 2 * MAX(i + 1, G_INET_HASH_MIN_BUCKETS));
+    }
+    g_assert_true(resized);
+    g_assert_cmpuint(g_inet_hash_size(hash), ==, TEST_HASH_ENTRIES);
+    g_assert_null(g_inet_hash_lookup(hash, TEST_HASH(0), GUINT_TO_POINTER(0)));
+    g_inet_hash_chains(hash, &chains, &chain_max);
+    g_assert_cmpuint(chains, >, TEST_HASH_ENTRIES / 4);
+    g_assert_cmpuint(chain_max, <, 16);
+    g_assert_cmpuint(g_inet_hash_memory(hash, TEST_HASH_ENTRIES), >=,
+                     (hash->mask + 1) * sizeof(gpointer));
+
+    for (i = 0; i < TEST_HASH_ENTRIES; i++) {
+        g_assert_true(g_inet_hash_remove(hash, &entries[i].node));
+        g_assert_false(g_inet_hash_remove(hash, &entries[i].node));
+        if (i + 1 < TEST_HASH_ENTRIES)
+            g_assert_true(g_inet_hash_lookup(hash, TEST_HASH(TEST_HASH_ENTRIES),
+                                             GUINT_TO_POINTER(TEST_HASH_ENTRIES)) ==
+                          &entries[TEST_HASH_ENTRIES - 1].node);
+    }
+    /* Only shrinks when compacted, and not below the reserved size */
+    g_assert_cmpuint(g_inet_hash_size(hash), ==, 0);
+    g_assert_true(g_inet_hash_sparse(hash));
+    g_inet_hash_reserve(hash, 1000);
+    g_assert_true(g_inet_hash_compact(hash, TRUE));
+    g_assert_null(hash->old);
+    g_assert_cmpuint(hash->mask + 1, ==, 1024);
+    g_assert_false(g_inet_hash_sparse(hash));
+    g_assert_false(g_inet_hash_compact(hash, TRUE));
+    g_inet_hash_free(hash);
+    g_free(entries);
+}
+
+/* Bucket summaries stay exact through inserts, removes and resizes */
+static void test_hash_check_tags(GInetHash * hash)
+{
+    GInetHashNode *node;
+    guint32 tags;
+    guint32 i;
+
+    g_assert_null(hash->old);
+    for (i = 0; i <= hash->mask; i++) {
+        for (tags = 0, node = hash->buckets[i].head; node; node = node->next)
+            tags |= hash_tag(node->hash);
+        g_assert_cmpuint(hash->buckets[i].tags, ==, tags);
+        if (hash->buckets[i].head)
+            g_assert_cmpuint(hash->buckets[i].hash, ==, hash->buckets[i].head->hash);
+    }
+}
+
+void test_hash_tags()
+{
+    GInetHash *hash = g_inet_hash_new(test_hash_equal);
+    test_hash_entry *entries = g_new0(test_hash_entry, TEST_HASH_ENTRIES);
+    guint32 hashval;
+    guint rejected = 0;
+    guint i;
+
+    for (i = 0; i < TEST_HASH_ENTRIES; i++) {
+        entries[i].key = i + 1;
+        g_inet_hash_insert(hash, &entries[i].node, TEST_HASH(i + 1));
+    }
+    g_inet_hash_compact(hash, TRUE);
+    hash_migrate(hash, G_MAXUINT);
+    test_hash_check_tags(hash);
+
+    /* Most misses are rejected by the bucket alone */
+    for (i = TEST_HASH_ENTRIES; i < 2 * TEST_HASH_ENTRIES; i++) {
+        hashval = TEST_HASH(i + 1);
+        if (!(hash->buckets[hashval & hash->mask].tags & hash_tag(hashval)))
+            rejected++;
+        g_assert_null(g_inet_hash_lookup(hash, hashval, GUINT_TO_POINTER(i + 1)));
+    }
+    g_assert_cmpuint(rejected, >, TEST_HASH_ENTRIES * 9 / 10);
+
+    for (i = 0; i < TEST_HASH_ENTRIES; i += 3)
+        g_assert_true(g_inet_hash_remove(hash, &entries[i].node));
+    hash_migrate(hash, G_MAXUINT);
+    test_hash_check_tags(hash);
+    for (i = 0; i < TEST_HASH_ENTRIES; i++)
+        g_assert_true(g_inet_hash_lookup(hash, TEST_HASH(i + 1), GUINT_TO_POINTER(i + 1)) ==
+                      (i % 3 ? &entries[i].node : NULL));
+    g_inet_hash_free(hash);
+    g_free(entries);
+}
+
+static void test_hash_count(GInetHashNode * node, gpointer user_data)
+{
+    (*(guint *) user_data)++;
+}
+
+void test_hash_cuckoo()
+{
+    GInetHash *hash = g_inet_hash_new_cuckoo(test_hash_equal);
+    test_hash_entry *entries = g_new0(test_hash_entry, 2 * TEST_HASH_ENTRIES);
+    guint64 chains, chain_max;
+    guint32 count;
+    guint found = 0;
+    guint i;
+
+    /* Reserved to run at its load limit when full */
+    g_inet_hash_reserve(hash, TEST_HASH_ENTRIES);
+    count = hash->count;
+    g_assert_cmpuint((guint64) count * G_INET_HASH_SLOTS * G_INET_HASH_CUCKOO_LOAD, <,
+                     (guint64) (TEST_HASH_ENTRIES + G_INET_HASH_SLOTS) * 100);
+    for (i = 0; i < TEST_HASH_ENTRIES; i++) {
+        entries[i].key = i + 1;
+        g_inet_hash_insert(hash, &entries[i].node, TEST_HASH(i + 1));
+    }
+    g_assert_cmpuint(hash->count, ==, count);
+    g_assert_cmpuint(g_inet_hash_size(hash), ==, TEST_HASH_ENTRIES);
+    for (i = 0; i < TEST_HASH_ENTRIES; i++)
+        g_assert_true(g_inet_hash_lookup(hash, TEST_HASH(i + 1), GUINT_TO_POINTER(i + 1)) ==
+                      &entries[i].node);
+    g_assert_null(g_inet_hash_lookup(hash, TEST_HASH(0), GUINT_TO_POINTER(0)));
+    g_inet_hash_chains(hash, &chains, &chain_max);
+    g_assert_cmpuint(chains, >, count * 9 / 10);
+    g_assert_cmpuint(chain_max, ==, G_INET_HASH_SLOTS);
+    g_assert_cmpuint(g_inet_hash_memory(hash, TEST_HASH_ENTRIES), ==,
+                     count * sizeof(GInetHashBucket));
+    g_assert_cmpuint(g_inet_hash_memory(hash, 2 * TEST_HASH_ENTRIES), ==,
+                     3 * count * sizeof(GInetHashBucket));
+
+    /* Removes free slots for later inserts */
+    for (i = 0; i < TEST_HASH_ENTRIES; i += 2) {
+        g_assert_true(g_inet_hash_remove(hash, &entries[i].node));
+        g_assert_false(g_inet_hash_remove(hash, &entries[i].node));
+    }
+    for (i = 1; i < TEST_HASH_ENTRIES; i += 2)
+        g_assert_true(g_inet_hash_lookup(hash, TEST_HASH(i + 1), GUINT_TO_POINTER(i + 1)) ==
+                      &entries[i].node);
+    for (i = 0; i < TEST_HASH_ENTRIES; i += 2)
+        g_inet_hash_insert(hash, &entries[i].node, TEST_HASH(i + 1));
+    g_assert_cmpuint(hash->count, ==, count);
+
+    /* Grows past its load */
+    for (i = TEST_HASH_ENTRIES; i < 2 * TEST_HASH_ENTRIES; i++) {
+        entries[i].key = i + 1;
+        g_inet_hash_insert(hash, &entries[i].node, TEST_HASH(i + 1));
+    }
+    g_assert_cmpuint(hash->count, >=, 2 * count);
+    for (i = 0; i < 2 * TEST_HASH_ENTRIES; i++)
+        g_assert_true(g_inet_hash_lookup(hash, TEST_HASH(i + 1), GUINT_TO_POINTER(i + 1)) ==
+                      &entries[i].node);
+    g_inet_hash_foreach(hash, test_hash_count, &found);
+    g_assert_cmpuint(found, ==, 2 * TEST_HASH_ENTRIES);
+
+    /* Shrinks back to the reserved size when compacted */
+    g_inet_hash_remove_all(hash, test_hash_count, &found);
+    g_assert_cmpuint(found, ==, 4 * TEST_HASH_ENTRIES);
+    g_assert_cmpuint(g_inet_hash_size(hash), ==, 0);
+    g_assert_cmpuint(hash->count, ==, count);
+    g_inet_hash_insert(hash, &entries[0].node, TEST_HASH(1));
+    g_inet_hash_reserve(hash, 1000);
+    g_assert_true(g_inet_hash_sparse(hash));
+    g_assert_true(g_inet_hash_compact(hash, TRUE));
+    g_assert_cmpuint(hash->count, <, count / 8);
+    g_assert_false(g_inet_hash_sparse(hash));
+    g_assert_false(g_inet_hash_compact(hash, TRUE));
+    g_assert_true(g_inet_hash_lookup(hash, TEST_HASH(1), GUINT_TO_POINTER(1)) ==
+                  &entries[0].node);
+    g_inet_hash_free(hash);
+    g_free(entries);
+}
+
+void test_hash_cuckoo_same()
+{
+    GInetHash *hash = g_inet_hash_new_cuckoo(test_hash_equal);
+    test_hash_entry entries[100];
+    guint found = 0;
+    guint i;
+
+    /* More entries with one hash than its buckets and the stash hold are
+     * chained, rather than growing the array without end */
+    for (i = 0; i < 100; i++) {
+        entries[i].key = i + 1;
+        g_inet_hash_insert(hash, &entries[i].node, 42);
+    }
+    g_assert_cmpuint(g_inet_hash_size(hash), ==, 100);
+    g_assert_nonnull(hash->overflow);
+    g_assert_cmpuint(hash->count, <, 1 << 12);
+    for (i = 0; i < 100; i++)
+        g_assert_true(g_inet_hash_lookup(hash, 42, GUINT_TO_POINTER(i + 1)) ==
+                      &entries[i].node);
+    g_assert_null(g_inet_hash_lookup(hash, 42, GUINT_TO_POINTER(0)));
+    g_inet_hash_foreach(hash, test_hash_count, &found);
+    g_assert_cmpuint(found, ==, 100);
+
+    /* Rebuilding keeps them, and removing makes room for chained ones */
+    g_inet_hash_compact(hash, TRUE);
+    for (i = 0; i < 100; i += 2)
+        g_assert_true(g_inet_hash_remove(hash, &entries[i].node));
+    g_assert_false(g_inet_hash_remove(hash, &entries[0].node));
+    for (i = 1; i < 100; i += 2)
+        g_assert_true(g_inet_hash_lookup(hash, 42, GUINT_TO_POINTER(i + 1)) ==
+                      &entries[i].node);
+    g_inet_hash_remove_all(hash, test_hash_count, &found);
+    g_assert_cmpuint(found, ==, 150);
+    g_assert_null(hash->overflow);
+    g_inet_hash_free(hash);
+}
+
+static guint make_flow_pkt(guint8 * buffer, guint i)
+{
+    TEST_SPORT = 1024 + i;
+    return make_pkt(buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_UDP);
+}
+
+void test_flow_table_new_full()
+{
+    GInetFlowTable *table;
+    GInetFlow *flow;
+    guint64 capacity, max, memory_max;
+    guint64 now = 1000000;
+    guint buckets;
+    guint len;
+    guint i;
+
+    setup_test();
+    table = g_inet_flow_table_new_full(5000, 6000, 64 << 20, 16, G_INET_FLOW_TABLE_DEFAULT);
+    g_assert_nonnull(table);
+    g_object_get(table, "capacity", &capacity, "max", &max, "memory-max", &memory_max, NULL);
+    g_assert_cmpuint(capacity, ==, 5000);
+    g_assert_cmpuint(max, ==, 6000);
+    g_assert_cmpuint(memory_max, ==, 64 << 20);
+    g_assert_cmpuint(table->frag_info_list->max_pending, ==, 16);
+    g_assert_cmpuint(table->frag_info_list->max_depth, ==, 16);
+    /* Buckets for the capacity exist before any flow */
+    g_assert_cmpuint(table->flows->mask + 1, >=, 5000);
+    for (i = 0; i < 5000; i++) {
+        len = make_flow_pkt(test_buffer, i);
+        g_assert_nonnull(g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE,
+                                              FALSE, NULL, NULL));
+    }
+    g_assert_cmpuint(table->flows->mask + 1, ==, 8192);
+    g_assert_null(table->flows->old);
+    g_inet_flow_table_compact(table);
+    g_assert_cmpuint(table->flows->mask + 1, ==, 8192);
+    g_object_unref(table);
+
+    /* Grows past a small capacity then shrinks after a minute of low use */
+    table = g_inet_flow_table_new_full(100, 0, 0, 0, G_INET_FLOW_TABLE_DEFAULT);
+    for (i = 0; i < 5000; i++) {
+        len = make_flow_pkt(test_buffer, i);
+        g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE, FALSE, NULL, NULL);
+    }
+    buckets = table->flows->mask + 1;
+    g_assert_cmpuint(buckets, >=, 4096);
+    now += (G_INET_FLOW_DEFAULT_NEW_TIMEOUT + 1) * 1000000;
+    while ((flow = g_inet_flow_expire(table, now)) != NULL)
+        g_object_unref(flow);
+    g_assert_cmpuint(g_inet_hash_size(table->flows), ==, 0);
+    g_assert_cmpuint(table->flows->mask + 1, ==, buckets);
+    now += G_INET_FLOW_DEFAULT_COMPACT_DELAY * 1000000;
+    g_assert_null(g_inet_flow_expire(table, now));
+    g_assert_cmpuint(table->flows->mask + 1, ==, 128);
+    g_object_unref(table);
+
+    /* Unless asked not to, when it only shrinks on request */
+    table = g_inet_flow_table_new_full(0, 0, 0, 0, G_INET_FLOW_TABLE_NO_COMPACT);
+    for (i = 0; i < 1000; i++) {
+        len = make_flow_pkt(test_buffer, i);
+        g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE, FALSE, NULL, NULL);
+    }
+    buckets = table->flows->mask + 1;
+    g_assert_cmpuint(buckets, >=, 1024);
+    now += (G_INET_FLOW_DEFAULT_NEW_TIMEOUT + 1) * 1000000;
+    while ((flow = g_inet_flow_expire(table, now)) != NULL)
+        g_object_unref(flow);
+    g_inet_flow_expire(table, now + (G_INET_FLOW_DEFAULT_COMPACT_DELAY + 1) * 1000000);
+    g_assert_cmpuint(table->flows->mask + 1, ==, buckets);
+    g_inet_flow_table_compact(table);
+    g_assert_cmpuint(table->flows->mask + 1, ==, G_INET_HASH_MIN_BUCKETS);
+    g_object_unref(table);
+    TEST_SPORT = _TEST_SPORT;
+}
+
+void test_flow_table_hugepages()
+{
+    GInetFlowTable *table;
+    GInetFlowTableMemory memory;
+    GInetFlow *flow;
+    guint len;
+    guint i;
+
+    setup_test();
+    /* 2MB of buckets is mapped, on huge pages where the system has them */
+    table = g_inet_flow_table_new_full(1 << 18, 0, 0, 0, G_INET_FLOW_TABLE_HUGEPAGES);
+    g_assert_nonnull(table);
+    g_assert_true(table->flows->hugepages);
+    g_assert_cmpuint(table->flows->mask + 1, ==, 1 << 18);
+    for (i = 0; i < 5000; i++) {
+        len = make_flow_pkt(test_buffer, i);
+        g_assert_nonnull(g_inet_flow_get_full(table, test_buffer, len, 0, 0, TRUE, TRUE,
+                                              FALSE, NULL, NULL));
+    }
+    /* Moving between two mapped arrays keeps every flow */
+    g_inet_hash_reserve(table->flows, 1 << 19);
+    for (i = 0; i < 5000; i++) {
+        len = make_flow_pkt(test_buffer, i);
+        flow = g_inet_flow_get_full(table, test_buffer, len, 0, 0, FALSE, TRUE, FALSE,
+                                    NULL, NULL);
+        g_assert_nonnull(flow);
+        g_object_unref(flow);
+    }
+    g_assert_cmpuint(g_inet_hash_size(table->flows), ==, 0);
+    g_inet_flow_table_memory_get(table, &memory);
+    g_assert_true(memory.hugepages == 0 || memory.hugepages == memory.hash);
+    g_object_unref(table);
+    TEST_SPORT = _TEST_SPORT;
+}
+
+void test_flow_table_numa()
+{
+    GInetFlowTable *table;
+    GInetFlow *flow;
+    gint node;
+    guint len;
+    guint i;
+
+    setup_test();
+    table = g_inet_flow_table_new();
+    g_object_get(table, "numa-node", &node, NULL);
+    g_assert_cmpint(node, ==, G_INET_FLOW_NUMA_ANY);
+    /* Small buckets stay on the heap so there is nothing to bind yet */
+    if (g_inet_flow_table_numa_node_set(table, G_INET_FLOW_NUMA_LOCAL)) {
+        g_object_get(table, "numa-node", &node, NULL);
+        g_assert_cmpint(node, ==, g_inet_hash_node_current());
+    }
+    g_object_unref(table);
+
+    /* Node 200 does not exist, even while the buckets are too small to map */
+    table = g_inet_flow_table_new();
+    g_assert_false(g_inet_flow_table_numa_node_set(table, 200));
+    g_object_get(table, "numa-node", &node, NULL);
+    g_assert_cmpint(node, ==, G_INET_FLOW_NUMA_ANY);
+    g_object_unref(table);
+
+    /* So the hash keeps its default placement */
+    table = g_inet_flow_table_new_full(1 << 18, 0, 0, 0, G_INET_FLOW_TABLE_DEFAULT);
+    g_assert_false(table->flows->buckets_flags & G_INET_HASH_MAPPED);
+    g_assert_false(g_inet_flow_table_numa_node_set(table, 200));
+    g_assert_false(table->flows->buckets_flags & G_INET_HASH_MAPPED);
+    g_assert_false(table->flows->buckets_flags & G_INET_HASH_BOUND);
+    for (i = 0; i < 5000; i++) {
+        len = make_flow_pkt(test_buffer, i);
+        g_assert_nonnull(g_inet_flow_get_full(table, test_buffer, len, 0, 0, TRUE, TRUE,
+                                              FALSE, NULL, NULL));
+    }
+    /* Moving the hash keeps its flows whether or not node 0 can be bound */
+    if (g_inet_flow_table_numa_node_set(table, 0)) {
+        g_object_get(table, "numa-node", &node, NULL);
+        g_assert_cmpint(node, ==, 0);
+        g_assert_true(table->flows->buckets_flags & G_INET_HASH_BOUND);
+    } else {
+        g_object_get(table, "numa-node", &node, NULL);
+        g_assert_cmpint(node, ==, G_INET_FLOW_NUMA_ANY);
+    }
+    g_inet_hash_reserve(table->flows, 1 << 19);
+    g_assert_true(g_inet_flow_table_numa_node_set(table, G_INET_FLOW_NUMA_ANY));
+    for (i = 0; i < 5000; i++) {
+        len = make_flow_pkt(test_buffer, i);
+        flow = g_inet_flow_get_full(table, test_buffer, len, 0, 0, FALSE, TRUE, FALSE,
+                                    NULL, NULL);
+        g_assert_nonnull(flow);
+        g_object_unref(flow);
+    }
+    g_assert_cmpuint(g_inet_hash_size(table->flows), ==, 0);
+    g_object_unref(table);
+    TEST_SPORT = _TEST_SPORT;
+}
+
+void test_flow_table_latency()
+{
+    GInetFlowTable *table = g_inet_flow_table_new();
+    GInetFlowLatency latency;
+    GInetFlow *flow;
+    int i;
+
+    setup_test();
+    g_assert_nonnull(table);
+    g_assert(!g_inet_flow_table_latency_get(table, G_INET_FLOW_STAGE_PARSE, &latency));
+
+    g_inet_flow_table_latency_set(table, 2);
+    guint len = make_pkt(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_UDP);
+    for (i = 0; i < 10; i++) {
+        g_assert_nonnull((flow =
+                            g_inet_flow_get_full(table, test_buffer, len, 0, 0, TRUE, TRUE,
+                                                 FALSE, NULL, NULL)));
+    }
+
+    /* Every second packet is timed - the first sample is a hit */
+    g_assert(g_inet_flow_table_latency_get(table, G_INET_FLOW_STAGE_PARSE, &latency));
+    g_assert_cmpuint(latency.samples, ==, 5);
+    g_assert_cmpuint(latency.p50, <=, latency.p99);
+    g_assert_cmpuint(latency.p99, <=, latency.p999);
+    g_assert_cmpuint(latency.p999, <=, latency.max);
+    g_assert(g_inet_flow_table_latency_get(table, G_INET_FLOW_STAGE_LOOKUP, &latency));
+    g_assert_cmpuint(latency.samples, ==, 5);
+    g_assert(g_inet_flow_table_latency_get(table, G_INET_FLOW_STAGE_EXPIRY, &latency));
+    g_assert_cmpuint(latency.samples, ==, 5);
+    g_assert(g_inet_flow_table_latency_get(table, G_INET_FLOW_STAGE_CREATE, &latency));
+    g_assert_cmpuint(latency.samples, ==, 0);
+    g_assert(!g_inet_flow_table_latency_get(table, G_INET_FLOW_STAGE_COUNT, &latency));
+
+    g_inet_flow_table_latency_set(table, 0);
+    g_assert(!g_inet_flow_table_latency_get(table, G_INET_FLOW_STAGE_LOOKUP, &latency));
+
+    g_object_unref(flow);
+    g_object_unref(table);
+}
+
+void test_flow_table_memory()
+{
+    GInetFlowTable *table = g_inet_flow_table_new();
+    GInetFlowTableMemory before, after;
+    GInetFlow *flow;
+    guint64 memory, memory_max;
+    guint len;
+
+    setup_test();
+    g_assert_nonnull(table);
+    g_inet_flow_table_memory_get(table, &before);
+    g_assert_cmpuint(before.flows, ==, 0);
+    g_assert_cmpuint(before.total, ==,
+                     before.flows + before.hash + before.expiry + before.fragments +
+                     before.other);
+
+    len = make_pkt(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_UDP);
+    g_assert_nonnull((flow = g_inet_flow_get_full(table, test_buffer, len, 0, 0, TRUE, TRUE,
+                                                  FALSE, NULL, NULL)));
+    g_inet_flow_table_memory_get(table, &after);
+    g_assert_cmpuint(after.flows, ==, sizeof(GInetFlow));
+    g_object_get(table, "memory", &memory, NULL);
+    g_assert_cmpuint(memory, ==, after.total);
+
+    /* Budget only fits the flow already in the table */
+    g_inet_flow_table_memory_max_set(table, after.total);
+    g_object_get(table, "memory-max", &memory_max, NULL);
+    g_assert_cmpuint(memory_max, ==, after.total);
+    len = make_pkt(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_TCP);
+    g_assert_null(g_inet_flow_get_full(table, test_buffer, len, 0, 0, TRUE, TRUE,
+                                       FALSE, NULL, NULL));
+    g_assert_null(g_inet_flow_create(table, test_tuple, 0));
+
+    g_inet_flow_table_memory_max_set(table, after.total + sizeof(GInetFlow));
+    g_assert_nonnull(g_inet_flow_get_full(table, test_buffer, len, 0, 0, TRUE, TRUE,
+                                          FALSE, NULL, NULL));
+
+    g_object_unref(flow);
+    g_object_unref(table);
+}
+
 void test_flow_not_expired()
 {
     guint64 now = get_time_us();
@@ -1924,26 +2702,743 @@ void test_flow_tcp_state_fin_timeout()
     g_object_unref(table);
 }
 
-void test_flow_ipv4_encap()
+void test_filter_flood()
 {
-    GInetFlowTable *table;
+    GInetFilter *filter = g_inet_filter_new(1 << 16, 2, 30 * 1000000);
+    guint64 now = 1000000;
+    guint admitted = 0;
+    guint32 hash;
+    guint i;
+
+    /* A scan of single packet tuples at 1us spacing, ten times the cells */
+    for (i = 0; i < 10 << 16; i++, now++) {
+        hash = (i + 1) * 0x9E3779B1U;
+        hash = (hash ^ (hash >> 16)) * 0x85EBCA6BU;
+        hash ^= hash >> 13;
+        if (g_inet_filter_admit(filter, hash, FALSE, now) && i >= 5 << 16)
+            admitted++;
+    }
+    g_assert_cmpuint(admitted, <, (5 << 16) / 4);
+
+    /* A real second packet soon after the first still gets through */
+    g_assert_false(g_inet_filter_admit(filter, 0x12345678, FALSE, now));
+    g_assert_true(g_inet_filter_admit(filter, 0x12345678, FALSE, now + 1));
+    g_inet_filter_free(filter);
+}
+
+void test_flow_table_admission()
+{
+    GInetFlowTable *table = g_inet_flow_table_new();
+    GInetFlowTableStats stats;
+    GInetFlowTableMemory memory;
+    guint64 now = 1000000;
+    guint64 other;
+    guint64 size;
     GInetFlow *flow;
+    guint8 *p;
+    guint len;
+    guint i;
 
     setup_test();
-    g_assert_nonnull((table = g_inet_flow_table_new()));
+    g_inet_flow_table_memory_get(table, &memory);
+    other = memory.other;
+    g_inet_flow_table_admission_set(table, 2, 0);
+    g_inet_flow_table_memory_get(table, &memory);
+    g_assert_cmpuint(memory.other, >=, other + 2 * G_INET_FLOW_DEFAULT_ADMISSION_CELLS);
+
+    /* A scan only adds to the filter */
+    for (i = 0; i < 1000; i++) {
+        len = make_flow_pkt(test_buffer, i);
+        g_assert_null(g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE, FALSE,
+                                           NULL, NULL));
+    }
+    g_object_get(table, "size", &size, NULL);
+    g_assert_cmpuint(size, ==, 0);
+    g_inet_flow_table_stats_get(table, &stats);
+    g_assert_cmpuint(stats.unadmitted, ==, 1000);
+    g_assert_cmpuint(stats.created, ==, 0);
 
-    guint8 *p = build_hdr_ip(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_TCP, FALSE);
-    p = build_hdr_after_ip(p, IP_PROTOCOL_TCP, FALSE);
-    guint len = (guint) (p - test_buffer);
+    /* Second packet of a tuple gets a flow */
+    len = make_flow_pkt(test_buffer, 0);
+    flow = g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE, FALSE, NULL, NULL);
+    g_assert_nonnull(flow);
+    g_object_unref(flow);
 
-    g_assert_nonnull((flow =
-                        g_inet_flow_get_full(table, test_buffer, len, 0, 0, TRUE, FALSE,
-                                             FALSE, NULL, NULL)));
+    /* Unless the first was forgotten */
+    len = make_flow_pkt(test_buffer, 1);
+    now += 2 * G_INET_FLOW_DEFAULT_NEW_TIMEOUT * 1000000;
+    g_assert_null(g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE, FALSE,
+                                       NULL, NULL));
+    TEST_SPORT = _TEST_SPORT;
+
+    /* A reply is admitted before the packet count is reached */
+    g_inet_flow_table_admission_set(table, 10, 1024);
+    p = build_pkt_tcp(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_TCP, FALSE,
+                      TEST_SPORT, TEST_DPORT, SYN);
+    g_assert_null(g_inet_flow_get_full(table, test_buffer, (guint) (p - test_buffer), 0, now,
+                                       TRUE, TRUE, FALSE, NULL, NULL));
+    g_assert_null(g_inet_flow_get_full(table, test_buffer, (guint) (p - test_buffer), 0, now,
+                                       TRUE, TRUE, FALSE, NULL, NULL));
+    p = build_pkt_tcp(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_TCP, TRUE,
+                      TEST_DPORT, TEST_SPORT, SYN_ACK);
+    flow = g_inet_flow_get_full(table, test_buffer, (guint) (p - test_buffer), 0, now, TRUE,
+                                TRUE, FALSE, NULL, NULL);
+    g_assert_nonnull(flow);
+    g_object_unref(flow);
+
+    /* Off again */
+    g_inet_flow_table_admission_set(table, 0, 0);
+    g_inet_flow_table_memory_get(table, &memory);
+    g_assert_cmpuint(memory.other, <, other + G_INET_FLOW_DEFAULT_ADMISSION_CELLS);
+    len = make_flow_pkt(test_buffer, 2000);
+    flow = g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE, FALSE, NULL, NULL);
+    g_assert_nonnull(flow);
     g_object_unref(flow);
     g_object_unref(table);
+    TEST_SPORT = _TEST_SPORT;
 }
 
-void test_flow_ipv6_encap()
+static GInetFlow *tcp_state_pkt(GInetFlowTable * table, gboolean reverse, guint16 sport,
+                                guint16 dport, guint16 flags, guint64 ts,
+                                GInetFlowTcpState expect)
+{
+    GInetFlow *flow;
+    guint tcp_state;
+    guint8 *p = build_pkt_tcp(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_TCP, reverse,
+                              sport, dport, flags);
+
+    flow = g_inet_flow_get_full(table, test_buffer, (guint) (p - test_buffer), 0, ts, TRUE,
+                                TRUE, FALSE, NULL, NULL);
+    g_assert_nonnull(flow);
+    g_object_get(flow, "tcp-state", &tcp_state, NULL);
+    g_assert_cmpuint(tcp_state, ==, expect);
+    return flow;
+}
+
+void test_flow_tcp_state_teardown()
+{
+    guint64 now = 1000000;
+    GInetFlowTable *table;
+    GInetFlow *flow;
+    guint64 lifetime;
+    guint state;
+    guint64 size;
+
+    setup_test();
+    table = g_inet_flow_table_new();
+    tcp_state_pkt(table, FALSE, TEST_SPORT, TEST_DPORT, SYN, now, FLOW_TCP_SYN_SENT);
+    tcp_state_pkt(table, TRUE, TEST_DPORT, TEST_SPORT, SYN_ACK, now, FLOW_TCP_SYN_RECV);
+    flow = tcp_state_pkt(table, FALSE, TEST_SPORT, TEST_DPORT, ACK, now, FLOW_TCP_ESTABLISHED);
+    g_object_get(flow, "state", &state, "lifetime", &lifetime, NULL);
+    g_assert_cmpuint(state, ==, FLOW_OPEN);
+    g_assert_cmpuint(lifetime, ==, G_INET_FLOW_DEFAULT_OPEN_TIMEOUT);
+    /* Retransmitted handshake packets do not reopen the connection */
+    tcp_state_pkt(table, FALSE, TEST_SPORT, TEST_DPORT, SYN, now, FLOW_TCP_ESTABLISHED);
+    tcp_state_pkt(table, TRUE, TEST_DPORT, TEST_SPORT, SYN_ACK, now, FLOW_TCP_ESTABLISHED);
+
+    /* The client closes and the server keeps sending */
+    tcp_state_pkt(table, FALSE, TEST_SPORT, TEST_DPORT, FIN_ACK, now, FLOW_TCP_FIN_WAIT);
+    flow = tcp_state_pkt(table, TRUE, TEST_DPORT, TEST_SPORT, ACK, now, FLOW_TCP_CLOSE_WAIT);
+    g_object_get(flow, "state", &state, "lifetime", &lifetime, NULL);
+    g_assert_cmpuint(state, ==, FLOW_OPEN);
+    g_assert_cmpuint(lifetime, ==, G_INET_FLOW_DEFAULT_HALF_CLOSED_TIMEOUT);
+    tcp_state_pkt(table, TRUE, TEST_DPORT, TEST_SPORT, ACK, now, FLOW_TCP_CLOSE_WAIT);
+
+    /* Then closes too */
+    flow = tcp_state_pkt(table, TRUE, TEST_DPORT, TEST_SPORT, FIN_ACK, now, FLOW_TCP_LAST_ACK);
+    g_object_get(flow, "state", &state, NULL);
+    g_assert_cmpuint(state, ==, FLOW_CLOSED);
+    flow = tcp_state_pkt(table, FALSE, TEST_SPORT, TEST_DPORT, ACK, now, FLOW_TCP_TIME_WAIT);
+    g_object_get(flow, "lifetime", &lifetime, NULL);
+    g_assert_cmpuint(lifetime, ==, G_INET_FLOW_DEFAULT_TIME_WAIT_TIMEOUT);
+
+    /* A new SYN on the same ports starts again */
+    tcp_state_pkt(table, FALSE, TEST_SPORT, TEST_DPORT, SYN, now, FLOW_TCP_SYN_SENT);
+    tcp_state_pkt(table, FALSE, TEST_SPORT, TEST_DPORT, RST, now, FLOW_TCP_CLOSE);
+    flow = tcp_state_pkt(table, TRUE, TEST_DPORT, TEST_SPORT, ACK, now, FLOW_TCP_CLOSE);
+
+    /* Gone within seconds rather than the closed timeout */
+    g_assert_null(g_inet_flow_expire(table, now + 1000000));
+    g_assert_true(g_inet_flow_expire(table,
+                                     now + G_INET_FLOW_DEFAULT_TIME_WAIT_TIMEOUT * 1000000) ==
+                  flow);
+    g_object_unref(flow);
+    g_object_get(table, "size", &size, NULL);
+    g_assert_cmpuint(size, ==, 0);
+    g_object_unref(table);
+}
+
+void test_flow_tcp_state_midstream()
+{
+    GInetFlowTable *table;
+    GInetFlow *flow;
+    guint state;
+    gchar direction;
+
+    setup_test();
+    table = g_inet_flow_table_new();
+    /* No handshake - the lower port is taken as the server */
+    flow = tcp_state_pkt(table, FALSE, TEST_DPORT, TEST_SPORT, ACK, 1000000, FLOW_TCP_NONE);
+    g_object_get(flow, "state", &state, "direction", &direction, NULL);
+    g_assert_cmpuint(state, ==, FLOW_NEW);
+    g_assert_cmpint(direction, ==, FLOW_DIRECTION_ORIGINAL);
+    tcp_state_pkt(table, FALSE, TEST_DPORT, TEST_SPORT, ACK, 1000000, FLOW_TCP_NONE);
+    /* Established once both ends are seen */
+    flow = tcp_state_pkt(table, TRUE, TEST_SPORT, TEST_DPORT, ACK, 1000000,
+                         FLOW_TCP_ESTABLISHED);
+    g_object_get(flow, "state", &state, "direction", &direction, NULL);
+    g_assert_cmpuint(state, ==, FLOW_OPEN);
+    g_assert_cmpint(direction, ==, FLOW_DIRECTION_REPLY);
+    g_object_unref(flow);
+    g_object_unref(table);
+}
+
+void test_flow_tcp_state_same_ports()
+{
+    GInetFlowTable *table;
+    GInetFlow *flow;
+    gchar direction;
+    guint64 size;
+
+    setup_test();
+    table = g_inet_flow_table_new();
+    /* Peers on the same port are one flow and the handshake sets the server */
+    tcp_state_pkt(table, FALSE, TEST_SPORT, TEST_SPORT, SYN, 1000000, FLOW_TCP_SYN_SENT);
+    flow = tcp_state_pkt(table, TRUE, TEST_SPORT, TEST_SPORT, SYN_ACK, 1000000,
+                         FLOW_TCP_SYN_RECV);
+    g_object_get(flow, "direction", &direction, NULL);
+    g_assert_cmpint(direction, ==, FLOW_DIRECTION_REPLY);
+    flow = tcp_state_pkt(table, FALSE, TEST_SPORT, TEST_SPORT, ACK, 1000000,
+                         FLOW_TCP_ESTABLISHED);
+    g_object_get(flow, "direction", &direction, NULL);
+    g_assert_cmpint(direction, ==, FLOW_DIRECTION_ORIGINAL);
+    g_object_get(table, "size", &size, NULL);
+    g_assert_cmpuint(size, ==, 1);
+    g_object_unref(table);
+}
+
+void test_flow_table_state_max()
+{
+    GInetFlowTable *table = g_inet_flow_table_new();
+    GInetFlowTableStats stats;
+    GInetTuple tuple;
+    guint64 now = 1000000;
+    GInetFlow *flow;
+    guint state;
+    guint len;
+    guint i;
+
+    setup_test();
+    test_probe_reset();
+    g_inet_flow_table_state_max_set(table, FLOW_NEW, 100);
+    g_inet_flow_table_state_max_set(table, FLOW_OPEN, 1);
+    tcp_state_pkt(table, FALSE, TEST_SPORT, TEST_DPORT, SYN, now, FLOW_TCP_SYN_SENT);
+    tcp_state_pkt(table, TRUE, TEST_DPORT, TEST_SPORT, SYN_ACK, now, FLOW_TCP_SYN_RECV);
+
+    /* A flood of new flows recycles the oldest new ones, not the open one */
+    for (i = 0; i < 1000; i++) {
+        len = make_flow_pkt(test_buffer, i);
+        g_assert_nonnull(g_inet_flow_get_full(table, test_buffer, len, 0, now + i, TRUE, TRUE,
+                                              FALSE, NULL, NULL));
+    }
+    g_inet_flow_table_stats_get(table, &stats);
+    g_assert_cmpuint(stats.size, ==, 101);
+    g_assert_cmpuint(stats.states[FLOW_NEW], ==, 100);
+    g_assert_cmpuint(stats.states[FLOW_OPEN], ==, 1);
+    g_assert_cmpuint(stats.recycled[FLOW_NEW], ==, 900);
+    g_assert_cmpuint(stats.create_failed, ==, 0);
+    g_assert_cmpuint(test_probe_hits("flow__recycle"), ==, 900);
+    /* The survivors are the most recent */
+    len = make_flow_pkt(test_buffer, 999);
+    g_assert_nonnull(g_inet_flow_parse(test_buffer, len, NULL, &tuple, FALSE));
+    g_assert_nonnull(g_inet_flow_lookup(table, &tuple));
+    len = make_flow_pkt(test_buffer, 0);
+    g_assert_nonnull(g_inet_flow_parse(test_buffer, len, NULL, &tuple, FALSE));
+    g_assert_null(g_inet_flow_lookup(table, &tuple));
+    TEST_SPORT = _TEST_SPORT;
+
+    /* Recycled flows are handed back by expiry, before they time out */
+    for (i = 0; (flow = g_inet_flow_expire(table, now + 1000)) != NULL; i++) {
+        g_assert_true(flow->recycled);
+        g_object_unref(flow);
+    }
+    g_assert_cmpuint(i, ==, 900);
+    g_inet_flow_table_stats_get(table, &stats);
+    g_assert_cmpuint(stats.size, ==, 101);
+    g_assert_cmpuint(stats.expired[FLOW_NEW], ==, 0);
+
+    /* Another connection opening does not push out the first */
+    tcp_state_pkt(table, FALSE, TEST_DPORT, TEST_SPORT, SYN, now + 2000, FLOW_TCP_SYN_SENT);
+    flow = tcp_state_pkt(table, TRUE, TEST_SPORT, TEST_DPORT, SYN_ACK, now + 2000,
+                         FLOW_TCP_SYN_RECV);
+    g_object_get(flow, "state", &state, NULL);
+    g_assert_cmpuint(state, ==, FLOW_NEW);
+    g_inet_flow_table_stats_get(table, &stats);
+    g_assert_cmpuint(stats.states[FLOW_OPEN], ==, 1);
+    g_assert_cmpuint(stats.recycled[FLOW_OPEN], ==, 0);
+    g_assert_cmpuint(stats.refused[FLOW_OPEN], ==, 1);
+    g_assert_cmpuint(stats.size, ==, 101);
+    /* The new flow that made room is left for the table to free */
+    g_assert_cmpuint(stats.recycled[FLOW_NEW], ==, 901);
+    g_object_unref(table);
+}
+
+void test_flow_table_state_max_again()
+{
+    GInetFlowTable *table = g_inet_flow_table_new();
+    GInetFlowTableStats stats;
+    guint64 now = 1000000;
+    GInetFlow *flow;
+    guint64 lifetime;
+
+    setup_test();
+    test_probe_reset();
+    g_inet_flow_table_state_max_set(table, FLOW_OPEN, 1);
+    g_inet_flow_table_state_max_set(table, FLOW_CLOSED, 1);
+    flow = tcp_state_pkt(table, FALSE, TEST_SPORT, TEST_DPORT, SYN, now, FLOW_TCP_SYN_SENT);
+    g_inet_flow_establish(table, flow);
+    g_assert_cmpuint(test_probe_hits("flow__state"), ==, 1);
+
+    /* Establishing or closing again is not a change of state, so neither
+     * counts nor is refused at a full quota */
+    g_inet_flow_establish(table, flow);
+    g_object_get(flow, "lifetime", &lifetime, NULL);
+    g_assert_cmpuint(lifetime, ==, G_INET_FLOW_DEFAULT_OPEN_TIMEOUT);
+    g_inet_flow_close(table, flow);
+    g_inet_flow_close(table, flow);
+    g_inet_flow_table_stats_get(table, &stats);
+    g_assert_cmpuint(stats.states[FLOW_NEW], ==, 0);
+    g_assert_cmpuint(stats.states[FLOW_OPEN], ==, 0);
+    g_assert_cmpuint(stats.states[FLOW_CLOSED], ==, 1);
+    g_assert_cmpuint(stats.refused[FLOW_OPEN], ==, 0);
+    g_assert_cmpuint(stats.refused[FLOW_CLOSED], ==, 0);
+    g_assert_cmpuint(test_probe_hits("flow__state"), ==, 2);
+    g_object_unref(table);
+}
+
+void test_flow_table_state_max_reopen()
+{
+    GInetFlowTable *table = g_inet_flow_table_new();
+    GInetFlowTableStats stats;
+    guint64 now = 1000000;
+    GInetFlow *flow, *other;
+    guint state;
+
+    setup_test();
+    g_inet_flow_table_state_max_set(table, FLOW_NEW, 1);
+    flow = tcp_state_pkt(table, FALSE, TEST_SPORT, TEST_DPORT, SYN, now, FLOW_TCP_SYN_SENT);
+    tcp_state_pkt(table, TRUE, TEST_DPORT, TEST_SPORT, SYN_ACK, now, FLOW_TCP_SYN_RECV);
+    tcp_state_pkt(table, FALSE, TEST_SPORT, TEST_DPORT, ACK, now, FLOW_TCP_ESTABLISHED);
+    tcp_state_pkt(table, FALSE, TEST_SPORT + 1, TEST_DPORT, SYN, now, FLOW_TCP_SYN_SENT);
+
+    /* The only other new flow already belongs to the expiry caller */
+    now += (G_INET_FLOW_DEFAULT_NEW_TIMEOUT + 1) * 1000000;
+    other = g_inet_flow_expire(table, now);
+    g_assert_nonnull(other);
+    g_assert_true(other != flow);
+
+    /* So reopening the connection cannot take a place in NEW */
+    tcp_state_pkt(table, FALSE, TEST_SPORT, TEST_DPORT, RST, now, FLOW_TCP_CLOSE);
+    tcp_state_pkt(table, FALSE, TEST_SPORT, TEST_DPORT, SYN, now, FLOW_TCP_SYN_SENT);
+    g_object_get(flow, "state", &state, NULL);
+    g_assert_cmpuint(state, ==, FLOW_CLOSED);
+    g_inet_flow_table_stats_get(table, &stats);
+    g_assert_cmpuint(stats.states[FLOW_NEW], ==, 1);
+    g_assert_cmpuint(stats.states[FLOW_CLOSED], ==, 1);
+    g_assert_cmpuint(stats.refused[FLOW_NEW], ==, 1);
+
+    /* Once the other has gone there is room again */
+    g_object_unref(other);
+    tcp_state_pkt(table, FALSE, TEST_SPORT, TEST_DPORT, RST, now, FLOW_TCP_CLOSE);
+    tcp_state_pkt(table, FALSE, TEST_SPORT, TEST_DPORT, SYN, now, FLOW_TCP_SYN_SENT);
+    g_object_get(flow, "state", &state, NULL);
+    g_assert_cmpuint(state, ==, FLOW_NEW);
+    g_inet_flow_table_stats_get(table, &stats);
+    g_assert_cmpuint(stats.states[FLOW_NEW], ==, 1);
+    g_assert_cmpuint(stats.states[FLOW_CLOSED], ==, 0);
+    g_object_unref(table);
+}
+
+void test_limit_subnet()
+{
+    GInetLimit *limit = g_inet_limit_new(1024, 1, 1);
+    struct sockaddr_storage address = { 0 };
+    gboolean throttled;
+    guint refused = 0;
+    guint i;
+
+    /* Sources sharing their first octets still spread over the sets, so
+     * each keeps its empty bucket rather than being evicted for a full one */
+    address.ss_family = AF_INET;
+    for (i = 0; i < 256; i++) {
+        ((struct sockaddr_in *) &address)->sin_addr.s_addr = htonl(0x0A000000 + i * 97);
+        g_assert_true(g_inet_limit_take(limit, flow_hash_address(0, &address), 1000000,
+                                        &throttled));
+    }
+    for (i = 0; i < 256; i++) {
+        ((struct sockaddr_in *) &address)->sin_addr.s_addr = htonl(0x0A000000 + i * 97);
+        if (!g_inet_limit_take(limit, flow_hash_address(0, &address), 1000001, &throttled))
+            refused++;
+    }
+    g_assert_cmpuint(refused, >=, 240);
+    g_inet_limit_free(limit);
+}
+
+void test_flow_table_source_limit()
+{
+    GInetFlowTable *table = g_inet_flow_table_new();
+    GInetFlowTableStats stats;
+    guint64 now = 1000000;
+    GInetFlow *flow;
+    guint created = 0;
+    guint8 *p;
+    guint len;
+    guint i;
+
+    setup_test();
+    g_inet_flow_table_source_limit_set(table, 10, 5, 0);
+
+    /* One source scanning gets its burst */
+    for (i = 0; i < 100; i++) {
+        len = make_flow_pkt(test_buffer, i);
+        if (g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE, FALSE, NULL,
+                                 NULL))
+            created++;
+    }
+    g_assert_cmpuint(created, ==, 5);
+    g_inet_flow_table_stats_get(table, &stats);
+    g_assert_cmpuint(stats.throttled, ==, 95);
+    g_assert_cmpuint(stats.throttled_sources, ==, 1);
+
+    /* Existing flows are not limited */
+    len = make_flow_pkt(test_buffer, 0);
+    g_assert_nonnull(g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE, FALSE,
+                                          NULL, NULL));
+
+    /* Nor is another source */
+    p = build_pkt_tcp(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_TCP, TRUE,
+                      TEST_DPORT, 80, SYN);
+    flow = g_inet_flow_get_full(table, test_buffer, (guint) (p - test_buffer), 0, now, TRUE,
+                                TRUE, FALSE, NULL, NULL);
+    g_assert_nonnull(flow);
+
+    /* Half a second refills five tokens */
+    for (created = 0, i = 100; i < 200; i++) {
+        len = make_flow_pkt(test_buffer, i);
+        if (g_inet_flow_get_full(table, test_buffer, len, 0, now + 500000, TRUE, TRUE, FALSE,
+                                 NULL, NULL))
+            created++;
+    }
+    g_assert_cmpuint(created, ==, 5);
+    g_inet_flow_table_stats_get(table, &stats);
+    g_assert_cmpuint(stats.throttled_sources, ==, 2);
+    g_assert_cmpuint(stats.size, ==, 11);
+
+    g_inet_flow_table_source_limit_set(table, 0, 0, 0);
+    len = make_flow_pkt(test_buffer, 200);
+    g_assert_nonnull(g_inet_flow_get_full(table, test_buffer, len, 0, now + 500000, TRUE, TRUE,
+                                          FALSE, NULL, NULL));
+    g_object_unref(table);
+    TEST_SPORT = _TEST_SPORT;
+}
+
+void test_flow_table_sample()
+{
+    GInetFlowTable *table = g_inet_flow_table_new();
+    GInetFlowTableStats stats;
+    guint64 now = 1000000;
+    guint64 rate;
+    GInetFlow *flow;
+    guint sampled = 0;
+    guint len;
+    guint i;
+
+    setup_test();
+    g_inet_flow_table_sample_set(table, 4);
+    g_object_get(table, "sample-rate", &rate, NULL);
+    g_assert_cmpuint(rate, ==, 4);
+    for (i = 0; i < 4000; i++) {
+        len = make_flow_pkt(test_buffer, i);
+        flow = g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE, FALSE, NULL,
+                                    NULL);
+        /* Replies are sampled with their flow */
+        len = make_pkt_reverse(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_UDP);
+        g_assert_true(g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE, FALSE,
+                                           NULL, NULL) == flow);
+        if (flow)
+            sampled++;
+    }
+    g_assert_cmpuint(sampled, >, 800);
+    g_assert_cmpuint(sampled, <, 1200);
+    g_inet_flow_table_stats_get(table, &stats);
+    g_assert_cmpuint(stats.sample_rate, ==, 4);
+    g_assert_cmpuint(stats.size, ==, sampled);
+    g_assert_cmpuint(stats.unsampled, ==, 2 * (4000 - sampled));
+
+    /* A higher rate samples a subset of the same flows */
+    g_inet_flow_table_sample_set(table, 8);
+    for (i = 0; i < 4000; i++) {
+        len = make_flow_pkt(test_buffer, i);
+        g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE, FALSE, NULL, NULL);
+    }
+    g_inet_flow_table_stats_get(table, &stats);
+    g_assert_cmpuint(stats.created, ==, sampled);
+    g_assert_cmpuint(stats.unsampled, >, 2 * (4000 - sampled) + (4000 - sampled));
+
+    g_inet_flow_table_sample_set(table, 0);
+    g_inet_flow_table_stats_get(table, &stats);
+    g_assert_cmpuint(stats.sample_rate, ==, 1);
+    for (i = 0; i < 4000; i++) {
+        len = make_flow_pkt(test_buffer, i);
+        g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE, FALSE, NULL, NULL);
+    }
+    g_inet_flow_table_stats_get(table, &stats);
+    g_assert_cmpuint(stats.size, ==, 4000);
+    g_object_unref(table);
+    TEST_SPORT = _TEST_SPORT;
+}
+
+void test_flow_table_top()
+{
+    GInetFlowTable *table = g_inet_flow_table_new();
+    GInetFlowTableMemory memory;
+    GInetFlowTopHost hosts[4];
+    GInetFlowTop top[4];
+    guint64 now = 1000000;
+    guint64 other;
+    guint len = 0;
+    guint i;
+
+    setup_test();
+    g_assert_cmpuint(g_inet_flow_table_top_flows(table, top, 4), ==, 0);
+    g_inet_flow_table_memory_get(table, &memory);
+    other = memory.other;
+    g_inet_flow_table_top_set(table, 3, 1 << 12, G_INET_FLOW_TOP_PACKETS);
+    g_inet_flow_table_memory_get(table, &memory);
+    g_assert_cmpuint(memory.other, >, other + 2 * 4 * (1 << 12) * 16);
+
+    /* Two heavy flows among many single packets, one heavy both ways */
+    for (i = 0; i < 300; i++) {
+        len = make_flow_pkt(test_buffer, i);
+        g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE, FALSE, NULL, NULL);
+        len = make_flow_pkt(test_buffer, 1000 + i % 3);
+        g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE, FALSE, NULL, NULL);
+        if (i % 3 == 0) {
+            len = make_pkt_reverse(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_UDP);
+            g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE, FALSE, NULL,
+                                 NULL);
+        }
+    }
+    g_assert_cmpuint(g_inet_flow_table_top_flows(table, top, 4), ==, 3);
+    g_assert_cmpuint(g_inet_tuple_get_src_port(&top[0].tuple), ==, 1024 + 1000);
+    g_assert_cmpuint(top[0].packets, >=, 200);
+    g_assert_cmpuint(top[0].bytes, >=, 200 * len);
+    g_assert_cmpuint(top[1].packets, >=, 100);
+    g_assert_cmpuint(top[1].packets, <, 200);
+    g_assert_cmpuint(top[2].packets, >=, 100);
+    g_assert_cmpuint(top[2].packets, <, 200);
+    g_assert_cmpuint(g_inet_flow_table_top_flows(table, top, 1), ==, 1);
+    g_assert_cmpuint(g_inet_tuple_get_src_port(&top[0].tuple), ==, 1024 + 1000);
+
+    /* Sources: the client sent all but the replies */
+    g_assert_cmpuint(g_inet_flow_table_top_hosts(table, hosts, 4), ==, 2);
+    g_assert_cmpuint(hosts[0].packets, ==, 600);
+    g_assert_cmpuint(hosts[1].packets, ==, 100);
+    g_assert_true(memcmp(&hosts[1].address, &top[0].tuple.dst,
+                         sizeof(struct sockaddr_in)) == 0);
+
+    /* Lookups without update and flows sampled out are not counted */
+    g_inet_flow_table_top_set(table, 3, 0, G_INET_FLOW_TOP_PACKETS);
+    len = make_flow_pkt(test_buffer, 1000);
+    g_inet_flow_get_full(table, test_buffer, len, 0, now, FALSE, TRUE, FALSE, NULL, NULL);
+    g_assert_cmpuint(g_inet_flow_table_top_flows(table, top, 4), ==, 0);
+    g_inet_flow_table_sample_set(table, 1 << 20);
+    for (i = 0; i < 100; i++) {
+        len = make_flow_pkt(test_buffer, i);
+        g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE, FALSE, NULL, NULL);
+    }
+    g_assert_cmpuint(g_inet_flow_table_top_flows(table, top, 4), ==, 0);
+    g_inet_flow_table_sample_set(table, 1);
+
+        /* Setting it again starts afresh, and 0 turns it off */
+    g_inet_flow_table_top_set(table, 3, 0, G_INET_FLOW_TOP_BYTES);
+    g_assert_cmpuint(g_inet_flow_table_top_hosts(table, hosts, 4), ==, 0);
+    g_inet_flow_table_top_set(table, 0, 0, G_INET_FLOW_TOP_BYTES);
+    g_inet_flow_table_memory_get(table, &memory);
+    g_assert_cmpuint(memory.other, <, other + 4 * (1 << 12));
+    g_object_unref(table);
+    TEST_SPORT = _TEST_SPORT;
+}
+
+void test_sketch_heap()
+{
+    GInetSketch *sketch = g_inet_sketch_new(1 << 12, 8, sizeof(guint32),
+                                            G_INET_SKETCH_PACKETS);
+    GInetSketchEntry top[8];
+    guint32 key;
+    guint i, j;
+
+    /* Five heavy keys churned through by a stream of single packets */
+    for (i = 0; i < 5000; i++) {
+        key = i % 2 ? i % 5 : 100 + i;
+        g_inet_sketch_add(sketch, key, &key, 1, 0);
+        for (j = 0; j < sketch->size; j++) {
+            g_assert_cmpuint(sketch->where[sketch->heap[j].slot], ==, j);
+            g_assert_cmpuint(sketch->index[sketch_find(sketch, sketch->heap[j].hash)], ==,
+                             sketch->heap[j].slot + 1);
+            if (j)
+                g_assert_cmpuint(sketch->heap[(j - 1) / 2].count[0], <=,
+                                 sketch->heap[j].count[0]);
+        }
+    }
+    g_assert_cmpuint(g_inet_sketch_top(sketch, top), ==, 8);
+    for (i = 0; i < 5; i++) {
+        key = *(guint32 *) g_inet_sketch_key(sketch, &top[i]);
+        g_assert_cmpuint(key, <, 5);
+        g_assert_cmpuint(top[i].hash, ==, key);
+        g_assert_cmpuint(top[i].count[0], >=, 500);
+    }
+    g_inet_sketch_free(sketch);
+}
+
+void test_flow_lookup_rekey()
+{
+    GInetFlowTable *table = g_inet_flow_table_new();
+    GInetTuple tuple, other;
+    GInetFlow *flow;
+    guint len;
+
+    setup_test();
+    len = make_flow_pkt(test_buffer, 2);
+    g_assert_nonnull(g_inet_flow_parse(test_buffer, len, NULL, &other, FALSE));
+    len = make_flow_pkt(test_buffer, 1);
+    g_assert_nonnull(g_inet_flow_parse(test_buffer, len, NULL, &tuple, FALSE));
+
+    /* A tuple changed after parsing is keyed afresh, not by its old key */
+    ((struct sockaddr_in *) &tuple.src)->sin_port =
+        ((struct sockaddr_in *) &other.src)->sin_port;
+    flow = g_inet_flow_create(table, &tuple, 0);
+    g_assert_nonnull(flow);
+    g_assert_true(g_inet_flow_lookup(table, &other) == flow);
+    g_assert_null(g_inet_flow_lookup(table, g_inet_flow_parse(test_buffer, len, NULL, &tuple,
+                                                              FALSE)));
+    ((struct sockaddr_in *) &tuple.src)->sin_port =
+        ((struct sockaddr_in *) &other.src)->sin_port;
+    g_assert_true(g_inet_flow_lookup(table, &tuple) == flow);
+    g_object_unref(table);
+}
+
+void test_flow_table_cache()
+{
+    GInetFlowTable *table = g_inet_flow_table_new();
+    GInetFlowTableStats stats;
+    guint64 now = 1000000;
+    GInetFlow *flow, *other;
+    guint len;
+    guint i;
+
+    setup_test();
+    len = make_flow_pkt(test_buffer, 1);
+    flow = g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE, FALSE, NULL, NULL);
+    for (i = 0; i < 9; i++) {
+        g_assert_true(g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE, FALSE,
+                                           NULL, NULL) == flow);
+    }
+    len = make_pkt_reverse(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_UDP);
+    g_assert_true(g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE, FALSE,
+                                       NULL, NULL) == flow);
+    g_inet_flow_table_stats_get(table, &stats);
+    g_assert_cmpuint(stats.cache_hits, ==, 10);
+    g_assert_cmpuint(stats.cache_misses, ==, 1);
+
+    /* A flow leaving the table leaves the cache */
+    g_assert_true(g_inet_flow_expire(table, now + 600 * 1000000ULL) == flow);
+    g_object_unref(flow);
+    len = make_flow_pkt(test_buffer, 1);
+    other = g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE, FALSE, NULL,
+                                 NULL);
+    g_assert_nonnull(other);
+    g_inet_flow_table_stats_get(table, &stats);
+    g_assert_cmpuint(stats.cache_misses, ==, 2);
+    g_assert_cmpuint(stats.created, ==, 2);
+
+    /* Without the cache every lookup goes to the hash */
+    g_inet_flow_table_cache_set(table, 0);
+    g_assert_true(g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE, FALSE,
+                                       NULL, NULL) == other);
+    g_inet_flow_table_stats_get(table, &stats);
+    g_assert_cmpuint(stats.cache_hits + stats.cache_misses, ==, 12);
+    g_inet_flow_table_cache_set(table, 16);
+    g_assert_true(g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE, FALSE,
+                                       NULL, NULL) == other);
+    g_assert_true(g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE, FALSE,
+                                       NULL, NULL) == other);
+    g_inet_flow_table_stats_get(table, &stats);
+    g_assert_cmpuint(stats.cache_hits, ==, 11);
+    g_assert_cmpuint(stats.cache_misses, ==, 3);
+    g_object_unref(table);
+    TEST_SPORT = _TEST_SPORT;
+}
+
+void test_flow_table_cuckoo()
+{
+    GInetFlowTable *table;
+    GInetFlowTableMemory memory;
+    GInetFlowTableStats stats;
+    guint64 now = 1000000;
+    GInetTuple tuple;
+    GInetFlow *flow;
+    guint len;
+    guint i;
+
+    setup_test();
+    table = g_inet_flow_table_new_full(1000, 1000, 0, 0, G_INET_FLOW_TABLE_CUCKOO);
+    for (i = 0; i < 1000; i++) {
+        len = make_flow_pkt(test_buffer, i);
+        g_assert_nonnull(g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE,
+                                              FALSE, NULL, NULL));
+    }
+    len = make_flow_pkt(test_buffer, 1000);
+    g_assert_null(g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE, FALSE,
+                                       NULL, NULL));
+    g_inet_flow_table_stats_get(table, &stats);
+    g_assert_cmpuint(stats.size, ==, 1000);
+    g_assert_cmpuint(stats.chain_max, <=, G_INET_HASH_SLOTS);
+    g_inet_flow_table_memory_get(table, &memory);
+    g_assert_cmpuint(memory.hash, <, 1000 * 13);
+    for (i = 0; i < 1000; i++) {
+        len = make_flow_pkt(test_buffer, i);
+        g_assert_nonnull(g_inet_flow_parse(test_buffer, len, NULL, &tuple, FALSE));
+        g_assert_nonnull(g_inet_flow_lookup(table, &tuple));
+    }
+    while ((flow = g_inet_flow_expire(table, now + 60 * 1000000ULL)))
+        g_object_unref(flow);
+    g_inet_flow_table_stats_get(table, &stats);
+    g_assert_cmpuint(stats.size, ==, 0);
+    g_object_unref(table);
+    TEST_SPORT = _TEST_SPORT;
+}
+
+void test_flow_ipv4_encap()
+{
+    GInetFlowTable *table;
+    GInetFlow *flow;
+
+    setup_test();
+    g_assert_nonnull((table = g_inet_flow_table_new()));
+
+    guint8 *p = build_hdr_ip(test_buffer, ETH_PROTOCOL_IP, IP_PROTOCOL_TCP, FALSE);
+    p = build_hdr_after_ip(p, IP_PROTOCOL_TCP, FALSE);
+    guint len = (guint) (p - test_buffer);
+
+    g_assert_nonnull((flow =
+                        g_inet_flow_get_full(table, test_buffer, len, 0, 0, TRUE, FALSE,
+                                             FALSE, NULL, NULL)));
+    g_object_unref(flow);
+    g_object_unref(table);
+}
+
+void test_flow_ipv6_encap()
 {
     GInetFlow *flow;
     GInetFlowTable *table;
@@ -1971,7 +3466,7 @@ void test_flow_bad_ip_version()
     p = build_hdr_after_ip(p, IP_PROTOCOL_TCP, FALSE);
     guint len = (guint) (p - test_buffer);
 
-    g_assert_false(flow_parse_ip(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, TRUE));
+    g_assert_false(flow_parse_ip(test_tuple, test_buffer, len, NULL, NULL, 0, NULL, NULL, TRUE));
 }
 
 void test_flow_parse_ipv4_fragment()
@@ -1982,7 +3477,7 @@ void test_flow_parse_ipv4_fragment()
 
     setup_test();
     g_assert_nonnull((table = g_inet_flow_table_new()));
-    g_assert(g_list_length(table->frag_info_list->head) == 0);
+    g_assert(g_inet_frag_list_length(table->frag_info_list) == 0);
 
     /* First IP fragment */
     p = build_hdr_eth(test_buffer, ETH_PROTOCOL_IP);
@@ -1991,7 +3486,7 @@ void test_flow_parse_ipv4_fragment()
     g_assert_nonnull((flow1 =
                         g_inet_flow_get_full(table, test_buffer, len, 0, 0, TRUE, TRUE,
                                              FALSE, NULL, NULL)));
-    g_assert(g_list_length(table->frag_info_list->head) == 1);
+    g_assert(g_inet_frag_list_length(table->frag_info_list) == 1);
 
     /* Second IP fragment */
     p = build_hdr_eth(test_buffer, ETH_PROTOCOL_IP);
@@ -2001,7 +3496,7 @@ void test_flow_parse_ipv4_fragment()
                         g_inet_flow_get_full(table, test_buffer, len, 0, 0, TRUE, TRUE,
                                              FALSE, NULL, NULL)));
     g_assert(flow1 == flow2);
-    g_assert(g_list_length(table->frag_info_list->head) == 1);
+    g_assert(g_inet_frag_list_length(table->frag_info_list) == 1);
 
     /* Last IP fragment */
     p = build_hdr_eth(test_buffer, ETH_PROTOCOL_IP);
@@ -2011,7 +3506,7 @@ void test_flow_parse_ipv4_fragment()
                         g_inet_flow_get_full(table, test_buffer, len, 0, 0, TRUE, TRUE,
                                              FALSE, NULL, NULL)));
     g_assert(flow1 == flow3);
-    g_assert(g_list_length(table->frag_info_list->head) == 0);
+    g_assert(g_inet_frag_list_length(table->frag_info_list) == 0);
 
     g_object_unref(flow1);
     g_object_unref(table);
@@ -2025,7 +3520,7 @@ void test_flow_parse_ipv6_fragment()
 
     setup_test();
     g_assert_nonnull((table = g_inet_flow_table_new()));
-    g_assert(g_list_length(table->frag_info_list->head) == 0);
+    g_assert(g_inet_frag_list_length(table->frag_info_list) == 0);
 
     /* First IP fragment */
     p = build_hdr_eth(test_buffer, ETH_PROTOCOL_IPV6);
@@ -2035,7 +3530,7 @@ void test_flow_parse_ipv6_fragment()
     g_assert_nonnull((flow1 =
                         g_inet_flow_get_full(table, test_buffer, len, 0, 0, TRUE, TRUE,
                                              FALSE, NULL, NULL)));
-    g_assert(g_list_length(table->frag_info_list->head) == 1);
+    g_assert(g_inet_frag_list_length(table->frag_info_list) == 1);
 
     /* Second IP fragment */
     p = build_hdr_eth(test_buffer, ETH_PROTOCOL_IPV6);
@@ -2045,7 +3540,7 @@ void test_flow_parse_ipv6_fragment()
                         g_inet_flow_get_full(table, test_buffer, len, 0, 0, TRUE, TRUE,
                                              FALSE, NULL, NULL)));
     g_assert(flow1 == flow2);
-    g_assert(g_list_length(table->frag_info_list->head) == 1);
+    g_assert(g_inet_frag_list_length(table->frag_info_list) == 1);
 
     /* Last IP fragment */
     p = build_hdr_eth(test_buffer, ETH_PROTOCOL_IPV6);
@@ -2055,12 +3550,105 @@ void test_flow_parse_ipv6_fragment()
                         g_inet_flow_get_full(table, test_buffer, len, 0, 0, TRUE, TRUE,
                                              FALSE, NULL, NULL)));
     g_assert(flow1 == flow3);
-    g_assert(g_list_length(table->frag_info_list->head) == 0);
+    g_assert(g_inet_frag_list_length(table->frag_info_list) == 0);
 
     g_object_unref(flow1);
     g_object_unref(table);
 }
 
+void test_flow_parse_ipv4_fragment_out_of_order()
+{
+    guint8 *p;
+    guint64 packets;
+    GInetFlow *flow1, *flow2;
+    GInetFlowTable *table;
+
+    setup_test();
+    g_assert_nonnull((table = g_inet_flow_table_new()));
+
+    /* Middle IP fragment - no ports yet so no flow */
+    p = build_hdr_eth(test_buffer, ETH_PROTOCOL_IP);
+    p = build_hdr_ip_fragment(p, ETH_PROTOCOL_IP, IP_PROTOCOL_UDP, FALSE, TRUE, 0xb9,
+                              0xbeef);
+    guint8 len = (guint) (p - test_buffer);
+    g_assert_null(g_inet_flow_get_full(table, test_buffer, len, 0, 0, TRUE, TRUE,
+                                       FALSE, NULL, NULL));
+    g_assert_cmpuint(g_inet_frag_list_pending(table->frag_info_list), ==, 1);
+    g_assert_cmpuint(g_inet_hash_size(table->flows), ==, 0);
+
+    /* First IP fragment - resolves the held fragment */
+    p = build_hdr_eth(test_buffer, ETH_PROTOCOL_IP);
+    p = build_hdr_ip_fragment(p, ETH_PROTOCOL_IP, IP_PROTOCOL_UDP, FALSE, TRUE, 0, 0xbeef);
+    g_assert_nonnull((flow1 =
+                        g_inet_flow_get_full(table, test_buffer, len, 0, 0, TRUE, TRUE,
+                                             FALSE, NULL, NULL)));
+    g_assert_cmpuint(g_inet_frag_list_pending(table->frag_info_list), ==, 0);
+    g_assert_cmpuint(g_inet_frag_list_length(table->frag_info_list), ==, 1);
+    g_object_get(flow1, "packets", &packets, NULL);
+    g_assert_cmpuint(packets, ==, 2);
+
+    /* Last IP fragment */
+    p = build_hdr_eth(test_buffer, ETH_PROTOCOL_IP);
+    p = build_hdr_ip_fragment(p, ETH_PROTOCOL_IP, IP_PROTOCOL_UDP, FALSE, FALSE, 0x172,
+                              0xbeef);
+    g_assert_nonnull((flow2 =
+                        g_inet_flow_get_full(table, test_buffer, len, 0, 0, TRUE, TRUE,
+                                             FALSE, NULL, NULL)));
+    g_assert(flow1 == flow2);
+    g_assert_cmpuint(g_inet_frag_list_length(table->frag_info_list), ==, 0);
+
+    g_object_unref(flow1);
+    g_object_unref(table);
+}
+
+void test_frag_list_pending_limits()
+{
+    GInetFragList *fragments = g_inet_frag_list_new();
+    GInetFragment entry = { 0 };
+
+    g_assert_nonnull(fragments);
+    g_inet_frag_list_pending_max_set(fragments, 4, 1000, 2);
+    ((struct sockaddr_in *) &entry.tuple.src)->sin_family = AF_INET;
+    ((struct sockaddr_in *) &entry.tuple.src)->sin_addr.s_addr = htonl(TEST_SADDR);
+    ((struct sockaddr_in *) &entry.tuple.dst)->sin_family = AF_INET;
+    ((struct sockaddr_in *) &entry.tuple.dst)->sin_addr.s_addr = htonl(TEST_DADDR);
+    entry.timestamp = 1;
+    entry.offset = 0xb9;
+    entry.bytes = 400;
+
+    /* Per source limit */
+    for (int i = 0; i < 3; i++) {
+        entry.id = i;
+        g_assert(!g_inet_frag_list_update(fragments, &entry, TRUE));
+    }
+    g_assert_cmpuint(g_inet_frag_list_pending(fragments), ==, 2);
+
+    /* Byte limit */
+    ((struct sockaddr_in *) &entry.tuple.src)->sin_addr.s_addr = htonl(TEST_DADDR);
+    ((struct sockaddr_in *) &entry.tuple.dst)->sin_addr.s_addr = htonl(TEST_SADDR);
+    entry.id = 3;
+    g_assert(!g_inet_frag_list_update(fragments, &entry, TRUE));
+    g_assert_cmpuint(g_inet_frag_list_pending(fragments), ==, 2);
+    entry.bytes = 200;
+    g_assert(!g_inet_frag_list_update(fragments, &entry, TRUE));
+    g_assert_cmpuint(g_inet_frag_list_pending(fragments), ==, 3);
+
+    /* Expiry releases the held fragments */
+    g_assert(g_inet_frag_list_expire(fragments, 1 + 60 * 1000000) == 3);
+    g_assert_cmpuint(g_inet_frag_list_pending(fragments), ==, 0);
+    g_assert_cmpuint(fragments->pending_bytes, ==, 0);
+    g_inet_frag_list_free(fragments);
+}
+
+static GInetFragment *first_frag_entry(GInetFragList * fragments)
+{
+    for (int i = 0; i < G_INET_FRAG_LIST_BUCKETS; i++) {
+        if (fragments->buckets[i].queue.head)
+            return fragments->buckets[i].queue.head->data;
+    }
+    return NULL;
+}
+
 void test_clear_expired_frag_info()
 {
     guint8 *p;
@@ -2070,7 +3658,7 @@ void test_clear_expired_frag_info()
 
     setup_test();
     g_assert_nonnull((table = g_inet_flow_table_new()));
-    g_assert(g_list_length(table->frag_info_list->head) == 0);
+    g_assert(g_inet_frag_list_length(table->frag_info_list) == 0);
 
     /* IP fragment 1 - expired */
     p = build_hdr_eth(test_buffer, ETH_PROTOCOL_IP);
@@ -2079,7 +3667,7 @@ void test_clear_expired_frag_info()
     g_assert_nonnull((flow1 =
                         g_inet_flow_get_full(table, test_buffer, len, 0, now - 50 * 1000000,
                                              TRUE, TRUE, FALSE, NULL, NULL)));
-    g_assert(g_list_length(table->frag_info_list->head) == 1);
+    g_assert(g_inet_frag_list_length(table->frag_info_list) == 1);
 
     /* IP fragment 2 - expired */
     p = build_hdr_eth(test_buffer, ETH_PROTOCOL_IP);
@@ -2087,7 +3675,7 @@ void test_clear_expired_frag_info()
     g_assert_nonnull((flow2 =
                         g_inet_flow_get_full(table, test_buffer, len, 0, now - 40 * 1000000,
                                              TRUE, TRUE, FALSE, NULL, NULL)));
-    g_assert(g_list_length(table->frag_info_list->head) == 2);
+    g_assert(g_inet_frag_list_length(table->frag_info_list) == 2);
 
     /* IP fragment 3 - not expired */
     p = build_hdr_eth(test_buffer, ETH_PROTOCOL_IP);
@@ -2095,20 +3683,224 @@ void test_clear_expired_frag_info()
     g_assert_nonnull((flow3 =
                         g_inet_flow_get_full(table, test_buffer, len, 0, now - 30 * 1000000,
                                              TRUE, TRUE, FALSE, NULL, NULL)));
-    g_assert(g_list_length(table->frag_info_list->head) == 3);
+    g_assert(g_inet_frag_list_length(table->frag_info_list) == 3);
 
-    g_assert(clear_expired_frag_info(table->frag_info_list, now) == 2);
-    g_assert(g_list_length(table->frag_info_list->head) == 1);
+    g_assert(g_inet_frag_list_expire(table->frag_info_list, now) == 2);
+    g_assert(g_inet_frag_list_length(table->frag_info_list) == 1);
 
-    GInetFragment *non_expired = (g_list_first(table->frag_info_list->head))->data;
+    GInetFragment *non_expired = first_frag_entry(table->frag_info_list);
     g_assert(non_expired->id == 0x3333);
 
     /* Do proper clean up */
-    clear_expired_frag_info(table->frag_info_list, now + 1000000);
+    g_inet_frag_list_expire(table->frag_info_list, now + 1000000);
     g_object_unref(flow1);
     g_object_unref(table);
 }
 
+void test_flow_expire_frag_info()
+{
+    guint8 *p;
+    GInetFlow *flow;
+    GInetFlowTable *table;
+    guint64 now = get_time_us();
+    guint64 expiry, stored, matched, expired, dropped, depth;
+
+    setup_test();
+    g_assert_nonnull((table = g_inet_flow_table_new()));
+    g_inet_flow_table_frag_expiry_set(table, 5);
+
+    /* First IP fragment */
+    p = build_hdr_eth(test_buffer, ETH_PROTOCOL_IP);
+    p = build_hdr_ip_fragment(p, ETH_PROTOCOL_IP, IP_PROTOCOL_UDP, FALSE, TRUE, 0, 0x1111);
+    guint8 len = (guint) (p - test_buffer);
+    g_assert_nonnull((flow =
+                        g_inet_flow_get_full(table, test_buffer, len, 0, now - 10 * 1000000,
+                                             TRUE, TRUE, FALSE, NULL, NULL)));
+
+    /* Second IP fragment */
+    p = build_hdr_eth(test_buffer, ETH_PROTOCOL_IP);
+    p = build_hdr_ip_fragment(p, ETH_PROTOCOL_IP, IP_PROTOCOL_UDP, FALSE, TRUE, 0xb9,
+                              0x1111);
+    g_assert(flow == g_inet_flow_get_full(table, test_buffer, len, 0, now - 9 * 1000000,
+                                          TRUE, TRUE, FALSE, NULL, NULL));
+
+    /* Recent IP fragment of another datagram */
+    p = build_hdr_eth(test_buffer, ETH_PROTOCOL_IP);
+    p = build_hdr_ip_fragment(p, ETH_PROTOCOL_IP, IP_PROTOCOL_UDP, FALSE, TRUE, 0, 0x2222);
+    g_assert(flow == g_inet_flow_get_full(table, test_buffer, len, 0, now - 1 * 1000000,
+                                          TRUE, TRUE, FALSE, NULL, NULL));
+
+    /* The last fragment never arrives - aged out by the flow timer */
+    g_assert_null(g_inet_flow_expire(table, now));
+    g_object_get(table, "frag-expiry", &expiry, "frag-stored", &stored,
+                 "frag-matched", &matched, "frag-expired", &expired,
+                 "frag-dropped", &dropped, "frag-depth", &depth, NULL);
+    g_assert_cmpuint(expiry, ==, 5);
+    g_assert_cmpuint(stored, ==, 2);
+    g_assert_cmpuint(matched, ==, 1);
+    g_assert_cmpuint(expired, ==, 1);
+    g_assert_cmpuint(dropped, ==, 0);
+    g_assert_cmpuint(depth, ==, 1);
+
+    g_object_unref(flow);
+    g_object_unref(table);
+}
+
+void test_flow_expire_frag_info_now()
+{
+    guint8 *p;
+    GInetFlow *flow;
+    GInetFlowTable *table;
+    guint64 expired, depth;
+
+    setup_test();
+    g_assert_nonnull((table = g_inet_flow_table_new()));
+
+    /* Stored without a timestamp, so on the flow clock */
+    p = build_hdr_eth(test_buffer, ETH_PROTOCOL_IP);
+    p = build_hdr_ip_fragment(p, ETH_PROTOCOL_IP, IP_PROTOCOL_UDP, FALSE, TRUE, 0, 0x1111);
+    guint8 len = (guint) (p - test_buffer);
+    g_assert_nonnull((flow =
+                        g_inet_flow_get_full(table, test_buffer, len, 0, 0, TRUE, TRUE, FALSE,
+                                             NULL, NULL)));
+    g_assert_cmpuint(g_inet_frag_list_length(table->frag_info_list), ==, 1);
+
+    g_inet_flow_expire(table, get_time_us() + 120 * 1000000);
+    g_object_get(table, "frag-expired", &expired, "frag-depth", &depth, NULL);
+    g_assert_cmpuint(expired, ==, 1);
+    g_assert_cmpuint(depth, ==, 0);
+
+    g_object_unref(flow);
+    g_object_unref(table);
+}
+
+void test_flow_table_frag_capacity()
+{
+    GInetFlowTable *table;
+    guint64 now = get_time_us();
+    guint64 stored, dropped, depth;
+    guint8 *p;
+    guint len;
+    guint i, n;
+
+    setup_test();
+    for (n = 0; n < 2; n++) {
+        /* The default list holds 128 datagrams, a larger capacity more */
+        table = n ? g_inet_flow_table_new_full(0, 0, 0, 512, G_INET_FLOW_TABLE_DEFAULT) :
+            g_inet_flow_table_new();
+        for (i = 0; i < 200; i++) {
+            p = build_hdr_eth(test_buffer, ETH_PROTOCOL_IP);
+            p = build_hdr_ip_fragment(p, ETH_PROTOCOL_IP, IP_PROTOCOL_UDP, FALSE, TRUE, 0,
+                                      0x1000 + i);
+            len = (guint) (p - test_buffer);
+            g_inet_flow_get_full(table, test_buffer, len, 0, now, TRUE, TRUE, FALSE, NULL,
+                                 NULL);
+        }
+        g_object_get(table, "frag-stored", &stored, "frag-dropped", &dropped,
+                     "frag-depth", &depth, NULL);
+        g_assert_cmpuint(stored, ==, n ? 200 : 128);
+        g_assert_cmpuint(dropped, ==, n ? 0 : 72);
+        g_assert_cmpuint(depth, ==, stored);
+        g_object_unref(table);
+    }
+}
+
+#define FRAG_THREADS    8
+#define FRAG_IDS        64
+
+static gpointer frag_thread_func(gpointer data)
+{
+    GInetFragList *fragments = (GInetFragList *) data;
+
+    for (int i = 0; i < FRAG_IDS; i++) {
+        GInetFragment entry = { 0 };
+        entry.id = i;
+        entry.timestamp = 1;
+        ((struct sockaddr_in *) &entry.tuple.src)->sin_family = AF_INET;
+        ((struct sockaddr_in *) &entry.tuple.src)->sin_addr.s_addr = htonl(TEST_SADDR);
+        ((struct sockaddr_in *) &entry.tuple.src)->sin_port = htons(TEST_SPORT);
+        ((struct sockaddr_in *) &entry.tuple.dst)->sin_family = AF_INET;
+        ((struct sockaddr_in *) &entry.tuple.dst)->sin_addr.s_addr = htonl(TEST_DADDR);
+        ((struct sockaddr_in *) &entry.tuple.dst)->sin_port = htons(TEST_DPORT);
+        g_assert(g_inet_frag_list_update(fragments, &entry, TRUE));
+    }
+    return NULL;
+}
+
+void test_frag_list_threads()
+{
+    GInetFragList *fragments = g_inet_frag_list_new();
+    GThread *threads[FRAG_THREADS];
+
+    g_assert_nonnull(fragments);
+    for (int i = 0; i < FRAG_THREADS; i++)
+        threads[i] = g_thread_new("frag", frag_thread_func, fragments);
+    for (int i = 0; i < FRAG_THREADS; i++)
+        g_thread_join(threads[i]);
+
+    /* Each first fragment is only stored once regardless of how many threads saw it */
+    g_assert_cmpuint(g_inet_frag_list_length(fragments), ==, FRAG_IDS);
+
+    /* Last fragments (without ports) pick up the stored ports and remove the entry */
+    for (int i = 0; i < FRAG_IDS; i++) {
+        GInetFragment entry = { 0 };
+        entry.id = i;
+        entry.timestamp = 1;
+        ((struct sockaddr_in *) &entry.tuple.src)->sin_family = AF_INET;
+        ((struct sockaddr_in *) &entry.tuple.src)->sin_addr.s_addr = htonl(TEST_SADDR);
+        ((struct sockaddr_in *) &entry.tuple.dst)->sin_family = AF_INET;
+        ((struct sockaddr_in *) &entry.tuple.dst)->sin_addr.s_addr = htonl(TEST_DADDR);
+        g_assert(g_inet_frag_list_update(fragments, &entry, FALSE));
+        g_assert_cmpuint(g_inet_tuple_get_src_port(&entry.tuple), ==, htons(TEST_SPORT));
+        g_assert_cmpuint(g_inet_tuple_get_dst_port(&entry.tuple), ==, htons(TEST_DPORT));
+    }
+    g_assert_cmpuint(g_inet_frag_list_length(fragments), ==, 0);
+    g_inet_frag_list_free(fragments);
+}
+
+#define FRAG_DEPTH      16
+
+static gpointer frag_depth_thread_func(gpointer data)
+{
+    GInetFragList *fragments = (GInetFragList *) data;
+    static gint thread_ids;
+    guint base = g_atomic_int_add(&thread_ids, 1) * FRAG_IDS;
+
+    /* Each store finds the list full of entries it can age out */
+    for (int i = 0; i < FRAG_IDS; i++) {
+        GInetFragment entry = { 0 };
+        entry.id = base + i;
+        entry.timestamp = 1 + (guint64) i * 60 * 1000000;
+        ((struct sockaddr_in *) &entry.tuple.src)->sin_family = AF_INET;
+        ((struct sockaddr_in *) &entry.tuple.src)->sin_addr.s_addr = htonl(TEST_SADDR);
+        ((struct sockaddr_in *) &entry.tuple.dst)->sin_family = AF_INET;
+        ((struct sockaddr_in *) &entry.tuple.dst)->sin_addr.s_addr = htonl(TEST_DADDR);
+        g_inet_frag_list_update(fragments, &entry, TRUE);
+        g_assert_cmpuint(g_inet_frag_list_length(fragments), <=, FRAG_DEPTH);
+    }
+    return NULL;
+}
+
+void test_frag_list_threads_depth()
+{
+    GInetFragList *fragments = g_inet_frag_list_new();
+    GThread *threads[FRAG_THREADS];
+    GInetFragStats stats;
+
+    g_assert_nonnull(fragments);
+    g_inet_frag_list_depth_max_set(fragments, FRAG_DEPTH);
+    for (int i = 0; i < FRAG_THREADS; i++)
+        threads[i] = g_thread_new("frag", frag_depth_thread_func, fragments);
+    for (int i = 0; i < FRAG_THREADS; i++)
+        g_thread_join(threads[i]);
+
+    /* Concurrent stores never take the list past its depth */
+    g_inet_frag_list_stats_get(fragments, &stats);
+    g_assert_cmpuint(stats.depth, <=, FRAG_DEPTH);
+    g_assert_cmpuint(stats.stored, ==, stats.depth + stats.expired);
+    g_inet_frag_list_free(fragments);
+}
+
 void test_flow_expiry_queue()
 {
     guint64 now = get_time_us();
@@ -2319,6 +4111,7 @@ int main (int argc, char *argv[])
     g_test_add_func ("/flow/parse/less/eth/length", test_flow_parse_less_than_eth_length);
     g_test_add_func ("/flow/parse/udp", test_flow_parse_udp);
     g_test_add_func ("/flow/parse/tcp", test_flow_parse_tcp);
+    g_test_add_func ("/flow/parse/canonical", test_flow_parse_canonical);
     g_test_add_func ("/flow/parse/icmp", test_flow_parse_icmp);
     g_test_add_func ("/flow/parse/pppoe", test_flow_parse_pppoe);
     g_test_add_func ("/flow/parse/vlan", test_flow_parse_vlan);
@@ -2351,6 +4144,32 @@ int main (int argc, char *argv[])
     g_test_add_func ("/flow/create", test_flow_create);
     g_test_add_func ("/flow/create/many", test_flow_create_many);
     g_test_add_func ("/flow/table/size", test_flow_table_size);
+    g_test_add_func ("/flow/table/memory", test_flow_table_memory);
+    g_test_add_func ("/flow/table/latency", test_flow_table_latency);
+    g_test_add_func ("/flow/table/stats", test_flow_table_stats);
+    g_test_add_func ("/flow/table/stats/switch", test_flow_table_stats_switch);
+    g_test_add_func ("/flow/probes", test_flow_probes);
+    g_test_add_func ("/histogram/percentile", test_histogram_percentile);
+    g_test_add_func ("/hash/resize", test_hash_resize);
+    g_test_add_func ("/hash/tags", test_hash_tags);
+    g_test_add_func ("/hash/cuckoo", test_hash_cuckoo);
+    g_test_add_func ("/hash/cuckoo/same", test_hash_cuckoo_same);
+    g_test_add_func ("/flow/table/new_full", test_flow_table_new_full);
+    g_test_add_func ("/flow/table/hugepages", test_flow_table_hugepages);
+    g_test_add_func ("/flow/table/numa", test_flow_table_numa);
+    g_test_add_func ("/filter/flood", test_filter_flood);
+    g_test_add_func ("/flow/table/admission", test_flow_table_admission);
+    g_test_add_func ("/flow/table/state_max", test_flow_table_state_max);
+    g_test_add_func ("/flow/table/state_max/again", test_flow_table_state_max_again);
+    g_test_add_func ("/flow/table/state_max/reopen", test_flow_table_state_max_reopen);
+    g_test_add_func ("/limit/subnet", test_limit_subnet);
+    g_test_add_func ("/flow/table/source_limit", test_flow_table_source_limit);
+    g_test_add_func ("/flow/table/sample", test_flow_table_sample);
+    g_test_add_func ("/flow/table/top", test_flow_table_top);
+    g_test_add_func ("/sketch/heap", test_sketch_heap);
+    g_test_add_func ("/flow/lookup/rekey", test_flow_lookup_rekey);
+    g_test_add_func ("/flow/table/cache", test_flow_table_cache);
+    g_test_add_func ("/flow/table/cuckoo", test_flow_table_cuckoo);
     g_test_add_func ("/flow/not_expired", test_flow_not_expired);
     g_test_add_func ("/flow/expired", test_flow_expired);
     g_test_add_func ("/flow/expired/no_unref", test_flow_expired_no_unref);
@@ -2364,12 +4183,22 @@ int main (int argc, char *argv[])
     g_test_add_func ("/flow/tcp/state/syn_timeout", test_flow_tcp_state_syn_timeout);
     g_test_add_func ("/flow/tcp/state/syn_synack_timeout", test_flow_tcp_state_syn_synack_timeout);
     g_test_add_func ("/flow/tcp/state/fin_timeout", test_flow_tcp_state_fin_timeout);
+    g_test_add_func ("/flow/tcp/state/teardown", test_flow_tcp_state_teardown);
+    g_test_add_func ("/flow/tcp/state/midstream", test_flow_tcp_state_midstream);
+    g_test_add_func ("/flow/tcp/state/same_ports", test_flow_tcp_state_same_ports);
     g_test_add_func ("/flow/ipv4_encap", test_flow_ipv4_encap);
     g_test_add_func ("/flow/ipv6_encap", test_flow_ipv6_encap);
     g_test_add_func ("/flow/bad/ip_version", test_flow_bad_ip_version);
     g_test_add_func ("/flow/parse/ipv4/fragment", test_flow_parse_ipv4_fragment);
     g_test_add_func ("/flow/parse/ipv6/fragment", test_flow_parse_ipv6_fragment);
+    g_test_add_func ("/flow/parse/ipv4/fragment/out_of_order", test_flow_parse_ipv4_fragment_out_of_order);
     g_test_add_func ("/clear/expired_frag_info", test_clear_expired_frag_info);
+    g_test_add_func ("/flow/expire/frag_info", test_flow_expire_frag_info);
+    g_test_add_func ("/flow/expire/frag_info/now", test_flow_expire_frag_info_now);
+    g_test_add_func ("/flow/table/frag_capacity", test_flow_table_frag_capacity);
+    g_test_add_func ("/frag/list/threads", test_frag_list_threads);
+    g_test_add_func ("/frag/list/threads/depth", test_frag_list_threads_depth);
+    g_test_add_func ("/frag/list/pending_limits", test_frag_list_pending_limits);
     g_test_add_func ("/flow/expiry/queue", test_flow_expiry_queue);
     g_test_add_func ("/flow/match/udp", test_flow_match_udp);
     g_test_add_func ("/flow/match/udp6", test_flow_match_udp6);